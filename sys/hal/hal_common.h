@@ -35,11 +35,42 @@ extern "C" {
 
 // Various common architecture HAL support functions.
 typedef struct _HAL_BOOT_INFO HAL_BOOT_INFO;
+typedef struct _HAL_MEM_RANGE HAL_MEM_RANGE;
+
+// Defined by the kernel in krn_cpu.h.
+typedef struct _KRN_CPU_DATA KRN_CPU_DATA;
+
+#define HAL_MEM_RANGE_AVAILABLE     1   // Usable RAM.
+#define HAL_MEM_RANGE_RESERVED      2   // Firmware, ACPI, bad RAM, etc.
+#define HAL_MEM_RANGE_BOOT          3   // Loaded image and boot structures.
+
+// 
+// Physical memory ranges may overlap.  Anything not AVAILABLE wins over an
+// AVAILABLE range covering the same pages.
+// 
+struct _HAL_MEM_RANGE
+{
+    uint64_t Base;
+    uint64_t Length;
+    uint32_t Type;
+};
 
 struct _HAL_BOOT_INFO
 {
     const char* pOptions;
     const char* pBootDevId;
+    
+    // Physical memory layout.
+    const HAL_MEM_RANGE* pMemRanges;
+    uint32_t MemRangeCount;
+    
+    // Physical memory [0, MappedLength) is mapped at MappedBaseVa.
+    uintptr_t MappedBaseVa;
+    size_t MappedLength;
+    
+    // Kernel address space nothing else uses, for Mem_Kva*.
+    uintptr_t KernelVaBase;
+    size_t KernelVaLength;
 };
 
 const HAL_BOOT_INFO*
@@ -47,6 +78,129 @@ OSCALL
 Hal_BootInfoGet(
     );
 
+// 
+// The kernel's data for the CPU this runs on.  Inline, so per-CPU fast paths
+// pay no call: GS is based at the x86 CPU block, whose first word points to
+// the block itself.  The host tests stand threads in for CPUs and supply
+// their own.
+// 
+#define HAL_CPU_DATA_OFFSET     0x100   // Of KRN_CPU_DATA in the CPU block.
+
+#if defined(HAL_HOST_TEST)
+
+KRN_CPU_DATA*
+OSCALL
+Hal_GetCpuData(
+    );
+
+#else
+
+KRN_INLINE
+KRN_CPU_DATA*
+OSCALL
+Hal_GetCpuData(
+    )
+{
+    uintptr_t block;
+    
+    __asm__ __volatile__ ("movl %%gs:0, %0" : "=r" (block));
+    
+    return (KRN_CPU_DATA*) (block + HAL_CPU_DATA_OFFSET);
+}
+
+#endif
+
+// Returns the previous interrupt state for Hal_InterruptsRestore.
+uint32_t
+OSCALL
+Hal_InterruptsDisable(
+    );
+
+void
+OSCALL
+Hal_InterruptsRestore(
+    uint32_t State
+    );
+
+// 
+// Kernel mappings, shared by every address space.  Flags are MEM_FLAGS_*.
+// Page tables are allocated on demand and stay, so kernel PDEs never change
+// once present.  Mapping over a present entry fails.
+// 
+KRN_ERROR_CODE
+OSCALL
+Hal_MapPage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapPage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    );
+
+// Va and Pa must be HAL_LARGE_PAGE_SIZE aligned.
+#define HAL_LARGE_PAGE_SIZE         (4*1024*1024)
+
+KRN_ERROR_CODE
+OSCALL
+Hal_MapLargePage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapLargePage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    );
+
+// 
+// Geometry of the last level cache, for page coloring.  All zero when the
+// CPU does not report it, Ways is zero for a fully associative cache.
+// 
+typedef struct _HAL_CACHE_INFO
+{
+    uint32_t Size;
+    uint32_t Ways;
+    uint32_t LineSize;
+} HAL_CACHE_INFO;
+
+void
+OSCALL
+Hal_CacheInfoGet(
+    HAL_CACHE_INFO* pInfo
+    );
+
+// 
+// CPUs running the kernel.  Unmapping a page only invalidates the calling
+// CPU's TLB, there is no shootdown yet, so code unmapping pages other CPUs
+// may be using checks this.
+// 
+uint32_t
+OSCALL
+Hal_CpuCount(
+    );
+
+// Optional CPU features the kernel can use.
+#define HAL_CPU_FEATURE_NT_STORE    0x00000001  // movnti and sfence.
+
+uint32_t
+OSCALL
+Hal_CpuFeaturesGet(
+    );
+
+// Free running cycle counter, not synchronized between CPUs.
+uint64_t
+OSCALL
+Hal_TimestampGet(
+    );
+
 int
 OSCALL
 Hal_conprintf(
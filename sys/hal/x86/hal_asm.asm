@@ -45,6 +45,15 @@ global Halx86_outw
 global Halx86_outdw
 global Halx86_sti
 global Halx86_cli
+global Halx86_hlt
+global Hal_TimestampGet
+global Halx86_ReadCr2
+global Halx86_ReadCr4
+global Halx86_WriteCr4
+global Halx86_Invlpg
+global Halx86_Cpuid
+global Hal_InterruptsDisable
+global Hal_InterruptsRestore
 global Halx86_InitIdt
 
 SECTION .boot
@@ -156,6 +165,70 @@ Halx86_cli:
     cli
     ret
 
+Halx86_hlt:
+    hlt
+    ret
+
+; The 64 bit result is returned in edx:eax, which is where rdtsc leaves it.
+Hal_TimestampGet:
+    rdtsc
+    ret
+
+Halx86_ReadCr2:
+    mov     eax, cr2
+    ret
+
+Halx86_ReadCr4:
+    mov     eax, cr4
+    ret
+
+Halx86_WriteCr4:
+    mov     eax, [esp+4]
+    mov     cr4, eax
+    ret
+
+Halx86_Invlpg:
+    mov     eax, [esp+4]
+    invlpg  [eax]
+    ret
+
+Halx86_Cpuid:
+    ; Prologue.
+    push    ebp
+    mov     ebp, esp
+    push    ebx
+    push    edi
+    
+    ; Body
+    mov     eax, [ebp+8]
+    mov     ecx, [ebp+12]
+    cpuid
+    mov     edi, [ebp+16]
+    mov     [edi], eax
+    mov     [edi+4], ebx
+    mov     [edi+8], ecx
+    mov     [edi+12], edx
+    
+    ; Epilogue.
+    pop     edi
+    pop     ebx
+    leave
+    ret
+
+Hal_InterruptsDisable:
+    pushfd
+    pop     eax
+    and     eax, 0x00000200     ; Previous IF.
+    cli
+    ret
+
+Hal_InterruptsRestore:
+    test    dword [esp+4], 0x00000200
+    jz      Hal_InterruptsRestore_0
+    sti
+Hal_InterruptsRestore_0:
+    ret
+
 HalIsr_LoadEntry:
     ; ecx = ISR address.
     ; edx = [Flags]:[ISR Index]
@@ -187,12 +260,10 @@ Halx86_InitIdt:
     pushad
     
     ; Zero the IDT_TABLE.
-    mov     ecx, HAL_IDT_TABLE_LEN
-    mov     eax, HAL_IDT_TABLE
-Halx86_InitIdt_0:
-    mov     byte [eax], 0
-    dec     ecx
-    jnz     Halx86_InitIdt_0
+    mov     ecx, HAL_IDT_TABLE_LEN / 4
+    mov     edi, HAL_IDT_TABLE
+    xor     eax, eax
+    rep stosd
     
     ; Setup the IDT to point at the table.
     mov     eax, HAL_IDT_TABLE_LEN-1
@@ -386,6 +457,10 @@ endstruc
 HalIsr_Generic:
     pushad
     
+    ; The C code expects DF clear, but we may have interrupted a backward
+    ; string copy.  iret restores the interrupted code's flags.
+    cld
+    
     mov     ax, gs
     push    ax
     mov     ax, fs
@@ -32,13 +32,14 @@ Halx86_CpuInitialize:
     ;   eax = CPU block base.
     ;   ebp = return address.
     
-    ; Clear the entire block.
-    mov     ecx, HAL_CPU_BLOCK_SIZE
-    
-Halx86_CpuInitialize_clear:
-    mov     byte [eax], 0
-    dec     ecx
-    jnz     Halx86_CpuInitialize_clear
+    ; Clear the entire block, a dword at a time.
+    mov     edx, eax
+    mov     edi, eax
+    xor     eax, eax
+    mov     ecx, HAL_CPU_BLOCK_SIZE / 4
+    cld
+    rep stosd
+    mov     eax, edx
     
     ; Setup the self-pointer (so we can find it from the GS).
     mov     [eax], eax
@@ -25,11 +25,25 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <krn_base.h>
+#include <krn_counter.h>
+#include <krn_epoch.h>
+#include <krn_mem.h>
+#include <krn_kva.h>
 #include <hal_common.h>
 #include "hal_x86.h"
 
 HALX86_MACHINE_INFO* g_pHalMachInfo = NULL;
 
+HAL_BOOT_INFO g_Hal_BootInfo = {0};
+HAL_MEM_RANGE g_Hal_MemRanges[HALX86_MAX_MEM_RANGES] = {{0}};
+char g_Hal_BootOptions[256] = {0};
+
+// Serializes kernel page directory and page table updates.
+KRN_SPINLOCK g_Halx86_PageLock = {0};
+
+// CPUID 0x80000006 associativity codes, 0 for fully associative.
+const uint8_t g_Halx86_CacheWays[16] = { 0, 1, 2, 0, 4, 0, 8, 0, 16, 0, 32, 48, 64, 96, 128, 0 };
+
 // This is in defined in x86/hal_common.c.
 void
 OSCALL
@@ -82,6 +96,421 @@ Hal_DumpIdtEntry(
 {
 }
 
+void
+OSCALL
+Halx86_InitBootInfo(
+    HALX86_MACHINE_INFO* pMachInfo
+    )
+{
+    HALX86_MULTIBOOT_INFO* pMultiBoot;
+    HAL_MEM_RANGE* pRanges;
+    uint32_t count;
+    
+    // Everything the loader hands us lives in memory we are about to give to
+    // the page allocator, so copy out what we need.
+    pMultiBoot = (HALX86_MULTIBOOT_INFO*) (HALX86_KERNEL_BASE_VA + (uintptr_t) pMachInfo->pMultiBoot);
+    pRanges = g_Hal_MemRanges;
+    count = 0;
+    
+    if (pMultiBoot->Flags & HALX86_MULTIBOOT_FLAG_MMAP)
+    {
+        uintptr_t offset;
+        
+        offset = 0;
+        while ((offset < pMultiBoot->MmapLength) &&
+               (count < (HALX86_MAX_MEM_RANGES - 1)))
+        {
+            HALX86_MULTIBOOT_MMAP_ENTRY* pEntry;
+            
+            pEntry = (HALX86_MULTIBOOT_MMAP_ENTRY*) (HALX86_KERNEL_BASE_VA + pMultiBoot->MmapAddress + offset);
+            
+            pRanges[count].Base = pEntry->BaseAddress;
+            pRanges[count].Length = pEntry->Length;
+            pRanges[count].Type = HAL_MEM_RANGE_RESERVED;
+            
+            if (pEntry->Type == HALX86_MULTIBOOT_MMAP_AVAILABLE)
+            {
+                pRanges[count].Type = HAL_MEM_RANGE_AVAILABLE;
+            }
+            
+            count++;
+            offset += pEntry->Size + sizeof(pEntry->Size);
+        }
+    }
+    else if (pMultiBoot->Flags & HALX86_MULTIBOOT_FLAG_MEM)
+    {
+        // No map, just the sizes (in KB) of low memory and memory above 1 MB.
+        pRanges[count].Base = 0;
+        pRanges[count].Length = pMultiBoot->MemLower * 1024ULL;
+        pRanges[count].Type = HAL_MEM_RANGE_AVAILABLE;
+        count++;
+        
+        pRanges[count].Base = 0x00100000;
+        pRanges[count].Length = pMultiBoot->MemUpper * 1024ULL;
+        pRanges[count].Type = HAL_MEM_RANGE_AVAILABLE;
+        count++;
+    }
+    
+    // The low 1 MB holds the boot page tables, CPU blocks, IDT and boot stack,
+    // and the image follows it.
+    pRanges[count].Base = 0;
+    pRanges[count].Length = (uintptr_t) g_Krn_ImageEnd - HALX86_KERNEL_BASE_VA;
+    pRanges[count].Type = HAL_MEM_RANGE_BOOT;
+    count++;
+    
+    if (pMultiBoot->Flags & HALX86_MULTIBOOT_FLAG_CMDLINE)
+    {
+        const char* pCmdLine;
+        uint32_t i;
+        
+        pCmdLine = (const char*) (HALX86_KERNEL_BASE_VA + pMultiBoot->CmdLine);
+        
+        for (i = 0; (i < (sizeof(g_Hal_BootOptions) - 1)) && pCmdLine[i]; i++)
+        {
+            g_Hal_BootOptions[i] = pCmdLine[i];
+        }
+        
+        g_Hal_BootInfo.pOptions = g_Hal_BootOptions;
+    }
+    
+    g_Hal_BootInfo.pMemRanges = pRanges;
+    g_Hal_BootInfo.MemRangeCount = count;
+    g_Hal_BootInfo.MappedBaseVa = HALX86_KERNEL_BASE_VA;
+    g_Hal_BootInfo.MappedLength = HALX86_BOOT_MAPPED_LENGTH;
+    
+    // The rest of the kernel half, up to 4 GB.
+    g_Hal_BootInfo.KernelVaBase = HALX86_KERNEL_BASE_VA + HALX86_BOOT_MAPPED_LENGTH;
+    g_Hal_BootInfo.KernelVaLength = 0 - g_Hal_BootInfo.KernelVaBase;
+}
+
+const HAL_BOOT_INFO*
+OSCALL
+Hal_BootInfoGet(
+    )
+{
+    return &g_Hal_BootInfo;
+}
+
+// The application processors are not started yet.
+uint32_t
+OSCALL
+Hal_CpuCount(
+    )
+{
+    return 1;
+}
+
+uint32_t
+OSCALL
+Hal_CpuFeaturesGet(
+    )
+{
+    uint32_t regs[4];
+    uint32_t features;
+    
+    features = 0;
+    
+    Halx86_Cpuid(HALX86_CPUID_FEATURES, 0, regs);
+    if (regs[3] & HALX86_CPUID_EDX_SSE2)
+    {
+        features |= HAL_CPU_FEATURE_NT_STORE;
+    }
+    
+    return features;
+}
+
+void
+OSCALL
+Hal_CacheInfoGet(
+    HAL_CACHE_INFO* pInfo
+    )
+{
+    uint32_t regs[4];
+    uint32_t maxLeaf;
+    uint32_t size;
+    uint32_t i;
+    
+    pInfo->Size = 0;
+    pInfo->Ways = 0;
+    pInfo->LineSize = 0;
+    
+    // Every CPU we boot on has CPUID, like PSE.
+    Halx86_Cpuid(0, 0, regs);
+    maxLeaf = regs[0];
+    
+    // Intel lists every cache, keep the largest data or unified one.  AMD
+    // returns no caches here.
+    if (maxLeaf >= HALX86_CPUID_CACHE_PARAMS)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            Halx86_Cpuid(HALX86_CPUID_CACHE_PARAMS, i, regs);
+            
+            if ((regs[0] & 0x1F) == 0)
+            {
+                break;
+            }
+            
+            // Skip instruction caches.
+            if ((regs[0] & 0x1F) == 2)
+            {
+                continue;
+            }
+            
+            // Ways * partitions * line size * sets.
+            size = (((regs[1] >> 22) & 0x3FF) + 1) *
+                   (((regs[1] >> 12) & 0x3FF) + 1) *
+                   ((regs[1] & 0xFFF) + 1) *
+                   (regs[2] + 1);
+            
+            if (size > pInfo->Size)
+            {
+                pInfo->Size = size;
+                pInfo->Ways = (regs[0] & 0x200) ? 0 : ((regs[1] >> 22) & 0x3FF) + 1;
+                pInfo->LineSize = (regs[1] & 0xFFF) + 1;
+            }
+        }
+    }
+    
+    if (pInfo->Size)
+    {
+        return;
+    }
+    
+    Halx86_Cpuid(HALX86_CPUID_EXT_MAX, 0, regs);
+    if (regs[0] < HALX86_CPUID_EXT_L2_L3)
+    {
+        return;
+    }
+    
+    // L3 in edx, in 512 KB units, else L2 in ecx, in KB.
+    Halx86_Cpuid(HALX86_CPUID_EXT_L2_L3, 0, regs);
+    if ((regs[3] >> 18) &&
+        ((regs[3] >> 12) & 0xF))
+    {
+        pInfo->Size = (regs[3] >> 18) * 512 * 1024;
+        pInfo->Ways = g_Halx86_CacheWays[(regs[3] >> 12) & 0xF];
+        pInfo->LineSize = regs[3] & 0xFF;
+    }
+    else if ((regs[2] >> 16) &&
+             ((regs[2] >> 12) & 0xF))
+    {
+        pInfo->Size = (regs[2] >> 16) * 1024;
+        pInfo->Ways = g_Halx86_CacheWays[(regs[2] >> 12) & 0xF];
+        pInfo->LineSize = regs[2] & 0xFF;
+    }
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_MapPage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    )
+{
+    uint32_t* pPde;
+    uint32_t* pPte;
+    uintptr_t tablePa;
+    uint32_t intState;
+    uint32_t pte;
+    
+    if ((Va & (MEM_PAGE_SIZE - 1)) ||
+        (Pa & (MEM_PAGE_SIZE - 1)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPde = (uint32_t*) (HALX86_KERNEL_BASE_VA + HALX86_KERNEL_PDE_PA);
+    pPde += Va >> HALX86_LARGE_PAGE_SHIFT;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&g_Halx86_PageLock);
+    
+    // Page tables have to be in the boot mapping for us to fill them in.
+    if ((*pPde & HALX86_PDE_FLAG_PRESENT) == 0)
+    {
+        if (Mem_PagesAlloc(
+                1,
+                MEM_TYPE_PAGE_TABLE | MEM_OPTS_ZERO | MEM_OPTS_SYS_CRITICAL,
+                &tablePa) != KRN_ERR_SUCCESS)
+        {
+            Krn_SpinLockRelease(&g_Halx86_PageLock);
+            Hal_InterruptsRestore(intState);
+            return KRN_ERR_NOT_ENOUGH_MEM;
+        }
+        
+        *pPde = tablePa | HALX86_PDE_FLAG_PRESENT | HALX86_PDE_FLAG_RW;
+    }
+    
+    if (*pPde & HALX86_PDE_FLAG_4MB)
+    {
+        Krn_SpinLockRelease(&g_Halx86_PageLock);
+        Hal_InterruptsRestore(intState);
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPte = Mem_PagesPaToVa(*pPde & HALX86_PDE_MASK_PTE_BASE);
+    pPte += (Va >> MEM_PAGE_SHIFT) & (HALX86_PTES_PER_TABLE - 1);
+    
+    if (*pPte & HALX86_PTE_FLAG_PRESENT)
+    {
+        Krn_SpinLockRelease(&g_Halx86_PageLock);
+        Hal_InterruptsRestore(intState);
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pte = Pa | HALX86_PTE_FLAG_PRESENT;
+    if (Flags & MEM_FLAGS_WRITE)
+    {
+        pte |= HALX86_PTE_FLAG_RW;
+    }
+    
+    // Not present entries are never cached, no flush needed.
+    *pPte = pte;
+    
+    Krn_SpinLockRelease(&g_Halx86_PageLock);
+    Hal_InterruptsRestore(intState);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapPage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    )
+{
+    uint32_t* pPde;
+    uint32_t* pPte;
+    uint32_t intState;
+    KRN_ERROR_CODE status;
+    
+    *pPa = 0;
+    
+    if (Va & (MEM_PAGE_SIZE - 1))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPde = (uint32_t*) (HALX86_KERNEL_BASE_VA + HALX86_KERNEL_PDE_PA);
+    pPde += Va >> HALX86_LARGE_PAGE_SHIFT;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&g_Halx86_PageLock);
+    
+    status = KRN_ERR_INV_PARAMETER;
+    
+    if ((*pPde & (HALX86_PDE_FLAG_PRESENT | HALX86_PDE_FLAG_4MB)) == HALX86_PDE_FLAG_PRESENT)
+    {
+        pPte = Mem_PagesPaToVa(*pPde & HALX86_PDE_MASK_PTE_BASE);
+        pPte += (Va >> MEM_PAGE_SHIFT) & (HALX86_PTES_PER_TABLE - 1);
+        
+        if (*pPte & HALX86_PTE_FLAG_PRESENT)
+        {
+            *pPa = *pPte & HALX86_PTE_MASK_BASE_ADDR;
+            *pPte = 0;
+            Halx86_Invlpg(Va);
+            status = KRN_ERR_SUCCESS;
+        }
+    }
+    
+    Krn_SpinLockRelease(&g_Halx86_PageLock);
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_MapLargePage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    )
+{
+    uint32_t* pPde;
+    uint32_t intState;
+    uint32_t pde;
+    
+    if ((Va & (HAL_LARGE_PAGE_SIZE - 1)) ||
+        (Pa & (HAL_LARGE_PAGE_SIZE - 1)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPde = (uint32_t*) (HALX86_KERNEL_BASE_VA + HALX86_KERNEL_PDE_PA);
+    pPde += Va >> HALX86_LARGE_PAGE_SHIFT;
+    
+    pde = Pa | HALX86_PDE_FLAG_PRESENT | HALX86_PDE_FLAG_4MB;
+    if (Flags & MEM_FLAGS_WRITE)
+    {
+        pde |= HALX86_PDE_FLAG_RW;
+    }
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&g_Halx86_PageLock);
+    
+    // Don't silently replace a page table or another mapping.
+    if (*pPde & HALX86_PDE_FLAG_PRESENT)
+    {
+        Krn_SpinLockRelease(&g_Halx86_PageLock);
+        Hal_InterruptsRestore(intState);
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    *pPde = pde;
+    
+    Krn_SpinLockRelease(&g_Halx86_PageLock);
+    Hal_InterruptsRestore(intState);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapLargePage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    )
+{
+    uint32_t* pPde;
+    uint32_t intState;
+    KRN_ERROR_CODE status;
+    
+    *pPa = 0;
+    
+    if (Va & (HAL_LARGE_PAGE_SIZE - 1))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPde = (uint32_t*) (HALX86_KERNEL_BASE_VA + HALX86_KERNEL_PDE_PA);
+    pPde += Va >> HALX86_LARGE_PAGE_SHIFT;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&g_Halx86_PageLock);
+    
+    status = KRN_ERR_INV_PARAMETER;
+    
+    if ((*pPde & (HALX86_PDE_FLAG_PRESENT | HALX86_PDE_FLAG_4MB)) ==
+        (HALX86_PDE_FLAG_PRESENT | HALX86_PDE_FLAG_4MB))
+    {
+        *pPa = *pPde & HALX86_PDE_MASK_4MB_BASE;
+        *pPde = 0;
+        
+        // One invlpg drops the whole 4 MB entry.
+        Halx86_Invlpg(Va);
+        status = KRN_ERR_SUCCESS;
+    }
+    
+    Krn_SpinLockRelease(&g_Halx86_PageLock);
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
+
 void
 OSCALL
 Hal_KernelEntry(
@@ -112,6 +541,32 @@ Hal_KernelEntry(
     // TODO: Eventually, we can remove this, but it's a good unit test.
     Hal_TestDataStructures();
     
+    Halx86_InitBootInfo(pContext);
+    // Counters first, the allocator counts from its first page.
+    Krn_CounterInit();
+    Krn_CounterCpuInit();
+    Krn_BaseInit();
+    
+    Krn_EpochInit();
+    Krn_EpochCpuInit();
+    
+    // Every CPU we boot on has PSE, it dates back to the Pentium.
+    Halx86_WriteCr4(Halx86_ReadCr4() | HALX86_CR4_PSE);
+    
+    Hal_conprintf("Initializing page allocator\n");
+    if (Mem_PagesInit(Hal_BootInfoGet()) != KRN_ERR_SUCCESS)
+    {
+        Hal_conprintf("Page allocator init failed\n");
+        while(1);
+    }
+    Mem_PagesStatsPrint();
+    
+    if (Mem_KvaInit(Hal_BootInfoGet()) != KRN_ERR_SUCCESS)
+    {
+        Hal_conprintf("Kernel VA init failed\n");
+        while(1);
+    }
+    
     Hal_conprintf("Initializing IDT\n");
     Halx86_InitIdt();
     
@@ -124,8 +579,14 @@ Hal_KernelEntry(
     // Enable the timer interrupt.
     Halx86_PicEnableDevices(0x01);
     
-    // Do something.
-    while(1);
+    // Idle.
+    while(1)
+    {
+        if (! Krn_Idle())
+        {
+            Halx86_hlt();
+        }
+    }
 }
 
 void
@@ -267,8 +728,6 @@ Halx86_GetPicIrqMask(
     return values;
 }
 
-uint32_t g_TimerHitCount = 0;
-
 void
 OSCALL
 Halx86_IsrRootCallback(
@@ -280,13 +739,30 @@ Halx86_IsrRootCallback(
     // Hal_conprintf("Halx86_IsrRootCallback: Id=%02X, EC=%08X\n", IntIndex, IntErrorCode);
     
     // TODO: Handle the interrupt.
-    if (IntIndex == 0x20)
+    if (IntIndex == 0x0E)
+    {
+        uintptr_t faultVa;
+        
+        // Kernel mode touching a not present page may be a lazily populated
+        // kernel range.  Anything else is fatal for now.
+        faultVa = Halx86_ReadCr2();
+        
+        if ((IntErrorCode & (HALX86_PF_ERROR_PRESENT | HALX86_PF_ERROR_USER)) ||
+            (Mem_KvaPageFault(faultVa) != KRN_ERR_SUCCESS))
+        {
+            Hal_conprintf("Page fault: VA=%08X, EC=%08X\n", faultVa, IntErrorCode);
+            while(1);
+        }
+    }
+    else if (IntIndex == 0x20)
     {
         // Timer.
-        g_TimerHitCount++;
-        if (0 == (g_TimerHitCount % 100))
+        Krn_EpochTick();
+        
+        Krn_CounterInc(KRN_COUNTER_TIMER_TICKS);
+        if (0 == (Krn_CounterReadLocal(KRN_COUNTER_TIMER_TICKS) % 100))
         {
-            Hal_conprintf("Halx86_TIMER: %d\n", g_TimerHitCount);
+            Hal_conprintf("Halx86_TIMER: %d\n", Krn_CounterRead(KRN_COUNTER_TIMER_TICKS));
         }
     }
     
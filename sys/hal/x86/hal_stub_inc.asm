@@ -149,6 +149,10 @@ struc HALX86_CPU_BLOCK
     ; Current execution state.
     .CurrentProcessBlock        resd 1
     .CurrentThreadBlock         resd 1
+    .CurrentState_Pad           resd 6  ; Align on 64-byte boundary.
+    
+    ; Kernel owned per-CPU data (KRN_CPU_DATA), variable size.
+    .KrnCpuData:
     
     ; Size
     .size:
@@ -28,6 +28,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __HAL_X86_H__
 
 #include <krn_base.h>
+#include <krn_cpu.h>
 
 
 // Forward declarations.
@@ -35,6 +36,7 @@ typedef struct _HALX86_CPU_BLOCK HALX86_CPU_BLOCK;
 typedef struct _HALX86_MACHINE_INFO HALX86_MACHINE_INFO;
 typedef struct _HALX86_BIOS_INTERRUPT_CONTEXT HALX86_BIOS_INTERRUPT_CONTEXT;
 typedef struct _HALX86_MULTIBOOT_INFO HALX86_MULTIBOOT_INFO;
+typedef struct _HALX86_MULTIBOOT_MMAP_ENTRY HALX86_MULTIBOOT_MMAP_ENTRY;
 typedef struct _HALX86_GDT_DESCRIPTOR HALX86_GDT_DESCRIPTOR;
 typedef struct _HALX86_GDT_ENTRY HALX86_GDT_ENTRY;
 typedef struct _HALX86_IDT_DESCRIPTOR HALX86_IDT_DESCRIPTOR;
@@ -43,6 +45,9 @@ typedef struct _HALX86_CONTEXT_RECORD HALX86_CONTEXT_RECORD;
 
 typedef void (*HALX86_BIOS_INTERRUPT_CALLBACK)();
 
+// HAL_CPU_BLOCK_SIZE in hal_stub_inc.asm.
+#define HALX86_CPU_BLOCK_SIZE       0x00001000
+
 
 #pragma pack(push, 1)
 
@@ -108,8 +113,21 @@ struct _HALX86_CPU_BLOCK
     // Current execution state.
     void* pCurrentProcessBlock;
     void* pCurrentThreadBlock;
+    uint32_t CurrentState_Pad[6];
+    
+    // Kernel owned per-CPU data.  The whole block must fit in
+    // HAL_CPU_BLOCK_SIZE.
+    KRN_CPU_DATA KrnCpuData;
 };
 
+_Static_assert(
+    offsetof(HALX86_CPU_BLOCK, KrnCpuData) + sizeof(KRN_CPU_DATA) <= HALX86_CPU_BLOCK_SIZE,
+    "KRN_CPU_DATA no longer fits in the CPU block");
+
+_Static_assert(
+    offsetof(HALX86_CPU_BLOCK, KrnCpuData) == HAL_CPU_DATA_OFFSET,
+    "Hal_GetCpuData no longer finds KRN_CPU_DATA");
+
 struct _HALX86_MACHINE_INFO
 {
     HALX86_MULTIBOOT_INFO* pMultiBoot;
@@ -158,6 +176,21 @@ struct _HALX86_MULTIBOOT_INFO
     uint32_t VbeInterfaceLength;
 };
 
+#define HALX86_MULTIBOOT_FLAG_MEM       0x00000001  // MemLower, MemUpper
+#define HALX86_MULTIBOOT_FLAG_CMDLINE   0x00000004  // CmdLine
+#define HALX86_MULTIBOOT_FLAG_MMAP      0x00000040  // MmapLength, MmapAddress
+
+#define HALX86_MULTIBOOT_MMAP_AVAILABLE 1
+
+// Size does not include the Size field itself.
+struct _HALX86_MULTIBOOT_MMAP_ENTRY
+{
+    uint32_t Size;
+    uint64_t BaseAddress;
+    uint64_t Length;
+    uint32_t Type;
+};
+
 struct _HALX86_GDT_DESCRIPTOR
 {
     uint16_t SizeMinus1;
@@ -226,6 +259,21 @@ struct _HALX86_IDT_ENTRY
     uint16_t OffsetHigh;
 };
 
+// Boot time memory layout, see hal_stub_inc.asm.
+#define HALX86_KERNEL_BASE_VA       0x80000000
+#define HALX86_BOOT_MAPPED_LENGTH   (32*1024*1024)
+#define HALX86_MAX_MEM_RANGES       32
+#define HALX86_KERNEL_PDE_PA        0x00020000
+
+#define HALX86_CR4_PSE              0x00000010
+#define HALX86_LARGE_PAGE_SHIFT     22
+
+#define HALX86_CPUID_FEATURES       0x00000001
+#define HALX86_CPUID_EDX_SSE2       0x04000000
+#define HALX86_CPUID_CACHE_PARAMS   0x00000004  // Intel, one subleaf a cache.
+#define HALX86_CPUID_EXT_MAX        0x80000000
+#define HALX86_CPUID_EXT_L2_L3      0x80000006  // AMD, also L2 on Intel.
+
 #define HALX86_PDE_FLAG_PRESENT     0x00000001
 #define HALX86_PDE_FLAG_RW          0x00000002
 #define HALX86_PDE_FLAG_USER        0x00000004
@@ -237,6 +285,8 @@ struct _HALX86_IDT_ENTRY
 #define HALX86_PDE_FLAG_IGNORED1    0x00000100
 #define HALX86_PDE_MASK_SOFTWARE    0x00000E00
 #define HALX86_PDE_MASK_PTE_BASE    0xFFFFF000
+#define HALX86_PDE_MASK_4MB_BASE    0xFFC00000
+#define HALX86_PTES_PER_TABLE       1024
 
 #define HALX86_PTE_FLAG_PRESENT     0x00000001
 #define HALX86_PTE_FLAG_RW          0x00000002
@@ -250,6 +300,11 @@ struct _HALX86_IDT_ENTRY
 #define HALX86_PTE_MASK_SOFTWARE    0x00000E00
 #define HALX86_PTE_MASK_BASE_ADDR   0xFFFFF000
 
+// Page fault error code.
+#define HALX86_PF_ERROR_PRESENT     0x00000001
+#define HALX86_PF_ERROR_WRITE       0x00000002
+#define HALX86_PF_ERROR_USER        0x00000004
+
 struct _HALX86_CONTEXT_RECORD
 {
     // Execution context.
@@ -301,6 +356,9 @@ struct _HALX86_CONTEXT_RECORD
 
 extern HALX86_MACHINE_INFO* g_pHalx86_MachInfo;
 
+// End of the loaded image, from the linker script.
+extern char g_Krn_ImageEnd[];
+
 HALX86_CPU_BLOCK*
 OSCALL
 Halx86_GetCurrentCpuBlock(
@@ -355,11 +413,53 @@ OSCALL
 Halx86_cli(
     );
 
+void
+OSCALL
+Halx86_hlt(
+    );
+
+uintptr_t
+OSCALL
+Halx86_ReadCr2(
+    );
+
+uint32_t
+OSCALL
+Halx86_ReadCr4(
+    );
+
+void
+OSCALL
+Halx86_WriteCr4(
+    uint32_t Value
+    );
+
+void
+OSCALL
+Halx86_Invlpg(
+    uintptr_t Va
+    );
+
+// Leaf in eax and SubLeaf in ecx, pRegs gets eax, ebx, ecx and edx.
+void
+OSCALL
+Halx86_Cpuid(
+    uint32_t Leaf,
+    uint32_t SubLeaf,
+    uint32_t* pRegs
+    );
+
 void
 OSCALL
 Halx86_InitIdt(
     );
 
+void
+OSCALL
+Halx86_InitBootInfo(
+    HALX86_MACHINE_INFO* pMachInfo
+    );
+
 void
 OSCALL
 Halx86_PicInit(
@@ -0,0 +1,431 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_ATOMIC_H__
+#define __KRN_ATOMIC_H__
+
+#include <krn_base.h>
+
+// 
+// Atomic operations, inline so a lock or queue fast path is the one locked
+// instruction and no call.
+// 
+// Loads and stores come relaxed, acquire or release.  x86 only reorders a
+// store with a later load, so these are all plain moves that differ in what
+// the compiler may move across them.  Krn_AtomicFence orders everything,
+// including that store then load.
+// 
+// The Krn_Interlocked read-modify-writes use a lock prefixed instruction,
+// which x86 always makes a full barrier, so they have no weaker variants.
+// They return the value from before the operation.
+// 
+// 32 bit x86 has no plain 64 bit load or store that is atomic without the
+// FPU, so the 64 bit functions are built on cmpxchg8b there.
+// 
+#define KRN_INLINE      static inline __attribute__((always_inline))
+
+// Fences.
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicFence(
+    )
+{
+    // Cheaper than mfence and needs no SSE2.
+#if defined(__x86_64__)
+    __asm__ __volatile__ ("lock; orl $0, (%%rsp)" ::: "memory", "cc");
+#else
+    __asm__ __volatile__ ("lock; orl $0, (%%esp)" ::: "memory", "cc");
+#endif
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicFenceAcquire(
+    )
+{
+    KRN_BARRIER();
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicFenceRelease(
+    )
+{
+    KRN_BARRIER();
+}
+
+// 32 bit loads and stores.
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_AtomicLoad32Relaxed(
+    const volatile uint32_t* pSrc
+    )
+{
+    return __atomic_load_n(pSrc, __ATOMIC_RELAXED);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_AtomicLoad32Acquire(
+    const volatile uint32_t* pSrc
+    )
+{
+    return __atomic_load_n(pSrc, __ATOMIC_ACQUIRE);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStore32Relaxed(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    __atomic_store_n(pDest, Value, __ATOMIC_RELAXED);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStore32Release(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    __atomic_store_n(pDest, Value, __ATOMIC_RELEASE);
+}
+
+// Pointer loads and stores.
+KRN_INLINE
+void*
+OSCALL
+Krn_AtomicLoadPtrRelaxed(
+    void* const volatile* pSrc
+    )
+{
+    return __atomic_load_n(pSrc, __ATOMIC_RELAXED);
+}
+
+KRN_INLINE
+void*
+OSCALL
+Krn_AtomicLoadPtrAcquire(
+    void* const volatile* pSrc
+    )
+{
+    return __atomic_load_n(pSrc, __ATOMIC_ACQUIRE);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStorePtrRelaxed(
+    void* volatile* pDest,
+    void* Value
+    )
+{
+    __atomic_store_n(pDest, Value, __ATOMIC_RELAXED);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStorePtrRelease(
+    void* volatile* pDest,
+    void* Value
+    )
+{
+    __atomic_store_n(pDest, Value, __ATOMIC_RELEASE);
+}
+
+// 32 bit read-modify-writes.
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedAdd32(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    return __atomic_fetch_add(pDest, Value, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedInc32(
+    volatile uint32_t* pDest
+    )
+{
+    return __atomic_fetch_add(pDest, 1, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedDec32(
+    volatile uint32_t* pDest
+    )
+{
+    return __atomic_fetch_sub(pDest, 1, __ATOMIC_SEQ_CST);
+}
+
+// Or and And compile to lock or and lock and when the result is unused,
+// otherwise to a cmpxchg loop.
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedOr32(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    return __atomic_fetch_or(pDest, Value, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedAnd32(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    return __atomic_fetch_and(pDest, Value, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedExg32(
+    volatile uint32_t* pDest,
+    uint32_t Value
+    )
+{
+    return __atomic_exchange_n(pDest, Value, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_InterlockedCmpExg32(
+    volatile uint32_t* pDest,
+    uint32_t Value,
+    uint32_t Compare
+    )
+{
+    // Compare is overwritten with the old value when the swap fails.
+    __atomic_compare_exchange_n(pDest, &Compare, Value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    
+    return Compare;
+}
+
+// Pointer read-modify-writes.
+KRN_INLINE
+void*
+OSCALL
+Krn_InterlockedExgPtr(
+    void* volatile* pDest,
+    void* Value
+    )
+{
+    return __atomic_exchange_n(pDest, Value, __ATOMIC_SEQ_CST);
+}
+
+KRN_INLINE
+void*
+OSCALL
+Krn_InterlockedCmpExgPtr(
+    void* volatile* pDest,
+    void* Value,
+    void* Compare
+    )
+{
+    __atomic_compare_exchange_n(pDest, &Compare, Value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    
+    return Compare;
+}
+
+// 64 bit operations.
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_InterlockedCmpExg64(
+    volatile uint64_t* pDest,
+    uint64_t Value,
+    uint64_t Compare
+    )
+{
+#if defined(__x86_64__)
+    __atomic_compare_exchange_n(pDest, &Compare, Value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+    // Compares edx:eax, stores ecx:ebx if equal, else loads edx:eax.
+    __asm__ __volatile__ (
+        "lock; cmpxchg8b %1"
+        : "+A" (Compare), "+m" (*pDest)
+        : "b" ((uint32_t) Value), "c" ((uint32_t) (Value >> 32))
+        : "memory", "cc"
+        );
+#endif
+    
+    return Compare;
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_AtomicLoad64Relaxed(
+    const volatile uint64_t* pSrc
+    )
+{
+#if defined(__x86_64__)
+    return __atomic_load_n(pSrc, __ATOMIC_RELAXED);
+#else
+    // A compare with zero that stores zero, so memory never changes.
+    return Krn_InterlockedCmpExg64((volatile uint64_t*) pSrc, 0, 0);
+#endif
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_AtomicLoad64Acquire(
+    const volatile uint64_t* pSrc
+    )
+{
+#if defined(__x86_64__)
+    return __atomic_load_n(pSrc, __ATOMIC_ACQUIRE);
+#else
+    return Krn_InterlockedCmpExg64((volatile uint64_t*) pSrc, 0, 0);
+#endif
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_InterlockedExg64(
+    volatile uint64_t* pDest,
+    uint64_t Value
+    )
+{
+#if defined(__x86_64__)
+    return __atomic_exchange_n(pDest, Value, __ATOMIC_SEQ_CST);
+#else
+    uint64_t oldVal;
+    uint64_t prevVal;
+    
+    // The first read may be torn, in which case the exchange fails and
+    // hands back the real value.
+    oldVal = *pDest;
+    while ((prevVal = Krn_InterlockedCmpExg64(pDest, Value, oldVal)) != oldVal)
+    {
+        oldVal = prevVal;
+    }
+    
+    return oldVal;
+#endif
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStore64Relaxed(
+    volatile uint64_t* pDest,
+    uint64_t Value
+    )
+{
+#if defined(__x86_64__)
+    __atomic_store_n(pDest, Value, __ATOMIC_RELAXED);
+#else
+    Krn_InterlockedExg64(pDest, Value);
+#endif
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_AtomicStore64Release(
+    volatile uint64_t* pDest,
+    uint64_t Value
+    )
+{
+#if defined(__x86_64__)
+    __atomic_store_n(pDest, Value, __ATOMIC_RELEASE);
+#else
+    Krn_InterlockedExg64(pDest, Value);
+#endif
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_InterlockedAdd64(
+    volatile uint64_t* pDest,
+    uint64_t Value
+    )
+{
+#if defined(__x86_64__)
+    return __atomic_fetch_add(pDest, Value, __ATOMIC_SEQ_CST);
+#else
+    uint64_t oldVal;
+    uint64_t prevVal;
+    
+    oldVal = *pDest;
+    while ((prevVal = Krn_InterlockedCmpExg64(pDest, oldVal + Value, oldVal)) != oldVal)
+    {
+        oldVal = prevVal;
+    }
+    
+    return oldVal;
+#endif
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_InterlockedInc64(
+    volatile uint64_t* pDest
+    )
+{
+    return Krn_InterlockedAdd64(pDest, 1);
+}
+
+KRN_INLINE
+uint64_t
+OSCALL
+Krn_InterlockedDec64(
+    volatile uint64_t* pDest
+    )
+{
+    return Krn_InterlockedAdd64(pDest, (uint64_t) -1);
+}
+
+#endif // __KRN_ATOMIC_H__
@@ -37,6 +37,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 #define _countof(X)     (sizeof(X) / sizeof((X)[0]))
 
+#define KRN_CACHE_LINE_SIZE     64
+
+// Tells the core we are spinning, saves power and the pipeline flush on exit.
+#define KRN_PAUSE()             __asm__ __volatile__ ("pause" ::: "memory")
+
+// Keeps the compiler from moving accesses across a plain releasing store.
+// x86 doesn't reorder stores with older accesses, so nothing more is needed.
+#define KRN_BARRIER()           __asm__ __volatile__ ("" ::: "memory")
+
 // Place-holder for now.
 #define OSCALL
 
@@ -59,13 +68,46 @@ typedef uint32_t KRN_ERROR_CODE;
 //
 
 typedef struct _KRN_STACK_ENTRY KRN_STACK_ENTRY;
+typedef struct _KRN_TAGGED_STACK KRN_TAGGED_STACK;
 typedef struct _KRN_LIST_ENTRY KRN_LIST_ENTRY;
+typedef struct _KRN_TREE_ENTRY KRN_TREE_ENTRY;
+typedef struct _KRN_TREE KRN_TREE;
+typedef struct _KRN_HASH_ENTRY KRN_HASH_ENTRY;
+typedef struct _KRN_HASH_TABLE KRN_HASH_TABLE;
+typedef struct _KRN_SPINLOCK KRN_SPINLOCK;
+typedef struct _KRN_TICKET_LOCK KRN_TICKET_LOCK;
+typedef struct _KRN_MCS_LOCK KRN_MCS_LOCK;
+typedef struct _KRN_MCS_NODE KRN_MCS_NODE;
+typedef struct _KRN_RWLOCK KRN_RWLOCK;
+typedef struct _KRN_SEQLOCK KRN_SEQLOCK;
+typedef struct _KRN_RING KRN_RING;
 
 struct _KRN_STACK_ENTRY
 {
     KRN_STACK_ENTRY* pNext;
 };
 
+// 
+// Lock-free stack safe for several CPUs popping at once.  The top pointer
+// and a generation share one 64 bit word, swapped by Krn_InterlockedCmpExg64.
+// Every pop bumps the generation, so a pop that read a stale pNext fails
+// even when the same entry is back on top.  A popping CPU may still read
+// an entry another CPU has just taken, so entries must stay mapped.
+// 
+#if UINTPTR_MAX == 0xFFFFFFFF
+#define KRN_TAGGED_PTR_BITS     32
+#else
+// 64 bit hosts, for the test harness, have 48 bit pointers.
+#define KRN_TAGGED_PTR_BITS     48
+#endif
+
+#define KRN_TAGGED_PTR_MASK     ((1ULL << KRN_TAGGED_PTR_BITS) - 1)
+
+struct _KRN_TAGGED_STACK
+{
+    uint64_t Head __attribute__((aligned(8)));
+};
+
 //
 // In this doubly-linked list structure, the "ListHead" is itself a ListEntry.
 // However, it is a sentinel which points to itself at init.  This creates a
@@ -79,6 +121,148 @@ struct _KRN_LIST_ENTRY
     KRN_LIST_ENTRY* pPrev;
 };
 
+// 
+// Red-black tree ordered by Key, embedded in the caller's structure like a
+// list entry.  Equal keys are allowed and kept in insertion order.  Finds,
+// inserts and removes are O(log n), stepping to the next or previous entry
+// is O(1) on average.  No locking, callers serialize.
+// 
+struct _KRN_TREE_ENTRY
+{
+    KRN_TREE_ENTRY* pParent;
+    KRN_TREE_ENTRY* pLeft;
+    KRN_TREE_ENTRY* pRight;
+    uint64_t Key;
+    uint32_t Red;
+};
+
+struct _KRN_TREE
+{
+    KRN_TREE_ENTRY* pRoot;
+    uint32_t Count;
+};
+
+// 
+// Open addressing hash table of entries with unique keys.  The caller
+// provides a power of two array of slots and the table holds up to three
+// quarters of that, probing linearly.  Removal shifts later entries back
+// instead of leaving tombstones, so lookups never slow down with age.
+// 
+struct _KRN_HASH_ENTRY
+{
+    uintptr_t Key;
+};
+
+struct _KRN_HASH_TABLE
+{
+    KRN_HASH_ENTRY** ppSlots;
+    uint32_t Mask;
+    uint32_t Count;
+};
+
+// 
+// Spins on a plain read and only retries the exchange once the lock looks
+// free, so waiters don't keep pulling the line away from the owner.  Callers
+// that can be interrupted by a user of the same lock disable interrupts
+// first.
+// 
+struct _KRN_SPINLOCK
+{
+    volatile uint32_t Locked;
+};
+
+// 
+// Ticket lock, taken in the order CPUs arrived.  Waiters still all spin on
+// the lock's line, so keep these for locks with a few contenders that must
+// not starve.
+// 
+struct _KRN_TICKET_LOCK
+{
+    volatile uint32_t Next;
+    volatile uint32_t Owner;
+};
+
+// 
+// MCS queue lock, for heavily contended locks.  Each waiter brings its own
+// node, usually on its stack, and spins on that alone, so a release touches
+// one waiter's line instead of every waiter's.  The node passed to release
+// must be the one passed to acquire.
+// 
+struct _KRN_MCS_NODE
+{
+    KRN_MCS_NODE* volatile pNext;
+    volatile uint32_t Locked;
+} __attribute__((aligned(KRN_CACHE_LINE_SIZE)));
+
+struct _KRN_MCS_LOCK
+{
+    KRN_MCS_NODE* volatile pTail;
+};
+
+// 
+// Reader-writer spin lock.  Readers share it, a writer has it alone.  A
+// waiting writer holds off new readers so a stream of them can't starve
+// it.  Data also used by interrupt handlers needs interrupts disabled
+// around the write side.
+// 
+#define KRN_RWLOCK_WRITER       0x80000000
+#define KRN_RWLOCK_WAITING      0x40000000
+#define KRN_RWLOCK_READERS      0x3FFFFFFF
+
+struct _KRN_RWLOCK
+{
+    volatile uint32_t Value;
+};
+
+// 
+// Sequence lock, for small read-mostly data like the time.  Writers take
+// the lock and bump Sequence before and after, so it is odd during a
+// write.  Readers write nothing, they copy the data and retry if Sequence
+// moved:
+// 
+//     do
+//     {
+//         seq = Krn_SeqLockReadBegin(&lock);
+//         copy = data;
+//     } while (Krn_SeqLockReadRetry(&lock, seq));
+// 
+// Readers may see torn data inside the loop, so they must not follow
+// pointers from it.
+// 
+struct _KRN_SEQLOCK
+{
+    volatile uint32_t Sequence;
+    KRN_SPINLOCK Lock;
+};
+
+// 
+// Bounded ring of pointers with one consumer.  Krn_RingEnqueue is for a
+// single producer, Krn_RingEnqueueMp for any number, and a ring must stick
+// to one or the other.  Both sides move whole batches and return how many
+// went, which may be fewer than asked.  Each side keeps its index on its
+// own cache line, along with a cached copy of the other side's, so the
+// line only moves when the cached copy runs out.
+// 
+// Multi-producer enqueues claim slots, fill them and then wait for earlier
+// claims to be published before publishing their own, with interrupts
+// disabled throughout so a handler can't wait on the code it interrupted.
+// 
+struct _KRN_RING
+{
+    // Consumer.
+    volatile uint32_t Head __attribute__((aligned(KRN_CACHE_LINE_SIZE)));
+    uint32_t TailCache;
+    
+    // Producers.  Claim runs ahead of Tail while multi-producer enqueues
+    // are filling their slots.
+    volatile uint32_t Tail __attribute__((aligned(KRN_CACHE_LINE_SIZE)));
+    volatile uint32_t Claim;
+    uint32_t HeadCache;
+    
+    void** pSlots __attribute__((aligned(KRN_CACHE_LINE_SIZE)));
+    uint32_t Mask;
+};
+
 // 
 // Functions
 // 
@@ -104,95 +288,392 @@ memset(
     size_t Count
     );
 
+void*
+OSCALL
+memcpy(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    );
+
+void*
+OSCALL
+memmove(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    );
+
+int
+OSCALL
+memcmp(
+    const void* pLeft,
+    const void* pRight,
+    size_t Count
+    );
+
+// memset that keeps the block out of the cache when the CPU can, for pages
+// nobody touches again soon.
+void*
+OSCALL
+Krn_MemSetNt(
+    void* pDest,
+    int Value,
+    size_t Count
+    );
+
+// Picks the memory primitives for this CPU, before anything large is moved.
+void
+OSCALL
+Krn_BaseInit(
+    );
+
 void
 OSCALL
 Krn_CheckPoint(
     );
 
-// Interlocked functions.
+// Background work for the idle loop.  Returns zero when there is nothing
+// left to do and the CPU can halt until the next interrupt.
 uint32_t
 OSCALL
-Krn_InterlockedInc32(
-    uint32_t* pDest
+Krn_Idle(
+    );
+
+// Interlocked functions and atomic loads and stores, all inline.
+#include <krn_atomic.h>
+
+// 
+// Lock fast paths are inline, one locked instruction when uncontended.
+// The *Slow functions are their out of line waits, called only from the
+// inline halves.
+// 
+void
+OSCALL
+Krn_SpinLockAcquireSlow(
+    KRN_SPINLOCK* pLock
     );
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedInc64(
-    uint32_t* pDest
+Krn_TicketLockAcquireSlow(
+    KRN_TICKET_LOCK* pLock,
+    uint32_t Ticket
+    );
+
+void
+OSCALL
+Krn_McsLockAcquireSlow(
+    KRN_MCS_NODE* pPrev,
+    KRN_MCS_NODE* pNode
+    );
+
+void
+OSCALL
+Krn_McsLockReleaseSlow(
+    KRN_MCS_NODE* pNode
+    );
+
+void
+OSCALL
+Krn_RwLockAcquireReadSlow(
+    KRN_RWLOCK* pLock
+    );
+
+void
+OSCALL
+Krn_RwLockAcquireWriteSlow(
+    KRN_RWLOCK* pLock
     );
 
 uint32_t
 OSCALL
-Krn_InterlockedDec32(
-    uint32_t* pDest
+Krn_SeqLockReadBeginSlow(
+    const KRN_SEQLOCK* pLock
     );
 
-uint64_t
+// Spin lock functions.
+void
 OSCALL
-Krn_InterlockedDec64(
-    uint64_t* pDest
+Krn_SpinLockInit(
+    KRN_SPINLOCK* pLock
     );
 
+KRN_INLINE
+void
+OSCALL
+Krn_SpinLockAcquire(
+    KRN_SPINLOCK* pLock
+    )
+{
+    if (Krn_InterlockedExg32(&pLock->Locked, 1))
+    {
+        Krn_SpinLockAcquireSlow(pLock);
+    }
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_SpinLockRelease(
+    KRN_SPINLOCK* pLock
+    )
+{
+    Krn_AtomicStore32Release(&pLock->Locked, 0);
+}
+
+// 
+// The Irq variants disable interrupts before taking the lock and return the
+// previous state for the matching release, for locks also taken by
+// interrupt handlers.
+// 
 uint32_t
 OSCALL
-Krn_InterlockedAdd32(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_SpinLockAcquireIrq(
+    KRN_SPINLOCK* pLock
+    );
+
+void
+OSCALL
+Krn_SpinLockReleaseIrq(
+    KRN_SPINLOCK* pLock,
+    uint32_t IntState
     );
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedAdd64(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_TicketLockInit(
+    KRN_TICKET_LOCK* pLock
     );
 
+KRN_INLINE
+void
+OSCALL
+Krn_TicketLockAcquire(
+    KRN_TICKET_LOCK* pLock
+    )
+{
+    uint32_t ticket;
+    
+    ticket = Krn_InterlockedInc32(&pLock->Next);
+    
+    if (Krn_AtomicLoad32Acquire(&pLock->Owner) != ticket)
+    {
+        Krn_TicketLockAcquireSlow(pLock, ticket);
+    }
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_TicketLockRelease(
+    KRN_TICKET_LOCK* pLock
+    )
+{
+    // Only the owner writes Owner, so no locked instruction is needed.
+    Krn_AtomicStore32Release(&pLock->Owner, pLock->Owner + 1);
+}
+
 uint32_t
 OSCALL
-Krn_InterlockedExg32(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_TicketLockAcquireIrq(
+    KRN_TICKET_LOCK* pLock
     );
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedExg64(
-    uint64_t* pDest,
-    uint64_t Value
+Krn_TicketLockReleaseIrq(
+    KRN_TICKET_LOCK* pLock,
+    uint32_t IntState
     );
 
+void
+OSCALL
+Krn_McsLockInit(
+    KRN_MCS_LOCK* pLock
+    );
+
+KRN_INLINE
+void
+OSCALL
+Krn_McsLockAcquire(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode
+    )
+{
+    KRN_MCS_NODE* pPrev;
+    
+    pNode->pNext = NULL;
+    pNode->Locked = 1;
+    
+    pPrev = Krn_InterlockedExgPtr((void* volatile*) &pLock->pTail, pNode);
+    
+    if (pPrev)
+    {
+        Krn_McsLockAcquireSlow(pPrev, pNode);
+    }
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_McsLockRelease(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode
+    )
+{
+    // Nobody queued, unless one has swapped the tail but not linked yet.
+    if ((! pNode->pNext) &&
+        (Krn_InterlockedCmpExgPtr((void* volatile*) &pLock->pTail, NULL, pNode) == pNode))
+    {
+        return;
+    }
+    
+    Krn_McsLockReleaseSlow(pNode);
+}
+
 uint32_t
 OSCALL
-Krn_InterlockedCmpExg32(
-    uint32_t* pDest,
-    uint32_t Value,
-    uint32_t Compare
+Krn_McsLockAcquireIrq(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode
     );
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedCmpExg64(
-    uint64_t* pDest,
-    uint64_t Value,
-    uint64_t Compare
+Krn_McsLockReleaseIrq(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode,
+    uint32_t IntState
     );
 
-void*
+void
 OSCALL
-Krn_InterlockedExgPtr(
-    void** pDest,
-    void* Value
+Krn_RwLockInit(
+    KRN_RWLOCK* pLock
     );
 
-void*
+KRN_INLINE
+void
+OSCALL
+Krn_RwLockAcquireRead(
+    KRN_RWLOCK* pLock
+    )
+{
+    if ((Krn_AtomicLoad32Relaxed(&pLock->Value) & (KRN_RWLOCK_WRITER | KRN_RWLOCK_WAITING)) == 0)
+    {
+        // A writer may have got in since the check, back out if so.
+        if ((Krn_InterlockedInc32(&pLock->Value) & KRN_RWLOCK_WRITER) == 0)
+        {
+            return;
+        }
+        
+        Krn_InterlockedDec32(&pLock->Value);
+    }
+    
+    Krn_RwLockAcquireReadSlow(pLock);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_RwLockReleaseRead(
+    KRN_RWLOCK* pLock
+    )
+{
+    Krn_InterlockedDec32(&pLock->Value);
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_RwLockAcquireWrite(
+    KRN_RWLOCK* pLock
+    )
+{
+    if (Krn_InterlockedCmpExg32(&pLock->Value, KRN_RWLOCK_WRITER, 0) != 0)
+    {
+        Krn_RwLockAcquireWriteSlow(pLock);
+    }
+}
+
+KRN_INLINE
+void
 OSCALL
-Krn_InterlockedCmpExgPtr(
-    void** pDest,
-    void* Value,
-    void* Compare
+Krn_RwLockReleaseWrite(
+    KRN_RWLOCK* pLock
+    )
+{
+    // Readers backing out and waiting writers change the other bits.
+    Krn_InterlockedAnd32(&pLock->Value, ~KRN_RWLOCK_WRITER);
+}
+
+void
+OSCALL
+Krn_SeqLockInit(
+    KRN_SEQLOCK* pLock
     );
 
+KRN_INLINE
+void
+OSCALL
+Krn_SeqLockWriteBegin(
+    KRN_SEQLOCK* pLock
+    )
+{
+    Krn_SpinLockAcquire(&pLock->Lock);
+    
+    // Odd before any of the data changes.  x86 keeps stores in order.
+    Krn_AtomicStore32Relaxed(&pLock->Sequence, pLock->Sequence + 1);
+    Krn_AtomicFenceRelease();
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_SeqLockWriteEnd(
+    KRN_SEQLOCK* pLock
+    )
+{
+    Krn_AtomicStore32Release(&pLock->Sequence, pLock->Sequence + 1);
+    
+    Krn_SpinLockRelease(&pLock->Lock);
+}
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_SeqLockReadBegin(
+    const KRN_SEQLOCK* pLock
+    )
+{
+    uint32_t sequence;
+    
+    sequence = Krn_AtomicLoad32Acquire(&pLock->Sequence);
+    
+    if (sequence & 1)
+    {
+        sequence = Krn_SeqLockReadBeginSlow(pLock);
+    }
+    
+    return sequence;
+}
+
+// Non-zero when a write overlapped the read started at Sequence.
+KRN_INLINE
+int
+OSCALL
+Krn_SeqLockReadRetry(
+    const KRN_SEQLOCK* pLock,
+    uint32_t Sequence
+    )
+{
+    // The data reads finish before Sequence is read again.
+    Krn_AtomicFenceAcquire();
+    
+    return Krn_AtomicLoad32Relaxed(&pLock->Sequence) != Sequence;
+}
+
 // Stack functions.
 void
 OSCALL
@@ -213,6 +694,127 @@ Krn_StackPop(
     KRN_STACK_ENTRY* pStack
     );
 
+void
+OSCALL
+Krn_TaggedStackInit(
+    KRN_TAGGED_STACK* pStack
+    );
+
+void
+OSCALL
+Krn_TaggedStackPush(
+    KRN_TAGGED_STACK* pStack,
+    KRN_STACK_ENTRY* pEntry
+    );
+
+// Pushes pFirst through pLast, already linked through pNext, in one go.
+void
+OSCALL
+Krn_TaggedStackPushList(
+    KRN_TAGGED_STACK* pStack,
+    KRN_STACK_ENTRY* pFirst,
+    KRN_STACK_ENTRY* pLast
+    );
+
+KRN_STACK_ENTRY*
+OSCALL
+Krn_TaggedStackPop(
+    KRN_TAGGED_STACK* pStack
+    );
+
+// Empties the stack, returning the old entries linked top first.
+KRN_STACK_ENTRY*
+OSCALL
+Krn_TaggedStackPopAll(
+    KRN_TAGGED_STACK* pStack
+    );
+
+// Ring functions.  SlotCount must be a power of two.
+KRN_ERROR_CODE
+OSCALL
+Krn_RingInit(
+    KRN_RING* pRing,
+    void** pSlots,
+    uint32_t SlotCount
+    );
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_RingEnqueue(
+    KRN_RING* pRing,
+    void* const* pItems,
+    uint32_t Count
+    )
+{
+    uint32_t tail;
+    uint32_t room;
+    uint32_t i;
+    
+    // Indexes run freely and wrap, only the differences matter.
+    tail = pRing->Tail;
+    room = pRing->Mask + 1 - (tail - pRing->HeadCache);
+    
+    if (room < Count)
+    {
+        pRing->HeadCache = Krn_AtomicLoad32Relaxed(&pRing->Head);
+        room = pRing->Mask + 1 - (tail - pRing->HeadCache);
+        Count = (room < Count) ? room : Count;
+    }
+    
+    for (i = 0; i < Count; i++)
+    {
+        pRing->pSlots[(tail + i) & pRing->Mask] = pItems[i];
+    }
+    
+    // Slots are written before the consumer can see them.
+    Krn_AtomicStore32Release(&pRing->Tail, tail + Count);
+    
+    return Count;
+}
+
+uint32_t
+OSCALL
+Krn_RingEnqueueMp(
+    KRN_RING* pRing,
+    void* const* pItems,
+    uint32_t Count
+    );
+
+KRN_INLINE
+uint32_t
+OSCALL
+Krn_RingDequeue(
+    KRN_RING* pRing,
+    void** pItems,
+    uint32_t Count
+    )
+{
+    uint32_t head;
+    uint32_t ready;
+    uint32_t i;
+    
+    head = pRing->Head;
+    ready = pRing->TailCache - head;
+    
+    if (ready < Count)
+    {
+        pRing->TailCache = Krn_AtomicLoad32Acquire(&pRing->Tail);
+        ready = pRing->TailCache - head;
+        Count = (ready < Count) ? ready : Count;
+    }
+    
+    for (i = 0; i < Count; i++)
+    {
+        pItems[i] = pRing->pSlots[(head + i) & pRing->Mask];
+    }
+    
+    // The slots are read before the producers can reuse them.
+    Krn_AtomicStore32Release(&pRing->Head, head + Count);
+    
+    return Count;
+}
+
 // List functions.
 void
 OSCALL
@@ -259,6 +861,107 @@ Krn_ListAddEntry(
     KRN_LIST_ENTRY* pEntry
     );
 
+// Tree functions.
+void
+OSCALL
+Krn_TreeInit(
+    KRN_TREE* pTree
+    );
+
+// pEntry->Key must be set.
+void
+OSCALL
+Krn_TreeInsert(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    );
+
+void
+OSCALL
+Krn_TreeRemove(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    );
+
+// First entry with exactly Key, or NULL.
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFind(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    );
+
+// Last entry with a key at or below Key, or NULL.
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFindFloor(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    );
+
+// First entry with a key at or above Key, or NULL.
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFindCeiling(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    );
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFirst(
+    const KRN_TREE* pTree
+    );
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeLast(
+    const KRN_TREE* pTree
+    );
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeNext(
+    const KRN_TREE_ENTRY* pEntry
+    );
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreePrev(
+    const KRN_TREE_ENTRY* pEntry
+    );
+
+// Hash table functions.  SlotCount must be a power of two.
+KRN_ERROR_CODE
+OSCALL
+Krn_HashInit(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY** ppSlots,
+    uint32_t SlotCount
+    );
+
+// Fails if the key is already present or the table is three quarters full.
+KRN_ERROR_CODE
+OSCALL
+Krn_HashInsert(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY* pEntry
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Krn_HashRemove(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY* pEntry
+    );
+
+KRN_HASH_ENTRY*
+OSCALL
+Krn_HashFind(
+    const KRN_HASH_TABLE* pTable,
+    uintptr_t Key
+    );
+
 #endif // __KRN_BASE_H__
 
 
@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_CACHE_H__
+#define __KRN_CACHE_H__
+
+#include <krn_base.h>
+
+// 
+// Object caches hand out fixed-size, cache line aligned objects carved from
+// slabs of mapped pages.  Free objects sit on a lock-free stack, so an
+// allocation or free is a single push or pop until the cache has to grow,
+// which pushes the new slab's objects with one exchange.
+// Slabs are only returned to the page allocator by Krn_CacheDestroy.
+// 
+typedef struct _KRN_CACHE KRN_CACHE;
+
+struct _KRN_CACHE
+{
+    KRN_TAGGED_STACK FreeStack;
+    KRN_STACK_ENTRY SlabStack;
+    const char* pName;
+    uint32_t ObjectSize;
+    uint32_t ObjectsPerSlab;
+    uint32_t SlabPages;
+    uint32_t SlabCount;
+    uint32_t ObjectsInUse;
+};
+
+KRN_ERROR_CODE
+OSCALL
+Krn_CacheCreate(
+    KRN_CACHE* pCache,
+    const char* pName,
+    size_t ObjectSize
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Krn_CacheDestroy(
+    KRN_CACHE* pCache
+    );
+
+void*
+OSCALL
+Krn_CacheAlloc(
+    KRN_CACHE* pCache
+    );
+
+void
+OSCALL
+Krn_CacheFree(
+    KRN_CACHE* pCache,
+    void* pObject
+    );
+
+#endif // __KRN_CACHE_H__
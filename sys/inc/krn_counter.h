@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_COUNTER_H__
+#define __KRN_COUNTER_H__
+
+#include <krn_base.h>
+#include <hal_common.h>
+
+// 
+// Per-CPU statistics counters.  Krn_CounterAdd bumps the current CPU's copy
+// with a single unlocked add, which an interrupt on the same CPU cannot
+// split and which leaves other CPUs' cache lines alone.  Krn_CounterRead
+// folds every CPU's copy into a total on demand.  The total is sloppy, adds
+// in flight on other CPUs may or may not be in it, and wraps at 32 bits
+// like a plain global would.
+// 
+// New counters get an id here and cost nothing more than the add.
+// 
+#define KRN_COUNTER_MAX_CPUS    64
+
+typedef enum _KRN_COUNTER_ID
+{
+    KRN_COUNTER_TIMER_TICKS = 0,
+    
+    // Page allocator, read by Mem_PagesStatsGet.
+    KRN_COUNTER_MEM_ALLOC,
+    KRN_COUNTER_MEM_ALLOC_FAIL,
+    KRN_COUNTER_MEM_FREE,
+    KRN_COUNTER_MEM_FREE_FAIL,
+    KRN_COUNTER_MEM_COLOR_MISS,
+    KRN_COUNTER_MEM_COMPACT,
+    KRN_COUNTER_MEM_COMPACT_FAIL,
+    KRN_COUNTER_MEM_COMPACT_MOVED,
+    
+    // One per MEM_PAGE_STATS_LATENCY bucket.
+    KRN_COUNTER_MEM_ALLOC_LATENCY,
+    KRN_COUNTER_MEM_ALLOC_LATENCY_END = KRN_COUNTER_MEM_ALLOC_LATENCY + 16,
+    
+    KRN_COUNTER_COUNT = KRN_COUNTER_MEM_ALLOC_LATENCY_END
+} KRN_COUNTER_ID;
+
+// Kept in KRN_CPU_DATA.  Written only by the owning CPU.
+typedef struct _KRN_COUNTER_CPU
+{
+    volatile uint32_t Values[KRN_COUNTER_COUNT];
+} KRN_COUNTER_CPU;
+
+void
+OSCALL
+Krn_CounterInit(
+    );
+
+// Called once on each CPU before it uses the functions below.
+KRN_ERROR_CODE
+OSCALL
+Krn_CounterCpuInit(
+    );
+
+// Inline, counting should not cost a call.  The counters lead KRN_CPU_DATA.
+KRN_INLINE
+void
+OSCALL
+Krn_CounterAdd(
+    KRN_COUNTER_ID Id,
+    uint32_t Value
+    )
+{
+    KRN_COUNTER_CPU* pCpu;
+    
+    pCpu = (KRN_COUNTER_CPU*) Hal_GetCpuData();
+    
+    // One instruction, so an ISR on this CPU sees the add whole or not at
+    // all.  No lock prefix, nobody else writes this copy.
+    __asm__ __volatile__ (
+        "addl %1, %0"
+        : "+m" (pCpu->Values[Id])
+        : "ir" (Value)
+        );
+}
+
+KRN_INLINE
+void
+OSCALL
+Krn_CounterInc(
+    KRN_COUNTER_ID Id
+    )
+{
+    Krn_CounterAdd(Id, 1);
+}
+
+// This CPU's share only.
+uint32_t
+OSCALL
+Krn_CounterReadLocal(
+    KRN_COUNTER_ID Id
+    );
+
+// The sum over every CPU.
+uint32_t
+OSCALL
+Krn_CounterRead(
+    KRN_COUNTER_ID Id
+    );
+
+#endif // __KRN_COUNTER_H__
@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_CPU_H__
+#define __KRN_CPU_H__
+
+#include <krn_base.h>
+#include <krn_counter.h>
+#include <krn_epoch.h>
+#include <krn_mem.h>
+#include <hal_common.h>
+
+// 
+// Kernel data kept once per CPU.  The HAL embeds this in its CPU block and
+// hands it out through Hal_GetCpuData.  Only the owning CPU touches it, with
+// interrupts disabled where an ISR could also get in.
+// 
+// The counters come first, so the inline Krn_CounterAdd can reach them
+// without this header, which needs its types.
+// 
+struct _KRN_CPU_DATA
+{
+    KRN_COUNTER_CPU Counters;
+    MEM_PAGE_MAGAZINE PageMagazine;
+    KRN_EPOCH_CPU Epoch;
+};
+
+_Static_assert(
+    offsetof(KRN_CPU_DATA, Counters) == 0,
+    "Krn_CounterAdd no longer finds the counters");
+
+#endif // __KRN_CPU_H__
@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_EPOCH_H__
+#define __KRN_EPOCH_H__
+
+#include <krn_base.h>
+
+// 
+// Epoch based deferred freeing, so lists can be read without locks.  A
+// reader brackets its walk with Krn_EpochEnter and Krn_EpochExit, which
+// only change a count in its own CPU data, and must not block in between.
+// A writer unlinks a node as usual and hands it to Krn_DeferFree, which
+// calls the node's free function once every CPU has been outside a read
+// section since.
+// 
+// Each CPU's timer tick calls Krn_EpochTick.  A tick outside a read
+// section marks the CPU as having seen the global epoch, the global epoch
+// advances once every CPU has seen it, and nodes deferred in epoch E are
+// freed once it reaches E + 2.  Free functions run on the deferring CPU,
+// from its tick or a later Krn_DeferFree, with interrupts disabled.
+// 
+#define KRN_EPOCH_MAX_CPUS      64
+#define KRN_EPOCH_LISTS         3
+
+typedef struct _KRN_DEFER_ENTRY KRN_DEFER_ENTRY;
+
+typedef void (OSCALL *KRN_DEFER_FREE_FUNC)(
+    KRN_DEFER_ENTRY* pEntry
+    );
+
+struct _KRN_DEFER_ENTRY
+{
+    KRN_DEFER_ENTRY* pNext;
+    KRN_DEFER_FREE_FUNC pfnFree;
+};
+
+// Kept in KRN_CPU_DATA.  Only Epoch is read by other CPUs.
+typedef struct _KRN_EPOCH_CPU
+{
+    volatile uint32_t Nesting;                  // Read sections entered.
+    volatile uint32_t Epoch;                    // Last global epoch seen.
+    uint32_t ListEpochs[KRN_EPOCH_LISTS];
+    KRN_DEFER_ENTRY* pLists[KRN_EPOCH_LISTS];   // Waiting, by epoch mod 3.
+    uint32_t PendingCount;
+} KRN_EPOCH_CPU;
+
+void
+OSCALL
+Krn_EpochInit(
+    );
+
+// Called once on each CPU before it uses the functions below.
+KRN_ERROR_CODE
+OSCALL
+Krn_EpochCpuInit(
+    );
+
+void
+OSCALL
+Krn_EpochEnter(
+    );
+
+void
+OSCALL
+Krn_EpochExit(
+    );
+
+void
+OSCALL
+Krn_DeferFree(
+    KRN_DEFER_ENTRY* pEntry,
+    KRN_DEFER_FREE_FUNC pfnFree
+    );
+
+void
+OSCALL
+Krn_EpochTick(
+    );
+
+#endif // __KRN_EPOCH_H__
@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __KRN_KVA_H__
+#define __KRN_KVA_H__
+
+#include <krn_base.h>
+#include <hal_common.h>
+
+// 
+// Kernel virtual address ranges.  Mem_KvaAlloc only reserves addresses.
+// Page tables and zeroed pages arrive one at a time on first touch, through
+// Mem_KvaPageFault, so a range needs neither contiguous nor low memory.
+// MEM_OPTS_LARGE_PAGE ranges are 4 MB aligned and backed by large pages
+// straight away.  Pages of MEM_OPTS_COLOR ranges cycle through the cache
+// colors in the order they are touched.  Flags are MEM_FLAGS_*,
+// MEM_OPTS_LARGE_PAGE and MEM_OPTS_COLOR.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaInit(
+    const HAL_BOOT_INFO* pBootInfo
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaAlloc(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pVa
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaFree(
+    uintptr_t Va
+    );
+
+// For kernel mode faults on not present pages.
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaPageFault(
+    uintptr_t Va
+    );
+
+// For compaction.  Copies the page at Pa, recorded with Cookie by
+// Mem_PagesSetMovable, to a new page and maps that in its place.  Pa stays
+// allocated and belongs to the caller.
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaMovePage(
+    uint32_t Cookie,
+    uintptr_t Pa
+    );
+
+#endif // __KRN_KVA_H__
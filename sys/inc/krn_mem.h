@@ -32,12 +32,228 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdarg.h>
 #include <limits.h>
 
+#include <krn_base.h>
+#include <hal_common.h>
+
+#define MEM_PAGE_SIZE           4096
+#define MEM_PAGE_SHIFT          12
+
 #define MEM_FLAGS_READ          0x00000001
 #define MEM_FLAGS_WRITE         0x00000002
 #define MEM_FLAGS_EXEC          0x00000004
 
+// Page usage, recorded in the page database.
+#define MEM_TYPE_MASK           0x000F0000
+#define MEM_TYPE_SHIFT          16
+#define MEM_TYPE_FREE           0x00000000
+#define MEM_TYPE_RESERVED       0x00010000  // Not RAM, or owned by firmware.
+#define MEM_TYPE_BOOT           0x00020000  // Kernel image, boot structures.
+#define MEM_TYPE_MEM_INFO       0x00030000  // Page database and buddy bits.
+#define MEM_TYPE_SYSTEM         0x00040000  // General kernel allocation.
+#define MEM_TYPE_CACHED         0x00050000  // Free, held by a page magazine.
+#define MEM_TYPE_OBJECTS        0x00060000  // Object cache slab.
+#define MEM_TYPE_ZEROED         0x00070000  // Free, held by the zero pool.
+#define MEM_TYPE_PAGE_TABLE     0x00080000  // HAL paging structures.
+#define MEM_TYPE_MOVABLE        0x00090000  // Kernel VA backing, can migrate.
+
 #define MEM_OPTS_CONTIGUOUS     0x80000000
 #define MEM_OPTS_SYS_CRITICAL   0x40000000
+#define MEM_OPTS_MAPPED         0x20000000  // Must be in the boot mapping.
+#define MEM_OPTS_ZERO           0x10000000  // Zero filled, implies MAPPED.
+#define MEM_OPTS_LARGE_PAGE     0x08000000  // Whole, aligned large pages.
+#define MEM_OPTS_DMA            0x04000000  // Below 16 MB, for ISA DMA.
+#define MEM_OPTS_COLOR          0x02000000  // Next cache color, single pages.
+
+// 
+// Physical memory zones.  DMA is below 16 MB, LOW is the rest of the boot
+// mapping and HIGH is everything above.  Ordinary allocations go high
+// first, MEM_OPTS_MAPPED ones low first, and MEM_OPTS_DMA ones only to the
+// DMA zone.  Falling back to a lower zone stops at its reserve, which is
+// kept for the requests that can only be served there.
+// 
+#define MEM_ZONE_DMA            0
+#define MEM_ZONE_LOW            1
+#define MEM_ZONE_HIGH           2
+#define MEM_ZONE_COUNT          3
+
+#define MEM_ZONE_DMA_END        (16*1024*1024)
+
+// Pages in one HAL large page, a MEM_OPTS_LARGE_PAGE request is a multiple.
+#define MEM_LARGE_PAGE_COUNT    (HAL_LARGE_PAGE_SIZE / MEM_PAGE_SIZE)
+
+// Largest owner cookie Mem_PagesSetMovable can record.
+#define MEM_MOVABLE_COOKIE_MAX  0x00FFFFFF
+
+// 
+// Per-CPU stacks of free single pages in front of the buddy lists, one per
+// zone, so a freed page only goes back out to requests its zone serves.
+// Pages move to and from the buddy lists MEM_PAGE_MAGAZINE_BATCH at a time.
+// 
+#define MEM_PAGE_MAGAZINE_SIZE  32
+#define MEM_PAGE_MAGAZINE_BATCH 16
+
+typedef struct _MEM_PAGE_MAGAZINE
+{
+    uint32_t Count[MEM_ZONE_COUNT];
+    uint32_t Pages[MEM_ZONE_COUNT][MEM_PAGE_MAGAZINE_SIZE];    // Page numbers.
+    uint32_t NextColor;                                         // For MEM_OPTS_COLOR.
+} MEM_PAGE_MAGAZINE;
+
+// 
+// Allocator statistics.  Counters run from Mem_PagesInit and wrap at 2^32.
+// Allocation latency is bucketed by powers of two of TSC cycles, bucket i
+// counting [2^(i+5), 2^(i+6)), with the first and last buckets open ended.
+// 
+#define MEM_PAGE_STATS_ORDERS   21      // Up to 4 GB of pages.
+#define MEM_PAGE_STATS_LATENCY  16
+
+typedef struct _MEM_ZONE_STATS
+{
+    uint32_t BasePage;
+    uint32_t PageCount;             // Zero when the machine has no such zone.
+    uint32_t FreePages;
+    uint32_t ReservePages;
+} MEM_ZONE_STATS;
+
+typedef struct _MEM_PAGE_STATS
+{
+    uint32_t PageCount;
+    uint32_t PageDbBytes;
+    uint32_t BuddyBytes;            // Buddy lists, headers and bits.
+    uint32_t FreePages;             // In the buddy lists.
+    uint32_t ZeroPoolPages;
+    uint32_t OrderCount;            // Orders this machine has.
+    uint32_t LargestFreeOrder;      // Only meaningful with FreePages != 0.
+    
+    // Free blocks of each order that are not part of a larger free block.
+    uint32_t FreeBlocks[MEM_PAGE_STATS_ORDERS];
+    MEM_ZONE_STATS Zones[MEM_ZONE_COUNT];
+    
+    uint32_t AllocCount;
+    uint32_t AllocFailCount;
+    uint32_t FreeCount;
+    uint32_t FreeFailCount;
+    uint32_t AllocLatency[MEM_PAGE_STATS_LATENCY];
+    
+    // Compaction, in blocks emptied, attempts that found nothing, and pages
+    // migrated.
+    uint32_t CompactCount;
+    uint32_t CompactFailCount;
+    uint32_t CompactMovedPages;
+    
+    // Cache colors of the last level cache, 1 without coloring, and
+    // MEM_OPTS_COLOR requests served with some other color.
+    uint32_t ColorCount;
+    uint32_t ColorMissCount;
+} MEM_PAGE_STATS;
+
+// 
+// Physical page allocator.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesInit(
+    const HAL_BOOT_INFO* pBootInfo
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesMarkBusy(
+    uintptr_t BasePa,
+    size_t PageCount,
+    uint32_t Flags
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAlloc(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesFree(
+    uintptr_t BasePa,
+    size_t PageCount
+    );
+
+// The same, left out of the statistics.  For the memory manager's own
+// work, which no caller asked for.
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAllocInternal(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesFreeInternal(
+    uintptr_t BasePa,
+    size_t PageCount
+    );
+
+// One page of the same cache color as ColorPa, or none, for moving a page
+// of a MEM_OPTS_COLOR range.  Also left out of the statistics.
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAllocColor(
+    uintptr_t ColorPa,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    );
+
+void*
+OSCALL
+Mem_PagesPaToVa(
+    uintptr_t Pa
+    );
+
+// Idle time work, returns the number of pages zeroed.
+uint32_t
+OSCALL
+Mem_PagesZeroIdle(
+    );
+
+// 
+// Movable pages.  A MEM_TYPE_MOVABLE page with a non-zero cookie can be
+// migrated by compaction, which hands the cookie to Mem_KvaMovePage.  Zero
+// pins the page where it is.  High order allocations may compact, so they
+// must not be made with the kernel VA lock held.
+// 
+void
+OSCALL
+Mem_PagesSetMovable(
+    uintptr_t Pa,
+    uint32_t Cookie
+    );
+
+uint32_t
+OSCALL
+Mem_PagesGetMovable(
+    uintptr_t Pa
+    );
+
+// Idle time work, empties a large page worth of blocks when none is free.
+// Returns the number of pages migrated.
+uint32_t
+OSCALL
+Mem_PagesCompactIdle(
+    );
+
+void
+OSCALL
+Mem_PagesStatsGet(
+    MEM_PAGE_STATS* pStats
+    );
+
+void
+OSCALL
+Mem_PagesStatsPrint(
+    );
 
 
 #endif // __KRN_MEM_H__
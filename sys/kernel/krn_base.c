@@ -27,7 +27,146 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // Kernel mode base functionality.
 
 #include <krn_base.h>
+#include <hal_common.h>
 
+// Fills and copies shorter than this are done a byte at a time.
+#define KRN_MEM_SMALL           16
+
+// Blocks at least this large bypass the cache when the CPU can.  They would
+// only push everything else out of it.
+#define KRN_MEM_NT_THRESHOLD    (256*1024)
+
+// Dword loads that may be unaligned and alias anything.
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) KRN_MEM_DWORD;
+
+// Set by Krn_BaseInit when movnti and sfence are available.
+uint32_t g_Krn_MemNtStores = 0;
+
+void
+OSCALL
+Krn_MemStoreNt32(
+    uint32_t* pDest,
+    uint32_t Value,
+    size_t Dwords
+    );
+
+void
+OSCALL
+Krn_MemCopyNt32(
+    uint32_t* pDest,
+    const KRN_MEM_DWORD* pSource,
+    size_t Dwords
+    );
+
+void
+OSCALL
+Krn_TreeRotateLeft(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    );
+
+void
+OSCALL
+Krn_TreeRotateRight(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    );
+
+void
+OSCALL
+Krn_TreeRemoveFixup(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry,
+    KRN_TREE_ENTRY* pParent
+    );
+
+uint32_t
+OSCALL
+Krn_HashIndex(
+    const KRN_HASH_TABLE* pTable,
+    uintptr_t Key
+    );
+
+void
+OSCALL
+Krn_BaseInit(
+    )
+{
+    g_Krn_MemNtStores = (Hal_CpuFeaturesGet() & HAL_CPU_FEATURE_NT_STORE) != 0;
+}
+
+void
+OSCALL
+Krn_MemStoreNt32(
+    uint32_t* pDest,
+    uint32_t Value,
+    size_t Dwords
+    )
+{
+    // movnti only needs SSE2, not the XMM state, so nothing to save.
+    while (Dwords >= 4)
+    {
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[0]) : "r" (Value));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[1]) : "r" (Value));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[2]) : "r" (Value));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[3]) : "r" (Value));
+        pDest += 4;
+        Dwords -= 4;
+    }
+    
+    while (Dwords-- > 0)
+    {
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (*pDest) : "r" (Value));
+        pDest++;
+    }
+    
+    // Weakly ordered, make them visible before anything after us.
+    __asm__ __volatile__ ("sfence" ::: "memory");
+}
+
+void
+OSCALL
+Krn_MemCopyNt32(
+    uint32_t* pDest,
+    const KRN_MEM_DWORD* pSource,
+    size_t Dwords
+    )
+{
+    uint32_t v0;
+    uint32_t v1;
+    uint32_t v2;
+    uint32_t v3;
+    
+    while (Dwords >= 4)
+    {
+        v0 = pSource[0];
+        v1 = pSource[1];
+        v2 = pSource[2];
+        v3 = pSource[3];
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[0]) : "r" (v0));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[1]) : "r" (v1));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[2]) : "r" (v2));
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (pDest[3]) : "r" (v3));
+        pSource += 4;
+        pDest += 4;
+        Dwords -= 4;
+    }
+    
+    while (Dwords-- > 0)
+    {
+        v0 = *pSource++;
+        __asm__ __volatile__ ("movnti %1, %0" : "=m" (*pDest) : "r" (v0));
+        pDest++;
+    }
+    
+    __asm__ __volatile__ ("sfence" ::: "memory");
+}
+
+// 
+// The string primitives align the destination with single bytes, move
+// dwords with rep stosd or rep movsd, then finish with single bytes.  Large
+// blocks use non-temporal stores instead of rep, when the CPU has them.
+// 
 void*
 OSCALL
 memset(
@@ -37,15 +176,224 @@ memset(
     )
 {
     char* pDestChar = (char*) pDest;
+    char* pTail;
+    uint32_t fill;
+    size_t dwords;
     
-    while (Count-- > 0)
+    if (Count < KRN_MEM_SMALL)
+    {
+        while (Count-- > 0)
+        {
+            *pDestChar++ = (char) Value;
+        }
+        
+        return pDest;
+    }
+    
+    while ((uintptr_t) pDestChar & 3)
     {
         *pDestChar++ = (char) Value;
+        Count--;
+    }
+    
+    fill = (uint8_t) Value * 0x01010101U;
+    dwords = Count / 4;
+    pTail = pDestChar + (Count & ~(size_t) 3);
+    
+    if ((g_Krn_MemNtStores) &&
+        (Count >= KRN_MEM_NT_THRESHOLD))
+    {
+        Krn_MemStoreNt32((uint32_t*) pDestChar, fill, dwords);
+    }
+    else
+    {
+        __asm__ __volatile__ (
+                "rep stosl"
+                : "+D" (pDestChar), "+c" (dwords)
+                : "a" (fill)
+                : "memory");
+    }
+    
+    for (Count &= 3; Count > 0; Count--)
+    {
+        *pTail++ = (char) Value;
+    }
+    
+    return pDest;
+}
+
+void*
+OSCALL
+Krn_MemSetNt(
+    void* pDest,
+    int Value,
+    size_t Count
+    )
+{
+    if ((! g_Krn_MemNtStores) ||
+        ((uintptr_t) pDest & 3) ||
+        (Count & 3))
+    {
+        return memset(pDest, Value, Count);
+    }
+    
+    Krn_MemStoreNt32((uint32_t*) pDest, (uint8_t) Value * 0x01010101U, Count / 4);
+    
+    return pDest;
+}
+
+void*
+OSCALL
+memcpy(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    )
+{
+    char* pDestChar = (char*) pDest;
+    const char* pSourceChar = (const char*) pSource;
+    char* pDestTail;
+    const char* pSourceTail;
+    size_t dwords;
+    
+    if (Count < KRN_MEM_SMALL)
+    {
+        while (Count-- > 0)
+        {
+            *pDestChar++ = *pSourceChar++;
+        }
+        
+        return pDest;
+    }
+    
+    // Aligned stores matter more than aligned loads.
+    while ((uintptr_t) pDestChar & 3)
+    {
+        *pDestChar++ = *pSourceChar++;
+        Count--;
+    }
+    
+    dwords = Count / 4;
+    pDestTail = pDestChar + (Count & ~(size_t) 3);
+    pSourceTail = pSourceChar + (Count & ~(size_t) 3);
+    
+    if ((g_Krn_MemNtStores) &&
+        (Count >= KRN_MEM_NT_THRESHOLD))
+    {
+        Krn_MemCopyNt32((uint32_t*) pDestChar, (const KRN_MEM_DWORD*) pSourceChar, dwords);
+    }
+    else
+    {
+        __asm__ __volatile__ (
+                "rep movsl"
+                : "+D" (pDestChar), "+S" (pSourceChar), "+c" (dwords)
+                :
+                : "memory");
+    }
+    
+    for (Count &= 3; Count > 0; Count--)
+    {
+        *pDestTail++ = *pSourceTail++;
+    }
+    
+    return pDest;
+}
+
+void*
+OSCALL
+memmove(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    )
+{
+    char* pDestChar;
+    const char* pSourceChar;
+    size_t dwords;
+    
+    // Forward is safe unless the destination starts inside the source.
+    if (((uintptr_t) pDest - (uintptr_t) pSource) >= Count)
+    {
+        return memcpy(pDest, pSource, Count);
+    }
+    
+    if (pDest == pSource)
+    {
+        return pDest;
+    }
+    
+    // Backwards from the end, aligning the end of the destination.
+    pDestChar = (char*) pDest + Count;
+    pSourceChar = (const char*) pSource + Count;
+    
+    while ((Count > 0) &&
+           ((uintptr_t) pDestChar & 3))
+    {
+        *--pDestChar = *--pSourceChar;
+        Count--;
+    }
+    
+    dwords = Count / 4;
+    if (dwords)
+    {
+        pDestChar -= 4;
+        pSourceChar -= 4;
+        
+        // An interrupt here sees DF set, HalIsr_Generic clears it on entry.
+        __asm__ __volatile__ (
+                "std\n\t"
+                "rep movsl\n\t"
+                "cld"
+                : "+D" (pDestChar), "+S" (pSourceChar), "+c" (dwords)
+                :
+                : "memory");
+        
+        pDestChar += 4;
+        pSourceChar += 4;
+    }
+    
+    for (Count &= 3; Count > 0; Count--)
+    {
+        *--pDestChar = *--pSourceChar;
     }
     
     return pDest;
 }
 
+int
+OSCALL
+memcmp(
+    const void* pLeft,
+    const void* pRight,
+    size_t Count
+    )
+{
+    const uint8_t* pLeftByte = (const uint8_t*) pLeft;
+    const uint8_t* pRightByte = (const uint8_t*) pRight;
+    
+    // Skip equal dwords, the first difference is then found by bytes.
+    while ((Count >= 4) &&
+           (*(const KRN_MEM_DWORD*) pLeftByte == *(const KRN_MEM_DWORD*) pRightByte))
+    {
+        pLeftByte += 4;
+        pRightByte += 4;
+        Count -= 4;
+    }
+    
+    while (Count-- > 0)
+    {
+        if (*pLeftByte != *pRightByte)
+        {
+            return (int) *pLeftByte - (int) *pRightByte;
+        }
+        
+        pLeftByte++;
+        pRightByte++;
+    }
+    
+    return 0;
+}
+
 uint32_t g_KrnCheckPoint = 1;
 
 void
@@ -58,124 +406,261 @@ Krn_CheckPoint(
     }
 }
 
-// Interlocked functions.
-uint32_t
+// Spin lock functions.
+void
 OSCALL
-Krn_InterlockedInc32(
-    uint32_t* pDest
+Krn_SpinLockInit(
+    KRN_SPINLOCK* pLock
     )
 {
-    return __sync_fetch_and_add(pDest, 1);
+    pLock->Locked = 0;
 }
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedInc64(
-    uint32_t* pDest
+Krn_SpinLockAcquireSlow(
+    KRN_SPINLOCK* pLock
     )
 {
-    return __sync_fetch_and_add(pDest, 1ULL);
+    do
+    {
+        while (Krn_AtomicLoad32Relaxed(&pLock->Locked))
+        {
+            KRN_PAUSE();
+        }
+    } while (Krn_InterlockedExg32(&pLock->Locked, 1));
 }
 
 uint32_t
 OSCALL
-Krn_InterlockedDec32(
-    uint32_t* pDest
+Krn_SpinLockAcquireIrq(
+    KRN_SPINLOCK* pLock
     )
 {
-    return __sync_fetch_and_add(pDest, -1);
+    uint32_t intState;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(pLock);
+    
+    return intState;
 }
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedDec64(
-    uint64_t* pDest
+Krn_SpinLockReleaseIrq(
+    KRN_SPINLOCK* pLock,
+    uint32_t IntState
     )
 {
-    return __sync_fetch_and_add(pDest, -1LL);
+    Krn_SpinLockRelease(pLock);
+    Hal_InterruptsRestore(IntState);
 }
 
-uint32_t
+// Ticket lock functions.
+void
 OSCALL
-Krn_InterlockedAdd32(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_TicketLockInit(
+    KRN_TICKET_LOCK* pLock
     )
 {
-    return __sync_fetch_and_add(pDest, Value);
+    pLock->Next = 0;
+    pLock->Owner = 0;
 }
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedAdd64(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_TicketLockAcquireSlow(
+    KRN_TICKET_LOCK* pLock,
+    uint32_t Ticket
     )
 {
-    return __sync_fetch_and_add(pDest, Value);
+    while (Krn_AtomicLoad32Acquire(&pLock->Owner) != Ticket)
+    {
+        KRN_PAUSE();
+    }
 }
 
 uint32_t
 OSCALL
-Krn_InterlockedExg32(
-    uint32_t* pDest,
-    uint32_t Value
+Krn_TicketLockAcquireIrq(
+    KRN_TICKET_LOCK* pLock
+    )
+{
+    uint32_t intState;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_TicketLockAcquire(pLock);
+    
+    return intState;
+}
+
+void
+OSCALL
+Krn_TicketLockReleaseIrq(
+    KRN_TICKET_LOCK* pLock,
+    uint32_t IntState
+    )
+{
+    Krn_TicketLockRelease(pLock);
+    Hal_InterruptsRestore(IntState);
+}
+
+// MCS lock functions.
+void
+OSCALL
+Krn_McsLockInit(
+    KRN_MCS_LOCK* pLock
+    )
+{
+    pLock->pTail = NULL;
+}
+
+void
+OSCALL
+Krn_McsLockAcquireSlow(
+    KRN_MCS_NODE* pPrev,
+    KRN_MCS_NODE* pNode
     )
 {
-    return __sync_lock_test_and_set(pDest, Value);
+    // Queue behind the previous tail and wait for it to hand over.
+    pPrev->pNext = pNode;
+    
+    while (Krn_AtomicLoad32Acquire(&pNode->Locked))
+    {
+        KRN_PAUSE();
+    }
 }
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedExg64(
-    uint64_t* pDest,
-    uint64_t Value
+Krn_McsLockReleaseSlow(
+    KRN_MCS_NODE* pNode
     )
 {
-    return __sync_lock_test_and_set(pDest, Value);
+    // A waiter has swapped the tail, wait for it to link in.
+    while (! pNode->pNext)
+    {
+        KRN_PAUSE();
+    }
+    
+    Krn_AtomicStore32Release(&pNode->pNext->Locked, 0);
 }
 
 uint32_t
 OSCALL
-Krn_InterlockedCmpExg32(
-    uint32_t* pDest,
-    uint32_t Value,
-    uint32_t Compare
+Krn_McsLockAcquireIrq(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode
     )
 {
-    return __sync_val_compare_and_swap(pDest, Compare, Value);
+    uint32_t intState;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_McsLockAcquire(pLock, pNode);
+    
+    return intState;
 }
 
-uint64_t
+void
 OSCALL
-Krn_InterlockedCmpExg64(
-    uint64_t* pDest,
-    uint64_t Value,
-    uint64_t Compare
+Krn_McsLockReleaseIrq(
+    KRN_MCS_LOCK* pLock,
+    KRN_MCS_NODE* pNode,
+    uint32_t IntState
     )
 {
-    return __sync_val_compare_and_swap(pDest, Compare, Value);
+    Krn_McsLockRelease(pLock, pNode);
+    Hal_InterruptsRestore(IntState);
 }
 
-void*
+// Reader-writer lock functions.
+void
 OSCALL
-Krn_InterlockedExgPtr(
-    void** pDest,
-    void* Value
+Krn_RwLockInit(
+    KRN_RWLOCK* pLock
     )
 {
-    return __sync_lock_test_and_set(pDest, Value);
+    pLock->Value = 0;
 }
 
-void*
+void
+OSCALL
+Krn_RwLockAcquireReadSlow(
+    KRN_RWLOCK* pLock
+    )
+{
+    while (1)
+    {
+        while (Krn_AtomicLoad32Relaxed(&pLock->Value) & (KRN_RWLOCK_WRITER | KRN_RWLOCK_WAITING))
+        {
+            KRN_PAUSE();
+        }
+        
+        if ((Krn_InterlockedInc32(&pLock->Value) & KRN_RWLOCK_WRITER) == 0)
+        {
+            return;
+        }
+        
+        Krn_InterlockedDec32(&pLock->Value);
+    }
+}
+
+void
+OSCALL
+Krn_RwLockAcquireWriteSlow(
+    KRN_RWLOCK* pLock
+    )
+{
+    uint32_t value;
+    
+    while (1)
+    {
+        value = Krn_AtomicLoad32Relaxed(&pLock->Value);
+        
+        // Free apart from other writers' waiting flag, which taking the lock
+        // clears.  They set it again on their next pass.
+        if ((value & ~KRN_RWLOCK_WAITING) == 0)
+        {
+            if (Krn_InterlockedCmpExg32(&pLock->Value, KRN_RWLOCK_WRITER, value) == value)
+            {
+                return;
+            }
+        }
+        else if ((value & KRN_RWLOCK_WAITING) == 0)
+        {
+            Krn_InterlockedOr32(&pLock->Value, KRN_RWLOCK_WAITING);
+        }
+        
+        KRN_PAUSE();
+    }
+}
+
+// Sequence lock functions.
+void
+OSCALL
+Krn_SeqLockInit(
+    KRN_SEQLOCK* pLock
+    )
+{
+    pLock->Sequence = 0;
+    Krn_SpinLockInit(&pLock->Lock);
+}
+
+uint32_t
 OSCALL
-Krn_InterlockedCmpExgPtr(
-    void** pDest,
-    void* Value,
-    void* Compare
+Krn_SeqLockReadBeginSlow(
+    const KRN_SEQLOCK* pLock
     )
 {
-    return __sync_val_compare_and_swap(pDest, Compare, Value);
+    uint32_t sequence;
+    
+    // Wait out a write in progress rather than copy data sure to be torn.
+    while ((sequence = Krn_AtomicLoad32Acquire(&pLock->Sequence)) & 1)
+    {
+        KRN_PAUSE();
+    }
+    
+    return sequence;
 }
 
 // Stack functions.
@@ -205,7 +690,7 @@ Krn_StackPush(
         pEntry->pNext = pOldVal;
         
         pExcVal = Krn_InterlockedCmpExgPtr(
-                (void**) &pStack->pNext,
+                (void* volatile*) &pStack->pNext,
                 pEntry,
                 pOldVal);
     } while (pExcVal != pOldVal);
@@ -228,7 +713,7 @@ Krn_StackPop(
         if (pOldVal)
         {
             pExcVal = Krn_InterlockedCmpExgPtr(
-                    (void**) &pStack->pNext,
+                    (void* volatile*) &pStack->pNext,
                     pOldVal->pNext,
                     pOldVal);
         }
@@ -243,6 +728,177 @@ Krn_StackPop(
     return pOldVal;
 }
 
+// Tagged stack functions.
+void
+OSCALL
+Krn_TaggedStackInit(
+    KRN_TAGGED_STACK* pStack
+    )
+{
+    pStack->Head = 0;
+}
+
+void
+OSCALL
+Krn_TaggedStackPush(
+    KRN_TAGGED_STACK* pStack,
+    KRN_STACK_ENTRY* pEntry
+    )
+{
+    Krn_TaggedStackPushList(pStack, pEntry, pEntry);
+}
+
+void
+OSCALL
+Krn_TaggedStackPushList(
+    KRN_TAGGED_STACK* pStack,
+    KRN_STACK_ENTRY* pFirst,
+    KRN_STACK_ENTRY* pLast
+    )
+{
+    uint64_t OldVal;
+    uint64_t NewVal;
+    
+    // A push can't be fooled by a recycled top, so the generation is kept.
+    do
+    {
+        OldVal = *(volatile uint64_t*) &pStack->Head;
+        pLast->pNext = (KRN_STACK_ENTRY*) (uintptr_t) (OldVal & KRN_TAGGED_PTR_MASK);
+        NewVal = (OldVal & ~KRN_TAGGED_PTR_MASK) | (uintptr_t) pFirst;
+    } while (Krn_InterlockedCmpExg64(&pStack->Head, NewVal, OldVal) != OldVal);
+}
+
+KRN_STACK_ENTRY*
+OSCALL
+Krn_TaggedStackPop(
+    KRN_TAGGED_STACK* pStack
+    )
+{
+    KRN_STACK_ENTRY* pEntry;
+    uint64_t OldVal;
+    uint64_t NewVal;
+    
+    // The two halves may be read torn on 32 bit, but then the exchange fails.
+    do
+    {
+        OldVal = *(volatile uint64_t*) &pStack->Head;
+        pEntry = (KRN_STACK_ENTRY*) (uintptr_t) (OldVal & KRN_TAGGED_PTR_MASK);
+        
+        if (!pEntry)
+        {
+            // Empty.
+            return NULL;
+        }
+        
+        NewVal = (OldVal | KRN_TAGGED_PTR_MASK) + 1;
+        NewVal |= (uintptr_t) pEntry->pNext;
+    } while (Krn_InterlockedCmpExg64(&pStack->Head, NewVal, OldVal) != OldVal);
+    
+    return pEntry;
+}
+
+KRN_STACK_ENTRY*
+OSCALL
+Krn_TaggedStackPopAll(
+    KRN_TAGGED_STACK* pStack
+    )
+{
+    KRN_STACK_ENTRY* pEntry;
+    uint64_t OldVal;
+    uint64_t NewVal;
+    
+    do
+    {
+        OldVal = *(volatile uint64_t*) &pStack->Head;
+        pEntry = (KRN_STACK_ENTRY*) (uintptr_t) (OldVal & KRN_TAGGED_PTR_MASK);
+        
+        if (!pEntry)
+        {
+            return NULL;
+        }
+        
+        NewVal = (OldVal | KRN_TAGGED_PTR_MASK) + 1;
+    } while (Krn_InterlockedCmpExg64(&pStack->Head, NewVal, OldVal) != OldVal);
+    
+    return pEntry;
+}
+
+// Ring functions.
+KRN_ERROR_CODE
+OSCALL
+Krn_RingInit(
+    KRN_RING* pRing,
+    void** pSlots,
+    uint32_t SlotCount
+    )
+{
+    if ((SlotCount == 0) ||
+        (SlotCount & (SlotCount - 1)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pRing->Head = 0;
+    pRing->TailCache = 0;
+    pRing->Tail = 0;
+    pRing->Claim = 0;
+    pRing->HeadCache = 0;
+    pRing->pSlots = pSlots;
+    pRing->Mask = SlotCount - 1;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+uint32_t
+OSCALL
+Krn_RingEnqueueMp(
+    KRN_RING* pRing,
+    void* const* pItems,
+    uint32_t Count
+    )
+{
+    uint32_t intState;
+    uint32_t claim;
+    uint32_t room;
+    uint32_t i;
+    
+    intState = Hal_InterruptsDisable();
+    
+    do
+    {
+        claim = pRing->Claim;
+        room = pRing->Mask + 1 - (claim - pRing->Head);
+        
+        if (room < Count)
+        {
+            Count = room;
+            
+            if (Count == 0)
+            {
+                Hal_InterruptsRestore(intState);
+                return 0;
+            }
+        }
+    } while (Krn_InterlockedCmpExg32(&pRing->Claim, claim + Count, claim) != claim);
+    
+    for (i = 0; i < Count; i++)
+    {
+        pRing->pSlots[(claim + i) & pRing->Mask] = pItems[i];
+    }
+    
+    // Publish in claim order, the consumer takes everything below Tail.
+    while (Krn_AtomicLoad32Relaxed(&pRing->Tail) != claim)
+    {
+        KRN_PAUSE();
+    }
+    
+    Krn_AtomicStore32Release(&pRing->Tail, claim + Count);
+    
+    Hal_InterruptsRestore(intState);
+    
+    return Count;
+}
+
 // List functions.
 void
 OSCALL
@@ -353,3 +1009,687 @@ Krn_ListAddEntry(
 
 
 
+
+// Tree functions.
+void
+OSCALL
+Krn_TreeInit(
+    KRN_TREE* pTree
+    )
+{
+    pTree->pRoot = NULL;
+    pTree->Count = 0;
+}
+
+void
+OSCALL
+Krn_TreeRotateLeft(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pChild;
+    
+    pChild = pEntry->pRight;
+    
+    pEntry->pRight = pChild->pLeft;
+    if (pChild->pLeft)
+    {
+        pChild->pLeft->pParent = pEntry;
+    }
+    
+    pChild->pParent = pEntry->pParent;
+    if (! pEntry->pParent)
+    {
+        pTree->pRoot = pChild;
+    }
+    else if (pEntry == pEntry->pParent->pLeft)
+    {
+        pEntry->pParent->pLeft = pChild;
+    }
+    else
+    {
+        pEntry->pParent->pRight = pChild;
+    }
+    
+    pChild->pLeft = pEntry;
+    pEntry->pParent = pChild;
+}
+
+void
+OSCALL
+Krn_TreeRotateRight(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pChild;
+    
+    pChild = pEntry->pLeft;
+    
+    pEntry->pLeft = pChild->pRight;
+    if (pChild->pRight)
+    {
+        pChild->pRight->pParent = pEntry;
+    }
+    
+    pChild->pParent = pEntry->pParent;
+    if (! pEntry->pParent)
+    {
+        pTree->pRoot = pChild;
+    }
+    else if (pEntry == pEntry->pParent->pRight)
+    {
+        pEntry->pParent->pRight = pChild;
+    }
+    else
+    {
+        pEntry->pParent->pLeft = pChild;
+    }
+    
+    pChild->pRight = pEntry;
+    pEntry->pParent = pChild;
+}
+
+void
+OSCALL
+Krn_TreeInsert(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pParent;
+    KRN_TREE_ENTRY* pGrand;
+    KRN_TREE_ENTRY* pUncle;
+    KRN_TREE_ENTRY** ppLink;
+    
+    // Equal keys go right, after the ones already there.
+    pParent = NULL;
+    ppLink = &pTree->pRoot;
+    
+    while (*ppLink)
+    {
+        pParent = *ppLink;
+        ppLink = (pEntry->Key < pParent->Key) ? &pParent->pLeft : &pParent->pRight;
+    }
+    
+    pEntry->pParent = pParent;
+    pEntry->pLeft = NULL;
+    pEntry->pRight = NULL;
+    pEntry->Red = 1;
+    *ppLink = pEntry;
+    pTree->Count++;
+    
+    // Fix red parents of red entries, recoloring while the uncle is red and
+    // rotating at most twice when it isn't.
+    while (((pParent = pEntry->pParent) != NULL) &&
+           (pParent->Red))
+    {
+        // A red parent is never the root, so there is a grandparent.
+        pGrand = pParent->pParent;
+        
+        if (pParent == pGrand->pLeft)
+        {
+            pUncle = pGrand->pRight;
+            
+            if ((pUncle) &&
+                (pUncle->Red))
+            {
+                pParent->Red = 0;
+                pUncle->Red = 0;
+                pGrand->Red = 1;
+                pEntry = pGrand;
+                continue;
+            }
+            
+            if (pEntry == pParent->pRight)
+            {
+                Krn_TreeRotateLeft(pTree, pParent);
+                pEntry = pParent;
+                pParent = pEntry->pParent;
+            }
+            
+            pParent->Red = 0;
+            pGrand->Red = 1;
+            Krn_TreeRotateRight(pTree, pGrand);
+        }
+        else
+        {
+            pUncle = pGrand->pLeft;
+            
+            if ((pUncle) &&
+                (pUncle->Red))
+            {
+                pParent->Red = 0;
+                pUncle->Red = 0;
+                pGrand->Red = 1;
+                pEntry = pGrand;
+                continue;
+            }
+            
+            if (pEntry == pParent->pLeft)
+            {
+                Krn_TreeRotateRight(pTree, pParent);
+                pEntry = pParent;
+                pParent = pEntry->pParent;
+            }
+            
+            pParent->Red = 0;
+            pGrand->Red = 1;
+            Krn_TreeRotateLeft(pTree, pGrand);
+        }
+    }
+    
+    pTree->pRoot->Red = 0;
+}
+
+void
+OSCALL
+Krn_TreeRemove(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pUnlink;
+    KRN_TREE_ENTRY* pChild;
+    KRN_TREE_ENTRY* pParent;
+    uint32_t unlinkedRed;
+    
+    // Unlink pEntry if it has a free side, otherwise its successor, which
+    // then takes pEntry's place.
+    if ((! pEntry->pLeft) ||
+        (! pEntry->pRight))
+    {
+        pUnlink = pEntry;
+    }
+    else
+    {
+        pUnlink = pEntry->pRight;
+        while (pUnlink->pLeft)
+        {
+            pUnlink = pUnlink->pLeft;
+        }
+    }
+    
+    pChild = pUnlink->pLeft ? pUnlink->pLeft : pUnlink->pRight;
+    pParent = pUnlink->pParent;
+    unlinkedRed = pUnlink->Red;
+    
+    if (pChild)
+    {
+        pChild->pParent = pParent;
+    }
+    
+    if (! pParent)
+    {
+        pTree->pRoot = pChild;
+    }
+    else if (pUnlink == pParent->pLeft)
+    {
+        pParent->pLeft = pChild;
+    }
+    else
+    {
+        pParent->pRight = pChild;
+    }
+    
+    if (pUnlink != pEntry)
+    {
+        if (pParent == pEntry)
+        {
+            pParent = pUnlink;
+        }
+        
+        pUnlink->pParent = pEntry->pParent;
+        pUnlink->pLeft = pEntry->pLeft;
+        pUnlink->pRight = pEntry->pRight;
+        pUnlink->Red = pEntry->Red;
+        
+        if (! pEntry->pParent)
+        {
+            pTree->pRoot = pUnlink;
+        }
+        else if (pEntry == pEntry->pParent->pLeft)
+        {
+            pEntry->pParent->pLeft = pUnlink;
+        }
+        else
+        {
+            pEntry->pParent->pRight = pUnlink;
+        }
+        
+        if (pUnlink->pLeft)
+        {
+            pUnlink->pLeft->pParent = pUnlink;
+        }
+        
+        if (pUnlink->pRight)
+        {
+            pUnlink->pRight->pParent = pUnlink;
+        }
+    }
+    
+    pTree->Count--;
+    
+    // Taking out a black entry leaves its side one black short.
+    if (! unlinkedRed)
+    {
+        Krn_TreeRemoveFixup(pTree, pChild, pParent);
+    }
+}
+
+void
+OSCALL
+Krn_TreeRemoveFixup(
+    KRN_TREE* pTree,
+    KRN_TREE_ENTRY* pEntry,
+    KRN_TREE_ENTRY* pParent
+    )
+{
+    KRN_TREE_ENTRY* pSibling;
+    
+    // pEntry, which may be NULL, is a black short.  A red one just turns
+    // black, otherwise borrow from the sibling or push the shortage up.
+    while ((pEntry != pTree->pRoot) &&
+           ((! pEntry) || (! pEntry->Red)))
+    {
+        // The short side is one black down, so the sibling exists.
+        if (pEntry == pParent->pLeft)
+        {
+            pSibling = pParent->pRight;
+            
+            if (pSibling->Red)
+            {
+                pSibling->Red = 0;
+                pParent->Red = 1;
+                Krn_TreeRotateLeft(pTree, pParent);
+                pSibling = pParent->pRight;
+            }
+            
+            if (((! pSibling->pLeft) || (! pSibling->pLeft->Red)) &&
+                ((! pSibling->pRight) || (! pSibling->pRight->Red)))
+            {
+                pSibling->Red = 1;
+                pEntry = pParent;
+                pParent = pEntry->pParent;
+                continue;
+            }
+            
+            if ((! pSibling->pRight) ||
+                (! pSibling->pRight->Red))
+            {
+                pSibling->pLeft->Red = 0;
+                pSibling->Red = 1;
+                Krn_TreeRotateRight(pTree, pSibling);
+                pSibling = pParent->pRight;
+            }
+            
+            pSibling->Red = pParent->Red;
+            pParent->Red = 0;
+            pSibling->pRight->Red = 0;
+            Krn_TreeRotateLeft(pTree, pParent);
+        }
+        else
+        {
+            pSibling = pParent->pLeft;
+            
+            if (pSibling->Red)
+            {
+                pSibling->Red = 0;
+                pParent->Red = 1;
+                Krn_TreeRotateRight(pTree, pParent);
+                pSibling = pParent->pLeft;
+            }
+            
+            if (((! pSibling->pLeft) || (! pSibling->pLeft->Red)) &&
+                ((! pSibling->pRight) || (! pSibling->pRight->Red)))
+            {
+                pSibling->Red = 1;
+                pEntry = pParent;
+                pParent = pEntry->pParent;
+                continue;
+            }
+            
+            if ((! pSibling->pLeft) ||
+                (! pSibling->pLeft->Red))
+            {
+                pSibling->pRight->Red = 0;
+                pSibling->Red = 1;
+                Krn_TreeRotateLeft(pTree, pSibling);
+                pSibling = pParent->pLeft;
+            }
+            
+            pSibling->Red = pParent->Red;
+            pParent->Red = 0;
+            pSibling->pLeft->Red = 0;
+            Krn_TreeRotateRight(pTree, pParent);
+        }
+        
+        pEntry = pTree->pRoot;
+        break;
+    }
+    
+    if (pEntry)
+    {
+        pEntry->Red = 0;
+    }
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFind(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    
+    pEntry = Krn_TreeFindCeiling(pTree, Key);
+    
+    return ((pEntry) && (pEntry->Key == Key)) ? pEntry : NULL;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFindFloor(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    KRN_TREE_ENTRY* pFound;
+    
+    pFound = NULL;
+    pEntry = pTree->pRoot;
+    
+    while (pEntry)
+    {
+        if (pEntry->Key <= Key)
+        {
+            pFound = pEntry;
+            pEntry = pEntry->pRight;
+        }
+        else
+        {
+            pEntry = pEntry->pLeft;
+        }
+    }
+    
+    return pFound;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFindCeiling(
+    const KRN_TREE* pTree,
+    uint64_t Key
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    KRN_TREE_ENTRY* pFound;
+    
+    pFound = NULL;
+    pEntry = pTree->pRoot;
+    
+    while (pEntry)
+    {
+        if (pEntry->Key >= Key)
+        {
+            pFound = pEntry;
+            pEntry = pEntry->pLeft;
+        }
+        else
+        {
+            pEntry = pEntry->pRight;
+        }
+    }
+    
+    return pFound;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeFirst(
+    const KRN_TREE* pTree
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    
+    pEntry = pTree->pRoot;
+    
+    while ((pEntry) &&
+           (pEntry->pLeft))
+    {
+        pEntry = pEntry->pLeft;
+    }
+    
+    return pEntry;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeLast(
+    const KRN_TREE* pTree
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    
+    pEntry = pTree->pRoot;
+    
+    while ((pEntry) &&
+           (pEntry->pRight))
+    {
+        pEntry = pEntry->pRight;
+    }
+    
+    return pEntry;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreeNext(
+    const KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pNext;
+    
+    if (pEntry->pRight)
+    {
+        pNext = pEntry->pRight;
+        while (pNext->pLeft)
+        {
+            pNext = pNext->pLeft;
+        }
+        
+        return pNext;
+    }
+    
+    // Up until we come from a left child.
+    pNext = pEntry->pParent;
+    while ((pNext) &&
+           (pEntry == pNext->pRight))
+    {
+        pEntry = pNext;
+        pNext = pNext->pParent;
+    }
+    
+    return pNext;
+}
+
+KRN_TREE_ENTRY*
+OSCALL
+Krn_TreePrev(
+    const KRN_TREE_ENTRY* pEntry
+    )
+{
+    KRN_TREE_ENTRY* pPrev;
+    
+    if (pEntry->pLeft)
+    {
+        pPrev = pEntry->pLeft;
+        while (pPrev->pRight)
+        {
+            pPrev = pPrev->pRight;
+        }
+        
+        return pPrev;
+    }
+    
+    pPrev = pEntry->pParent;
+    while ((pPrev) &&
+           (pEntry == pPrev->pLeft))
+    {
+        pEntry = pPrev;
+        pPrev = pPrev->pParent;
+    }
+    
+    return pPrev;
+}
+
+// Hash table functions.
+uint32_t
+OSCALL
+Krn_HashIndex(
+    const KRN_HASH_TABLE* pTable,
+    uintptr_t Key
+    )
+{
+    // Fibonacci hashing.  The high half of the product mixes every key bit,
+    // so sequential handles and aligned addresses spread out.
+    return (uint32_t) (((uint64_t) Key * 0x9E3779B97F4A7C15ULL) >> 32) & pTable->Mask;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_HashInit(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY** ppSlots,
+    uint32_t SlotCount
+    )
+{
+    if ((SlotCount < 4) ||
+        (SlotCount & (SlotCount - 1)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    memset(ppSlots, 0, SlotCount * sizeof(KRN_HASH_ENTRY*));
+    
+    pTable->ppSlots = ppSlots;
+    pTable->Mask = SlotCount - 1;
+    pTable->Count = 0;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_HashInsert(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY* pEntry
+    )
+{
+    uint32_t index;
+    
+    index = Krn_HashIndex(pTable, pEntry->Key);
+    
+    while (pTable->ppSlots[index])
+    {
+        if (pTable->ppSlots[index]->Key == pEntry->Key)
+        {
+            return KRN_ERR_INV_PARAMETER;
+        }
+        
+        index = (index + 1) & pTable->Mask;
+    }
+    
+    // Past three quarters full, probe runs get long.
+    if (pTable->Count >= (pTable->Mask + 1) - ((pTable->Mask + 1) / 4))
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    pTable->ppSlots[index] = pEntry;
+    pTable->Count++;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_HashRemove(
+    KRN_HASH_TABLE* pTable,
+    KRN_HASH_ENTRY* pEntry
+    )
+{
+    uint32_t index;
+    uint32_t next;
+    uint32_t home;
+    
+    index = Krn_HashIndex(pTable, pEntry->Key);
+    
+    while (pTable->ppSlots[index] != pEntry)
+    {
+        if (! pTable->ppSlots[index])
+        {
+            return KRN_ERR_INV_PARAMETER;
+        }
+        
+        index = (index + 1) & pTable->Mask;
+    }
+    
+    // Move back later entries of the run whose probe passed the hole, so
+    // no lookup stops early at it.
+    next = index;
+    
+    while (1)
+    {
+        next = (next + 1) & pTable->Mask;
+        
+        if (! pTable->ppSlots[next])
+        {
+            break;
+        }
+        
+        home = Krn_HashIndex(pTable, pTable->ppSlots[next]->Key);
+        
+        if (((index - home) & pTable->Mask) < ((next - home) & pTable->Mask))
+        {
+            pTable->ppSlots[index] = pTable->ppSlots[next];
+            index = next;
+        }
+    }
+    
+    pTable->ppSlots[index] = NULL;
+    pTable->Count--;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_HASH_ENTRY*
+OSCALL
+Krn_HashFind(
+    const KRN_HASH_TABLE* pTable,
+    uintptr_t Key
+    )
+{
+    KRN_HASH_ENTRY* pEntry;
+    uint32_t index;
+    
+    index = Krn_HashIndex(pTable, Key);
+    
+    while ((pEntry = pTable->ppSlots[index]) != NULL)
+    {
+        if (pEntry->Key == Key)
+        {
+            return pEntry;
+        }
+        
+        index = (index + 1) & pTable->Mask;
+    }
+    
+    return NULL;
+}
+
+
+
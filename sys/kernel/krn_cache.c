@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Kernel object caches.
+
+#include <krn_base.h>
+#include <krn_mem.h>
+#include <krn_cache.h>
+
+// Slabs are sized to hold at least this many objects.
+#define KRN_CACHE_MIN_OBJECTS       8
+
+// 
+// Each slab starts with one cache line of header, objects follow.
+// 
+typedef struct _KRN_CACHE_SLAB
+{
+    KRN_STACK_ENTRY SlabEntry;
+    uintptr_t SlabPa;
+} KRN_CACHE_SLAB;
+
+KRN_STACK_ENTRY*
+OSCALL
+Krn_CacheGrow(
+    KRN_CACHE* pCache
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Krn_CacheCreate(
+    KRN_CACHE* pCache,
+    const char* pName,
+    size_t ObjectSize
+    )
+{
+    uint32_t slabPages;
+    
+    if ((ObjectSize == 0) ||
+        (ObjectSize > (64 * MEM_PAGE_SIZE)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // Round up to whole cache lines so no two objects share a line.
+    ObjectSize = (ObjectSize + KRN_CACHE_LINE_SIZE - 1) & ~(KRN_CACHE_LINE_SIZE - 1);
+    
+    // Smallest power of two pages that hold a reasonable number of objects.
+    slabPages = 1;
+    while (((slabPages * MEM_PAGE_SIZE) - KRN_CACHE_LINE_SIZE) < (KRN_CACHE_MIN_OBJECTS * ObjectSize))
+    {
+        slabPages *= 2;
+    }
+    
+    Krn_TaggedStackInit(&pCache->FreeStack);
+    Krn_StackInit(&pCache->SlabStack);
+    pCache->pName = pName;
+    pCache->ObjectSize = ObjectSize;
+    pCache->SlabPages = slabPages;
+    pCache->ObjectsPerSlab = ((slabPages * MEM_PAGE_SIZE) - KRN_CACHE_LINE_SIZE) / ObjectSize;
+    pCache->SlabCount = 0;
+    pCache->ObjectsInUse = 0;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_CacheDestroy(
+    KRN_CACHE* pCache
+    )
+{
+    KRN_STACK_ENTRY* pEntry;
+    
+    if (pCache->ObjectsInUse != 0)
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    Krn_TaggedStackInit(&pCache->FreeStack);
+    
+    while ((pEntry = Krn_StackPop(&pCache->SlabStack)) != NULL)
+    {
+        KRN_CACHE_SLAB* pSlab = (KRN_CACHE_SLAB*) pEntry;
+        
+        Mem_PagesFree(pSlab->SlabPa, pCache->SlabPages);
+        Krn_InterlockedDec32(&pCache->SlabCount);
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+void*
+OSCALL
+Krn_CacheAlloc(
+    KRN_CACHE* pCache
+    )
+{
+    KRN_STACK_ENTRY* pEntry;
+    
+    pEntry = Krn_TaggedStackPop(&pCache->FreeStack);
+    
+    if (! pEntry)
+    {
+        pEntry = Krn_CacheGrow(pCache);
+        
+        if (! pEntry)
+        {
+            return NULL;
+        }
+    }
+    
+    Krn_InterlockedInc32(&pCache->ObjectsInUse);
+    
+    return pEntry;
+}
+
+void
+OSCALL
+Krn_CacheFree(
+    KRN_CACHE* pCache,
+    void* pObject
+    )
+{
+    Krn_TaggedStackPush(&pCache->FreeStack, (KRN_STACK_ENTRY*) pObject);
+    Krn_InterlockedDec32(&pCache->ObjectsInUse);
+}
+
+KRN_STACK_ENTRY*
+OSCALL
+Krn_CacheGrow(
+    KRN_CACHE* pCache
+    )
+{
+    KRN_CACHE_SLAB* pSlab;
+    KRN_STACK_ENTRY* pEntry;
+    char* pObjects;
+    uintptr_t slabPa;
+    uint32_t i;
+    
+    // Slabs hold kernel pointers, so they have to stay mapped and in place.
+    if (Mem_PagesAlloc(
+            pCache->SlabPages,
+            MEM_TYPE_OBJECTS | MEM_OPTS_MAPPED | MEM_OPTS_SYS_CRITICAL,
+            &slabPa) != KRN_ERR_SUCCESS)
+    {
+        return NULL;
+    }
+    
+    pSlab = (KRN_CACHE_SLAB*) Mem_PagesPaToVa(slabPa);
+    pSlab->SlabPa = slabPa;
+    Krn_StackPush(&pCache->SlabStack, &pSlab->SlabEntry);
+    Krn_InterlockedInc32(&pCache->SlabCount);
+    
+    // Keep the first object for the caller, chain the rest and free them in
+    // one go.
+    pObjects = ((char*) pSlab) + KRN_CACHE_LINE_SIZE;
+    
+    if (pCache->ObjectsPerSlab > 1)
+    {
+        for (i = 1; i < pCache->ObjectsPerSlab - 1; i++)
+        {
+            pEntry = (KRN_STACK_ENTRY*) &pObjects[i * pCache->ObjectSize];
+            pEntry->pNext = (KRN_STACK_ENTRY*) &pObjects[(i + 1) * pCache->ObjectSize];
+        }
+        
+        Krn_TaggedStackPushList(
+                &pCache->FreeStack,
+                (KRN_STACK_ENTRY*) &pObjects[pCache->ObjectSize],
+                (KRN_STACK_ENTRY*) &pObjects[i * pCache->ObjectSize]);
+    }
+    
+    return (KRN_STACK_ENTRY*) pObjects;
+}
@@ -0,0 +1,110 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Per-CPU statistics counters.
+
+#include <krn_base.h>
+#include <krn_counter.h>
+#include <krn_cpu.h>
+#include <hal_common.h>
+
+typedef struct _KRN_COUNTER_STATE
+{
+    volatile uint32_t CpuCount;
+    KRN_COUNTER_CPU* volatile pCpus[KRN_COUNTER_MAX_CPUS];
+} KRN_COUNTER_STATE;
+
+KRN_COUNTER_STATE g_Krn_CounterState;
+
+void
+OSCALL
+Krn_CounterInit(
+    )
+{
+    memset(&g_Krn_CounterState, 0, sizeof(g_Krn_CounterState));
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_CounterCpuInit(
+    )
+{
+    KRN_COUNTER_CPU* pCpu;
+    uint32_t index;
+    
+    pCpu = &Hal_GetCpuData()->Counters;
+    
+    memset(pCpu, 0, sizeof(*pCpu));
+    
+    index = Krn_InterlockedInc32(&g_Krn_CounterState.CpuCount);
+    if (index >= KRN_COUNTER_MAX_CPUS)
+    {
+        Krn_InterlockedDec32(&g_Krn_CounterState.CpuCount);
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    g_Krn_CounterState.pCpus[index] = pCpu;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+uint32_t
+OSCALL
+Krn_CounterReadLocal(
+    KRN_COUNTER_ID Id
+    )
+{
+    return Hal_GetCpuData()->Counters.Values[Id];
+}
+
+uint32_t
+OSCALL
+Krn_CounterRead(
+    KRN_COUNTER_ID Id
+    )
+{
+    KRN_COUNTER_CPU* pCpu;
+    uint32_t count;
+    uint32_t total;
+    uint32_t i;
+    
+    count = g_Krn_CounterState.CpuCount;
+    count = (count > KRN_COUNTER_MAX_CPUS) ? KRN_COUNTER_MAX_CPUS : count;
+    total = 0;
+    
+    for (i = 0; i < count; i++)
+    {
+        // A CPU still registering has its slot claimed but not yet filled.
+        pCpu = g_Krn_CounterState.pCpus[i];
+        
+        if (pCpu)
+        {
+            total += pCpu->Values[Id];
+        }
+    }
+    
+    return total;
+}
@@ -0,0 +1,239 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Epoch based deferred freeing.
+
+#include <krn_base.h>
+#include <krn_epoch.h>
+#include <krn_cpu.h>
+#include <hal_common.h>
+
+typedef struct _KRN_EPOCH_STATE
+{
+    volatile uint32_t Epoch;
+    volatile uint32_t CpuCount;
+    KRN_EPOCH_CPU* volatile pCpus[KRN_EPOCH_MAX_CPUS];
+} KRN_EPOCH_STATE;
+
+KRN_EPOCH_STATE g_Krn_EpochState;
+
+int
+OSCALL
+Krn_EpochAllSeen(
+    uint32_t Epoch
+    );
+
+void
+OSCALL
+Krn_EpochReclaim(
+    KRN_EPOCH_CPU* pCpu,
+    uint32_t Epoch
+    );
+
+void
+OSCALL
+Krn_EpochInit(
+    )
+{
+    memset(&g_Krn_EpochState, 0, sizeof(g_Krn_EpochState));
+}
+
+KRN_ERROR_CODE
+OSCALL
+Krn_EpochCpuInit(
+    )
+{
+    KRN_EPOCH_CPU* pCpu;
+    uint32_t index;
+    
+    pCpu = &Hal_GetCpuData()->Epoch;
+    
+    memset(pCpu, 0, sizeof(*pCpu));
+    pCpu->Epoch = g_Krn_EpochState.Epoch;
+    
+    index = Krn_InterlockedInc32(&g_Krn_EpochState.CpuCount);
+    if (index >= KRN_EPOCH_MAX_CPUS)
+    {
+        Krn_InterlockedDec32(&g_Krn_EpochState.CpuCount);
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    g_Krn_EpochState.pCpus[index] = pCpu;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+void
+OSCALL
+Krn_EpochEnter(
+    )
+{
+    // Only this CPU's tick reads Nesting, so program order is enough.
+    Hal_GetCpuData()->Epoch.Nesting++;
+    KRN_BARRIER();
+}
+
+void
+OSCALL
+Krn_EpochExit(
+    )
+{
+    KRN_BARRIER();
+    Hal_GetCpuData()->Epoch.Nesting--;
+}
+
+void
+OSCALL
+Krn_DeferFree(
+    KRN_DEFER_ENTRY* pEntry,
+    KRN_DEFER_FREE_FUNC pfnFree
+    )
+{
+    KRN_EPOCH_CPU* pCpu;
+    uint32_t intState;
+    uint32_t epoch;
+    uint32_t list;
+    
+    pEntry->pfnFree = pfnFree;
+    
+    // The tick works on the same lists.
+    intState = Hal_InterruptsDisable();
+    
+    pCpu = &Hal_GetCpuData()->Epoch;
+    epoch = g_Krn_EpochState.Epoch;
+    list = epoch % KRN_EPOCH_LISTS;
+    
+    // A list last used three or more epochs ago is due, empty it first.
+    if ((pCpu->pLists[list]) &&
+        (pCpu->ListEpochs[list] != epoch))
+    {
+        Krn_EpochReclaim(pCpu, epoch);
+    }
+    
+    pEntry->pNext = pCpu->pLists[list];
+    pCpu->pLists[list] = pEntry;
+    pCpu->ListEpochs[list] = epoch;
+    pCpu->PendingCount++;
+    
+    Hal_InterruptsRestore(intState);
+}
+
+void
+OSCALL
+Krn_EpochTick(
+    )
+{
+    KRN_EPOCH_CPU* pCpu;
+    uint32_t intState;
+    uint32_t epoch;
+    
+    intState = Hal_InterruptsDisable();
+    
+    pCpu = &Hal_GetCpuData()->Epoch;
+    epoch = g_Krn_EpochState.Epoch;
+    
+    // Interrupted outside a read section, so this CPU holds no references
+    // from before now.
+    if (pCpu->Nesting == 0)
+    {
+        pCpu->Epoch = epoch;
+    }
+    
+    // Whoever gets there first moves it on.
+    if (Krn_EpochAllSeen(epoch))
+    {
+        Krn_InterlockedCmpExg32(&g_Krn_EpochState.Epoch, epoch + 1, epoch);
+    }
+    
+    if (pCpu->PendingCount)
+    {
+        Krn_EpochReclaim(pCpu, g_Krn_EpochState.Epoch);
+    }
+    
+    Hal_InterruptsRestore(intState);
+}
+
+int
+OSCALL
+Krn_EpochAllSeen(
+    uint32_t Epoch
+    )
+{
+    KRN_EPOCH_CPU* pCpu;
+    uint32_t count;
+    uint32_t i;
+    
+    count = g_Krn_EpochState.CpuCount;
+    count = (count > KRN_EPOCH_MAX_CPUS) ? KRN_EPOCH_MAX_CPUS : count;
+    
+    for (i = 0; i < count; i++)
+    {
+        // Not filled in yet means still starting up, outside any section.
+        pCpu = g_Krn_EpochState.pCpus[i];
+        
+        if ((pCpu) &&
+            (pCpu->Epoch != Epoch))
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+void
+OSCALL
+Krn_EpochReclaim(
+    KRN_EPOCH_CPU* pCpu,
+    uint32_t Epoch
+    )
+{
+    KRN_DEFER_ENTRY* pEntry;
+    KRN_DEFER_ENTRY* pNext;
+    uint32_t i;
+    
+    for (i = 0; i < KRN_EPOCH_LISTS; i++)
+    {
+        // Two advances since deferring, every CPU has left the sections
+        // that could still see these.  Differences survive the wrap.
+        if ((! pCpu->pLists[i]) ||
+            ((Epoch - pCpu->ListEpochs[i]) < 2))
+        {
+            continue;
+        }
+        
+        pEntry = pCpu->pLists[i];
+        pCpu->pLists[i] = NULL;
+        
+        while (pEntry)
+        {
+            pNext = pEntry->pNext;
+            pCpu->PendingCount--;
+            pEntry->pfnFree(pEntry);
+            pEntry = pNext;
+        }
+    }
+}
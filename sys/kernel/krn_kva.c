@@ -0,0 +1,677 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Kernel virtual address range allocator.
+
+#include <krn_base.h>
+#include <krn_mem.h>
+#include <krn_cache.h>
+#include <krn_kva.h>
+
+// Range state, kept in the Flags next to the MEM_FLAGS_* of the range.
+#define MEM_KVA_RANGE_FREE      0x00000100
+#define MEM_KVA_RANGE_FREEING   0x00000200
+#define MEM_KVA_RANGE_FLAGS     (MEM_FLAGS_READ | MEM_FLAGS_WRITE | MEM_FLAGS_EXEC | MEM_OPTS_LARGE_PAGE | MEM_OPTS_COLOR)
+
+typedef struct _MEM_KVA_RANGE MEM_KVA_RANGE;
+
+// 
+// Ranges tile the whole kernel VA space, free or not, so the neighbors in
+// the address tree are always the adjacent ranges and the floor of an
+// address is the range holding it.  Free ranges are also in the free tree,
+// keyed by size and then address, so its ceiling of a size is the best fit.
+// 
+struct _MEM_KVA_RANGE
+{
+    KRN_TREE_ENTRY AddressEntry;    // Keyed by Base.
+    KRN_TREE_ENTRY FreeEntry;       // Keyed by Mem_KvaFreeKey, free ranges only.
+    uintptr_t Base;
+    uint32_t PageCount;
+    uint32_t Flags;
+};
+
+typedef struct _MEM_KVA_STATE
+{
+    KRN_SPINLOCK Lock;
+    KRN_TREE AddressTree;
+    KRN_TREE FreeTree;
+    KRN_CACHE RangeCache;
+    uintptr_t Base;
+    uint32_t PageCount;
+    uint32_t FreePages;
+    uintptr_t CopyVa;               // Where Mem_KvaMovePage maps the old and new page.
+} MEM_KVA_STATE;
+
+MEM_KVA_STATE g_Mem_KvaState;
+
+uint64_t
+OSCALL
+Mem_KvaFreeKey(
+    uint32_t PageCount,
+    uintptr_t Base
+    );
+
+void
+OSCALL
+Mem_KvaInsertFree(
+    MEM_KVA_RANGE* pRange
+    );
+
+void
+OSCALL
+Mem_KvaSplit(
+    MEM_KVA_RANGE* pRange,
+    uint32_t HeadPages,
+    MEM_KVA_RANGE* pTail
+    );
+
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaFind(
+    uintptr_t Va
+    );
+
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaFindFree(
+    uint32_t PageCount,
+    uint32_t AlignPages,
+    uint32_t* pPad
+    );
+
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaMerge(
+    MEM_KVA_RANGE* pRange,
+    MEM_KVA_RANGE* pNext
+    );
+
+void
+OSCALL
+Mem_KvaUnmapRange(
+    uintptr_t Va,
+    uint32_t PageCount,
+    uint32_t Flags
+    );
+
+uint32_t
+OSCALL
+Mem_KvaCookie(
+    uintptr_t Va
+    );
+
+// Implementation
+
+// Size in the high half, so equal sizes go lowest address first.
+uint64_t
+OSCALL
+Mem_KvaFreeKey(
+    uint32_t PageCount,
+    uintptr_t Base
+    )
+{
+    return ((uint64_t) PageCount << 32) | (Base >> MEM_PAGE_SHIFT);
+}
+
+void
+OSCALL
+Mem_KvaInsertFree(
+    MEM_KVA_RANGE* pRange
+    )
+{
+    pRange->Flags = MEM_KVA_RANGE_FREE;
+    pRange->FreeEntry.Key = Mem_KvaFreeKey(pRange->PageCount, pRange->Base);
+    Krn_TreeInsert(&g_Mem_KvaState.FreeTree, &pRange->FreeEntry);
+}
+
+// pTail takes everything past the first HeadPages, with the same flags.
+void
+OSCALL
+Mem_KvaSplit(
+    MEM_KVA_RANGE* pRange,
+    uint32_t HeadPages,
+    MEM_KVA_RANGE* pTail
+    )
+{
+    pTail->Base = pRange->Base + ((uintptr_t) HeadPages << MEM_PAGE_SHIFT);
+    pTail->PageCount = pRange->PageCount - HeadPages;
+    pTail->Flags = pRange->Flags;
+    pRange->PageCount = HeadPages;
+    
+    pTail->AddressEntry.Key = pTail->Base;
+    Krn_TreeInsert(&g_Mem_KvaState.AddressTree, &pTail->AddressEntry);
+}
+
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaFind(
+    uintptr_t Va
+    )
+{
+    MEM_KVA_STATE* pState;
+    
+    pState = &g_Mem_KvaState;
+    
+    if ((Va < pState->Base) ||
+        (((Va - pState->Base) >> MEM_PAGE_SHIFT) >= pState->PageCount))
+    {
+        return NULL;
+    }
+    
+    // The ranges tile the space, so the floor always holds Va.
+    return (MEM_KVA_RANGE*) Krn_TreeFindFloor(&pState->AddressTree, Va);
+}
+
+// 
+// Best fit, the smallest free range that holds PageCount pages once its
+// base is padded to AlignPages.  Ranges of PageCount + AlignPages - 1 pages
+// fit whatever their base, so the walk never goes past the first of those.
+// 
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaFindFree(
+    uint32_t PageCount,
+    uint32_t AlignPages,
+    uint32_t* pPad
+    )
+{
+    KRN_TREE_ENTRY* pEntry;
+    MEM_KVA_RANGE* pRange;
+    uint32_t pad;
+    
+    pEntry = Krn_TreeFindCeiling(&g_Mem_KvaState.FreeTree, Mem_KvaFreeKey(PageCount, 0));
+    
+    for (; pEntry; pEntry = Krn_TreeNext(pEntry))
+    {
+        pRange = (MEM_KVA_RANGE*) ((char*) pEntry - offsetof(MEM_KVA_RANGE, FreeEntry));
+        pad = (AlignPages - ((pRange->Base >> MEM_PAGE_SHIFT) & (AlignPages - 1))) & (AlignPages - 1);
+        
+        if (pRange->PageCount >= PageCount + pad)
+        {
+            *pPad = pad;
+            return pRange;
+        }
+    }
+    
+    return NULL;
+}
+
+// Folds the free range pNext into the free range pRange, both already out
+// of the free tree.  Returns the descriptor that is no longer needed.
+MEM_KVA_RANGE*
+OSCALL
+Mem_KvaMerge(
+    MEM_KVA_RANGE* pRange,
+    MEM_KVA_RANGE* pNext
+    )
+{
+    pRange->PageCount += pNext->PageCount;
+    Krn_TreeRemove(&g_Mem_KvaState.AddressTree, &pNext->AddressEntry);
+    
+    return pNext;
+}
+
+// Movable page cookies are page numbers within kernel VA, plus one so that
+// zero stays free to mean pinned.
+uint32_t
+OSCALL
+Mem_KvaCookie(
+    uintptr_t Va
+    )
+{
+    uintptr_t page;
+    
+    page = ((Va - g_Mem_KvaState.Base) >> MEM_PAGE_SHIFT) + 1;
+    
+    return (page <= MEM_MOVABLE_COOKIE_MAX) ? (uint32_t) page : 0;
+}
+
+void
+OSCALL
+Mem_KvaUnmapRange(
+    uintptr_t Va,
+    uint32_t PageCount,
+    uint32_t Flags
+    )
+{
+    uintptr_t pa;
+    uint32_t i;
+    
+    if (Flags & MEM_OPTS_LARGE_PAGE)
+    {
+        for (i = 0; i < PageCount; i += MEM_LARGE_PAGE_COUNT)
+        {
+            if (Hal_UnmapLargePage(Va + ((uintptr_t) i << MEM_PAGE_SHIFT), &pa) == KRN_ERR_SUCCESS)
+            {
+                Mem_PagesFree(pa, MEM_LARGE_PAGE_COUNT);
+            }
+        }
+        
+        return;
+    }
+    
+    // Pages that were never touched are simply not there.
+    for (i = 0; i < PageCount; i++)
+    {
+        if (Hal_UnmapPage(Va + ((uintptr_t) i << MEM_PAGE_SHIFT), &pa) == KRN_ERR_SUCCESS)
+        {
+            Mem_PagesFree(pa, 1);
+        }
+    }
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaInit(
+    const HAL_BOOT_INFO* pBootInfo
+    )
+{
+    MEM_KVA_STATE* pState;
+    MEM_KVA_RANGE* pRange;
+    KRN_ERROR_CODE status;
+    
+    pState = &g_Mem_KvaState;
+    
+    if ((pBootInfo->KernelVaBase & (MEM_PAGE_SIZE - 1)) ||
+        (pBootInfo->KernelVaLength < MEM_PAGE_SIZE))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    memset(pState, 0, sizeof(*pState));
+    Krn_SpinLockInit(&pState->Lock);
+    Krn_TreeInit(&pState->AddressTree);
+    Krn_TreeInit(&pState->FreeTree);
+    
+    status = Krn_CacheCreate(&pState->RangeCache, "KvaRange", sizeof(MEM_KVA_RANGE));
+    if (status != KRN_ERR_SUCCESS)
+    {
+        return status;
+    }
+    
+    pState->Base = pBootInfo->KernelVaBase;
+    pState->PageCount = pBootInfo->KernelVaLength >> MEM_PAGE_SHIFT;
+    pState->FreePages = pState->PageCount;
+    
+    // One free range covering everything.
+    pRange = Krn_CacheAlloc(&pState->RangeCache);
+    if (! pRange)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    pRange->Base = pState->Base;
+    pRange->PageCount = pState->PageCount;
+    pRange->AddressEntry.Key = pRange->Base;
+    Krn_TreeInsert(&pState->AddressTree, &pRange->AddressEntry);
+    Mem_KvaInsertFree(pRange);
+    
+    return Mem_KvaAlloc(2, MEM_FLAGS_READ | MEM_FLAGS_WRITE, &pState->CopyVa);
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaAlloc(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pVa
+    )
+{
+    MEM_KVA_STATE* pState;
+    MEM_KVA_RANGE* pSpare[2];
+    MEM_KVA_RANGE* pBest;
+    MEM_KVA_RANGE* pRange;
+    uint32_t alignPages;
+    uint32_t bestPad;
+    uint32_t intState;
+    uintptr_t pa;
+    uint32_t i;
+    
+    pState = &g_Mem_KvaState;
+    *pVa = 0;
+    
+    alignPages = (Flags & MEM_OPTS_LARGE_PAGE) ? MEM_LARGE_PAGE_COUNT : 1;
+    
+    if ((PageCount == 0) ||
+        (PageCount > pState->PageCount) ||
+        (PageCount % alignPages))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // A split needs up to two new descriptors, get them before the lock.
+    pSpare[0] = Krn_CacheAlloc(&pState->RangeCache);
+    pSpare[1] = Krn_CacheAlloc(&pState->RangeCache);
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&pState->Lock);
+    
+    bestPad = 0;
+    pBest = Mem_KvaFindFree(PageCount, alignPages, &bestPad);
+    
+    if ((! pBest) ||
+        ((bestPad != 0) && (! pSpare[0])) ||
+        ((pBest->PageCount > PageCount + bestPad) && (! pSpare[bestPad ? 1 : 0])))
+    {
+        Krn_SpinLockRelease(&pState->Lock);
+        Hal_InterruptsRestore(intState);
+        
+        for (i = 0; i < _countof(pSpare); i++)
+        {
+            if (pSpare[i])
+            {
+                Krn_CacheFree(&pState->RangeCache, pSpare[i]);
+            }
+        }
+        
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    Krn_TreeRemove(&pState->FreeTree, &pBest->FreeEntry);
+    
+    // Alignment padding stays free in front.
+    i = 0;
+    if (bestPad)
+    {
+        pRange = pSpare[i++];
+        Mem_KvaSplit(pBest, bestPad, pRange);
+        Mem_KvaInsertFree(pBest);
+        pBest = pRange;
+    }
+    
+    if (pBest->PageCount > PageCount)
+    {
+        pRange = pSpare[i++];
+        Mem_KvaSplit(pBest, PageCount, pRange);
+        Mem_KvaInsertFree(pRange);
+    }
+    
+    pBest->Flags = Flags & MEM_KVA_RANGE_FLAGS;
+    pState->FreePages -= PageCount;
+    *pVa = pBest->Base;
+    
+    Krn_SpinLockRelease(&pState->Lock);
+    Hal_InterruptsRestore(intState);
+    
+    for (; i < _countof(pSpare); i++)
+    {
+        if (pSpare[i])
+        {
+            Krn_CacheFree(&pState->RangeCache, pSpare[i]);
+        }
+    }
+    
+    // Large pages are physically contiguous anyway, so there is nothing to
+    // gain from faulting them in.
+    if (Flags & MEM_OPTS_LARGE_PAGE)
+    {
+        for (i = 0; i < PageCount; i += MEM_LARGE_PAGE_COUNT)
+        {
+            if (Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT, MEM_OPTS_LARGE_PAGE, &pa) != KRN_ERR_SUCCESS)
+            {
+                break;
+            }
+            
+            if (Hal_MapLargePage(*pVa + ((uintptr_t) i << MEM_PAGE_SHIFT), pa, Flags) != KRN_ERR_SUCCESS)
+            {
+                Mem_PagesFree(pa, MEM_LARGE_PAGE_COUNT);
+                break;
+            }
+        }
+        
+        // Mem_KvaFree unmaps whatever made it in.
+        if (i < PageCount)
+        {
+            Mem_KvaFree(*pVa);
+            *pVa = 0;
+            return KRN_ERR_NOT_ENOUGH_MEM;
+        }
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaFree(
+    uintptr_t Va
+    )
+{
+    MEM_KVA_STATE* pState;
+    MEM_KVA_RANGE* pRange;
+    MEM_KVA_RANGE* pOther;
+    MEM_KVA_RANGE* pUnused[2];
+    uint32_t intState;
+    uint32_t i;
+    
+    pState = &g_Mem_KvaState;
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&pState->Lock);
+    
+    pRange = Mem_KvaFind(Va);
+    if ((! pRange) ||
+        (pRange->Base != Va) ||
+        (pRange->Flags & (MEM_KVA_RANGE_FREE | MEM_KVA_RANGE_FREEING)))
+    {
+        Krn_SpinLockRelease(&pState->Lock);
+        Hal_InterruptsRestore(intState);
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // Unmapping can take a while, do it without the lock.  FREEING keeps a
+    // second free or a fault from touching the range meanwhile.
+    pRange->Flags |= MEM_KVA_RANGE_FREEING;
+    
+    Krn_SpinLockRelease(&pState->Lock);
+    Hal_InterruptsRestore(intState);
+    
+    Mem_KvaUnmapRange(pRange->Base, pRange->PageCount, pRange->Flags);
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&pState->Lock);
+    
+    pState->FreePages += pRange->PageCount;
+    pUnused[0] = NULL;
+    pUnused[1] = NULL;
+    
+    // Coalesce with free neighbors.
+    pOther = (MEM_KVA_RANGE*) Krn_TreePrev(&pRange->AddressEntry);
+    if ((pOther) &&
+        (pOther->Flags & MEM_KVA_RANGE_FREE))
+    {
+        Krn_TreeRemove(&pState->FreeTree, &pOther->FreeEntry);
+        pUnused[0] = Mem_KvaMerge(pOther, pRange);
+        pRange = pOther;
+    }
+    
+    pOther = (MEM_KVA_RANGE*) Krn_TreeNext(&pRange->AddressEntry);
+    if ((pOther) &&
+        (pOther->Flags & MEM_KVA_RANGE_FREE))
+    {
+        Krn_TreeRemove(&pState->FreeTree, &pOther->FreeEntry);
+        pUnused[1] = Mem_KvaMerge(pRange, pOther);
+    }
+    
+    Mem_KvaInsertFree(pRange);
+    
+    Krn_SpinLockRelease(&pState->Lock);
+    Hal_InterruptsRestore(intState);
+    
+    for (i = 0; i < _countof(pUnused); i++)
+    {
+        if (pUnused[i])
+        {
+            Krn_CacheFree(&pState->RangeCache, pUnused[i]);
+        }
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaPageFault(
+    uintptr_t Va
+    )
+{
+    MEM_KVA_STATE* pState;
+    MEM_KVA_RANGE* pRange;
+    KRN_ERROR_CODE status;
+    uint32_t intState;
+    uintptr_t pa;
+    
+    pState = &g_Mem_KvaState;
+    Va &= ~(uintptr_t) (MEM_PAGE_SIZE - 1);
+    
+    // Held across the whole fault, so a racing free can't unmap under us
+    // and a racing fault on the same page finds it present.
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&pState->Lock);
+    
+    pRange = Mem_KvaFind(Va);
+    if ((! pRange) ||
+        (pRange->Flags & (MEM_KVA_RANGE_FREE | MEM_KVA_RANGE_FREEING | MEM_OPTS_LARGE_PAGE)))
+    {
+        Krn_SpinLockRelease(&pState->Lock);
+        Hal_InterruptsRestore(intState);
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    status = Mem_PagesAlloc(1, MEM_TYPE_MOVABLE | (pRange->Flags & MEM_OPTS_COLOR), &pa);
+    if (status == KRN_ERR_SUCCESS)
+    {
+        status = Hal_MapPage(Va, pa, pRange->Flags);
+        
+        if (status == KRN_ERR_SUCCESS)
+        {
+            // CR0.WP is clear, so this works for read only ranges too.
+            memset((void*) Va, 0, MEM_PAGE_SIZE);
+            Mem_PagesSetMovable(pa, Mem_KvaCookie(Va));
+        }
+        else
+        {
+            Mem_PagesFree(pa, 1);
+        }
+    }
+    
+    Krn_SpinLockRelease(&pState->Lock);
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_KvaMovePage(
+    uint32_t Cookie,
+    uintptr_t Pa
+    )
+{
+    MEM_KVA_STATE* pState;
+    MEM_KVA_RANGE* pRange;
+    KRN_ERROR_CODE status;
+    uint32_t intState;
+    uintptr_t newPa;
+    uintptr_t oldPa;
+    uintptr_t va;
+    
+    pState = &g_Mem_KvaState;
+    va = pState->Base + ((uintptr_t) (Cookie - 1) << MEM_PAGE_SHIFT);
+    
+    intState = Hal_InterruptsDisable();
+    Krn_SpinLockAcquire(&pState->Lock);
+    
+    // With the lock held and the range live, a page still recorded against
+    // this address is the one mapped there.  Faults wait for us.
+    pRange = Mem_KvaFind(va);
+    status = KRN_ERR_INV_PARAMETER;
+    
+    if ((pRange) &&
+        ((pRange->Flags & (MEM_KVA_RANGE_FREE | MEM_KVA_RANGE_FREEING | MEM_OPTS_LARGE_PAGE)) == 0) &&
+        (Mem_PagesGetMovable(Pa) == Cookie))
+    {
+        // Single pages, as for faults.  A colored range keeps its page's
+        // color, or the page stays.
+        if (pRange->Flags & MEM_OPTS_COLOR)
+        {
+            status = Mem_PagesAllocColor(Pa, MEM_TYPE_MOVABLE, &newPa);
+        }
+        else
+        {
+            status = Mem_PagesAllocInternal(1, MEM_TYPE_MOVABLE, &newPa);
+        }
+        
+        if (status == KRN_ERR_SUCCESS)
+        {
+            status = Hal_MapPage(pState->CopyVa, Pa, MEM_FLAGS_READ | MEM_FLAGS_WRITE);
+            
+            if (status != KRN_ERR_SUCCESS)
+            {
+                Mem_PagesFreeInternal(newPa, 1);
+            }
+        }
+    }
+    
+    if (status == KRN_ERR_SUCCESS)
+    {
+        status = Hal_MapPage(pState->CopyVa + MEM_PAGE_SIZE, newPa, MEM_FLAGS_READ | MEM_FLAGS_WRITE);
+        
+        if (status != KRN_ERR_SUCCESS)
+        {
+            Hal_UnmapPage(pState->CopyVa, &oldPa);
+            Mem_PagesFreeInternal(newPa, 1);
+        }
+    }
+    
+    // Unmap before the copy, so a write to the page faults and waits for us
+    // instead of landing in the old page behind the copy.  That only holds
+    // once no CPU has the old mapping cached, and Hal_UnmapPage flushes just
+    // this CPU's TLB.  Other CPUs need a shootdown here when they start.
+    if (status == KRN_ERR_SUCCESS)
+    {
+        OS_ASSERT(Hal_CpuCount() == 1);
+        
+        Hal_UnmapPage(va, &oldPa);
+        OS_ASSERT(oldPa == Pa);
+        
+        memcpy((void*) (pState->CopyVa + MEM_PAGE_SIZE), (void*) pState->CopyVa, MEM_PAGE_SIZE);
+        Hal_UnmapPage(pState->CopyVa, &oldPa);
+        Hal_UnmapPage(pState->CopyVa + MEM_PAGE_SIZE, &oldPa);
+        
+        // The page table is there, it was just in use.
+        status = Hal_MapPage(va, newPa, pRange->Flags);
+        OS_ASSERT(status == KRN_ERR_SUCCESS);
+        
+        Mem_PagesSetMovable(newPa, Cookie);
+        Mem_PagesSetMovable(Pa, 0);
+    }
+    
+    Krn_SpinLockRelease(&pState->Lock);
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
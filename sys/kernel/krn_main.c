@@ -25,6 +25,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <krn_base.h>
+#include <krn_mem.h>
 
 // Error reporting data.
 struct
@@ -44,6 +45,20 @@ Krn_Main(
     while(1);
 }
 
+uint32_t
+OSCALL
+Krn_Idle(
+    )
+{
+    uint32_t work;
+    
+    work = 0;
+    work += Mem_PagesZeroIdle();
+    work += Mem_PagesCompactIdle();
+    
+    return work;
+}
+
 void
 OSCALL
 Krn_ErrFunc(
@@ -26,35 +26,148 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <krn_base.h>
 #include <krn_mem.h>
+#include <krn_counter.h>
+#include <krn_cpu.h>
+#include <krn_kva.h>
 
 typedef struct _MEM_PAGE_DB_ENTRY MEM_PAGE_DB_ENTRY;
 typedef struct _MEM_BUDDY_LIST MEM_BUDDY_LIST;
 
 #define MEM_PAGE_0_FLAG_USED    0x80000000
 #define MEM_PAGE_0_FLAG_CRIT    0x40000000      // System critical
+#define MEM_PAGE_0_FLAG_FREEING 0x20000000      // Claimed by Mem_PagesFree
 #define MEM_PAGE_0_MASK_TYPE    0x0F000000
 #define MEM_PAGE_0_MASK_KRN     0x00FFFFFF
 #define MEM_PAGE_1_MASK_USR     0x00FFFFFF
 
+#define MEM_PAGE_0_SHIFT_TYPE   8               // MEM_TYPE_* to PageFlags0.
+
+// Held by compaction while the block around it is emptied.
+#define MEM_PAGE_0_CLAIMED      (MEM_PAGE_0_FLAG_USED | MEM_PAGE_0_FLAG_CRIT | \
+                                 (MEM_TYPE_RESERVED << MEM_PAGE_0_SHIFT_TYPE))
+
 struct _MEM_PAGE_DB_ENTRY
 {
     uint32_t PageFlags0;
     uint32_t PageFlags1;
 };
 
+// Physical pages above 4 GB are not reachable without PAE.
+#define MEM_PAGE_MAX_COUNT      (1024*1024)
+
+// Pre-zeroed pages kept ready, and how many the idle loop zeroes per call.
+#define MEM_ZERO_POOL_TARGET    64
+#define MEM_ZERO_POOL_STEP      4
+
+// Idle compaction keeps one block of this size free, if memory allows.
+#define MEM_COMPACT_IDLE_PAGES  MEM_LARGE_PAGE_COUNT
+
+// Pages one compaction looks at per zone, at least one block.
+#define MEM_COMPACT_SCAN_PAGES  (16 * MEM_LARGE_PAGE_COUNT)
+
+// 
+// A page's cache color is its page number modulo the color count, the number
+// of pages one way of the last level cache spans.  Zones start on large page
+// boundaries, so colors are the same counted from a zone's base.  A colored
+// request looks at this many free pages for its color before taking any.
+// 
+#define MEM_COLOR_MAX           MEM_LARGE_PAGE_COUNT
+#define MEM_COLOR_ANY           0xFFFFFFFF
+#define MEM_COLOR_PROBES        16
+
 #define MEM_BUDDY_MAX_BLOCKS            (256*1024*1024)
+
+// The top level is never smaller than this, so large pages can always be
+// served by a single block whenever there is enough memory for one.
+#define MEM_BUDDY_MIN_TOP_SIZE          MEM_LARGE_PAGE_COUNT
 #define MEM_BUDDY_BITS_PER_ELEMENT      (8 * sizeof(uint32_t))
+#define MEM_BUDDY_ELEMENT_FULL          0xFFFFFFFF
+#define MEM_BUDDY_ELEMENTS(Bits)        (((Bits) + MEM_BUDDY_BITS_PER_ELEMENT - 1) / MEM_BUDDY_BITS_PER_ELEMENT)
 
+// 
+// Each level keeps a small tree of summary bitmaps above its block bits.  A
+// set summary bit means the element below it is completely busy.  The top
+// summary is a single element, so finding a free block is a handful of bit
+// scans no matter how large the level is.  256M blocks need 5 summaries.
+// 
+#define MEM_BUDDY_MAX_SUMMARIES         6
+
+// 
+// A block bit is clear only when the whole block is free.  A block is busy as
+// soon as any of the lowest level blocks under it are allocated.
+// 
 struct _MEM_BUDDY_LIST
 {
     uint32_t BlockCount;
     uint32_t BlockSize;
     uint32_t BitsFree;
     uint32_t* pBlockBits;
+    uint32_t SummaryCount;
+    uint32_t* pSummaryBits[MEM_BUDDY_MAX_SUMMARIES];
     MEM_BUDDY_LIST* pPrev;
     MEM_BUDDY_LIST* pNext;
 };
 
+// Fallback allocations leave this share of a zone free, as a shift.
+#define MEM_ZONE_RESERVE_SHIFT  3
+
+// 
+// Each zone has buddy lists of its own, numbering blocks from BasePage.
+// Zones other than the last start on a large page boundary, so large page
+// alignment carries over.
+// 
+// Lock covers the zone's buddy lists and the DB entries of its pages on
+// them.  It is taken with interrupts disabled.  Code holding more than one
+// takes them in zone order.
+// 
+typedef struct _MEM_ZONE
+{
+    KRN_SPINLOCK Lock;
+    uint32_t BasePage;
+    uint32_t PageCount;
+    uint32_t ReservePages;
+    MEM_BUDDY_LIST* pBuddy;         // Top level, NULL for an empty zone.
+    MEM_BUDDY_LIST* pBuddyPages;    // Lowest level, one block per page.
+    uint32_t CompactCursor;         // Page offset the next compaction scan starts at.
+} MEM_ZONE;
+
+// 
+// Single pages mostly move through the per-CPU magazines, which only take a
+// zone lock once per batch.
+// 
+typedef struct _MEM_PAGE_STATE
+{
+    MEM_ZONE Zones[MEM_ZONE_COUNT];
+    MEM_PAGE_DB_ENTRY* pPageDb;
+    uint32_t PageCount;
+    uint32_t PageDbBytes;
+    uint32_t BuddyBytes;
+    uint32_t MappedPageCount;
+    uintptr_t MappedBaseVa;
+    
+    // Zeroed pages, linked through their first word.
+    KRN_TAGGED_STACK ZeroPool;
+    uint32_t ZeroPoolCount;
+    
+    // One compaction at a time.  Idle compaction does not rescan until
+    // something has been freed since fruitless scans last covered all of
+    // memory.  The other statistics are KRN_COUNTER_MEM_* per-CPU counters.
+    uint32_t Compacting;
+    uint32_t CompactIdleFreeCount;
+    uint32_t CompactIdleScanned;
+    
+    // Power of two, 1 when coloring is off.
+    uint32_t ColorCount;
+} MEM_PAGE_STATE;
+
+_Static_assert(
+    KRN_COUNTER_MEM_ALLOC_LATENCY_END - KRN_COUNTER_MEM_ALLOC_LATENCY == MEM_PAGE_STATS_LATENCY,
+    "One latency counter per bucket");
+
+MEM_PAGE_STATE g_Mem_PageState = {0};
+
+const char* g_Mem_ZoneNames[MEM_ZONE_COUNT] = { "DMA", "low", "high" };
+
 
 MEM_BUDDY_LIST*
 OSCALL
@@ -65,6 +178,19 @@ Mem_InitBuddyList(
     size_t* pBytesUsed
     );
 
+size_t
+OSCALL
+Mem_BuddyListSize(
+    uint32_t BlockCount
+    );
+
+size_t
+OSCALL
+Mem_BuddyLayout(
+    void* pLocation,
+    uint32_t BlockCount
+    );
+
 KRN_ERROR_CODE
 OSCALL
 Mem_BuddyAllocBlocks(
@@ -73,6 +199,15 @@ Mem_BuddyAllocBlocks(
     uint32_t* pBlockStart
     );
 
+KRN_ERROR_CODE
+OSCALL
+Mem_BuddyAllocColor(
+    MEM_BUDDY_LIST* pList,
+    uint32_t Color,
+    uint32_t ColorCount,
+    uint32_t* pBlockStart
+    );
+
 KRN_ERROR_CODE
 OSCALL
 Mem_BuddyFreeBlocks(
@@ -83,16 +218,217 @@ Mem_BuddyFreeBlocks(
 
 void
 OSCALL
-Mem_BuddySetBit(
+Mem_BuddySetRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    );
+
+void
+OSCALL
+Mem_BuddyClearRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    );
+
+void
+OSCALL
+Mem_BuddyFillRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount,
+    uint32_t Fill
+    );
+
+void
+OSCALL
+Mem_BuddyUpdateParents(
+    MEM_BUDDY_LIST* pList,
+    uint32_t FirstElement,
+    uint32_t LastElement
+    );
+
+uint32_t
+OSCALL
+Mem_BuddyFoldElement(
+    uint32_t Element
+    );
+
+uintptr_t
+OSCALL
+Mem_PagesFindBootRegion(
+    const HAL_BOOT_INFO* pBootInfo,
+    size_t ByteCount
+    );
+
+void
+OSCALL
+Mem_PagesSetDb(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t PageFlags0
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesMagazinePop(
+    uint32_t Flags,
+    uint32_t* pPage
+    );
+
+int
+OSCALL
+Mem_PagesMagazineUsable(
+    MEM_ZONE** ppZones,
+    uint32_t Index
+    );
+
+void
+OSCALL
+Mem_PagesMagazinePush(
+    uint32_t Page
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesColorPop(
+    uint32_t Flags,
+    uint32_t* pPage
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesZeroPoolPop(
+    uint32_t* pPage
+    );
+
+uint32_t
+OSCALL
+Mem_PagesZeroPoolDrain(
+    );
+
+uint32_t
+OSCALL
+Mem_PagesLock(
+    uint32_t PageStart,
+    uint32_t PageCount
+    );
+
+void
+OSCALL
+Mem_PagesUnlock(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t IntState
+    );
+
+uint32_t
+OSCALL
+Mem_BuddyFindFirstFree(
+    MEM_BUDDY_LIST* pList
+    );
+
+uint32_t
+OSCALL
+Mem_BuddyFindNextFree(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart
+    );
+
+int
+OSCALL
+Mem_BuddyRangeIsFree(
     MEM_BUDDY_LIST* pList,
-    uint32_t BlockIndex
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    );
+
+uint32_t
+OSCALL
+Mem_PagesZoneOrder(
+    uint32_t Flags,
+    MEM_ZONE** ppZones
+    );
+
+uint32_t
+OSCALL
+Mem_PagesZoneOf(
+    uint32_t Page
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesZoneAlloc(
+    MEM_ZONE* pZone,
+    uint32_t PageCount,
+    uint32_t Flags,
+    uint32_t Color,
+    uint32_t ReservePages,
+    uint32_t PageFlags0,
+    uint32_t* pPageStart
+    );
+
+void
+OSCALL
+Mem_PagesBuddyFill(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t Fill
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesBuddyAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    uint32_t Color,
+    uint32_t PageFlags0,
+    uint32_t* pPageStart
+    );
+
+uint32_t
+OSCALL
+Mem_PagesFreeTotal(
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesCompact(
+    size_t PageCount,
+    uint32_t Flags,
+    uint32_t* pBlockStart,
+    uint32_t* pBlockSize
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesCompactFind(
+    MEM_ZONE* pZone,
+    uint32_t BlockSize,
+    uint32_t Flags,
+    uint32_t* pBlockStart
+    );
+
+uint32_t
+OSCALL
+Mem_PagesIsMovable(
+    uint32_t PageFlags0
+    );
+
+void
+OSCALL
+Mem_PagesCompactRelease(
+    uint32_t PageStart,
+    uint32_t PageCount
     );
 
 void
 OSCALL
-Mem_BuddyClearBit(
+Mem_BuddyWriteElement(
     MEM_BUDDY_LIST* pList,
-    uint32_t BlockIndex
+    uint32_t ElementIndex,
+    uint32_t Value
     );
 
 // Implementation
@@ -107,24 +443,75 @@ Mem_InitBuddyList(
     )
 {
     MEM_BUDDY_LIST* pTopList;
+    size_t bytesUsed;
+    
+    *pBytesUsed = 0;
+    
+    // Measure, then lay it out for real.  Cache line offsets only line up
+    // with cache lines if the location does.
+    bytesUsed = Mem_BuddyLayout(NULL, BlockCount);
+    
+    if ((bytesUsed == 0) ||
+        (bytesUsed > LocationSize) ||
+        ((uintptr_t) pLocation & (KRN_CACHE_LINE_SIZE - 1)))
+    {
+        return NULL;
+    }
+    
+    Mem_BuddyLayout(pLocation, BlockCount);
+    pTopList = (MEM_BUDDY_LIST*) pLocation;
+    
+    // Last, mark the whole provided bit range as free.
+    Mem_BuddyFreeBlocks(pTopList, 0, BlockCount);
+    
+    *pBytesUsed = bytesUsed;
+    
+    return pTopList;
+}
+
+size_t
+OSCALL
+Mem_BuddyListSize(
+    uint32_t BlockCount
+    )
+{
+    return Mem_BuddyLayout(NULL, BlockCount);
+}
+
+// 
+// All of the metadata lives in one run, in this order:
+//   the level headers, top level first,
+//   every level's summaries, packed together since every scan starts there,
+//   the block bits of each level, top level first, each on a cache line.
+// Each level gets exactly the elements its blocks need, so the small upper
+// levels end up side by side ahead of the large lower ones.  With no
+// location this only measures.  Everything starts out busy.
+// 
+size_t
+OSCALL
+Mem_BuddyLayout(
+    void* pLocation,
+    uint32_t BlockCount
+    )
+{
+    MEM_BUDDY_LIST* pLists;
     char* pLocationBytes;
+    uint32_t* pBits;
+    uint32_t topBlockSize;
     uint32_t blockSize;
+    uint32_t listCount;
+    uint32_t elementCount;
+    uint32_t summaryCount;
     size_t bytesUsed;
     uint32_t i;
-    uint32_t listCount;
+    uint32_t j;
     
-    pTopList = NULL;
-    bytesUsed = 0;
-    *pBytesUsed = 0;
+    pLists = (MEM_BUDDY_LIST*) pLocation;
     pLocationBytes = (char*) pLocation;
-    listCount = 0;
-    
-    // Figure out the total number of bits required to store the lists.
-    // First, round up the bit count to a power of 2, counting along the
-    // way.
     
+    // Round the block count up to a power of 2, then pick a top level with
+    // enough blocks to fill at least one bit element.
     blockSize = 1;
-    // Round to power of 2.
     while ((blockSize < MEM_BUDDY_MAX_BLOCKS) &&
            (blockSize < BlockCount))
     {
@@ -134,91 +521,99 @@ Mem_InitBuddyList(
     // Too large for us.
     if (blockSize >= (MEM_BUDDY_MAX_BLOCKS))
     {
-        return NULL;
+        return 0;
     }
     
-    // Figure out the number of block levels we will use.  The first level
-    // should have a pretty decent number of blocks in it -- enough to utilize
-    // a full bit block element.
     blockSize /= MEM_BUDDY_BITS_PER_ELEMENT;
     
+    if ((blockSize < MEM_BUDDY_MIN_TOP_SIZE) &&
+        (BlockCount >= MEM_BUDDY_MIN_TOP_SIZE))
+    {
+        blockSize = MEM_BUDDY_MIN_TOP_SIZE;
+    }
+    
     if (blockSize == 0)
     {
         // This is designed to hold more than just a few elements, bail out.
-        return NULL;
+        return 0;
     }
     
-    // Fill out the headers up front.
-    pTopList = (MEM_BUDDY_LIST*) &pLocationBytes[bytesUsed];
-    i = 0;
+    topBlockSize = blockSize;
+    listCount = 0;
+    for (blockSize = topBlockSize; blockSize > 0; blockSize /= 2)
+    {
+        listCount++;
+    }
+    
+    bytesUsed = listCount * sizeof(MEM_BUDDY_LIST);
     
-    while (blockSize > 0)
+    for (i = 0; (pLocation) && (i < listCount); i++)
     {
-        bytesUsed += sizeof(MEM_BUDDY_LIST);
-        if (bytesUsed > LocationSize)
-        {
-            return NULL;
-        }
-        
-        pTopList[i].BlockCount = BlockCount / blockSize;
-        pTopList[i].BlockSize = blockSize;
-        pTopList[i].BitsFree = 0;
-        pTopList[i].pBlockBits = NULL;
+        pLists[i].BlockCount = BlockCount / (topBlockSize >> i);
+        pLists[i].BlockSize = topBlockSize >> i;
+        pLists[i].BitsFree = 0;
+        pLists[i].pBlockBits = NULL;
+        pLists[i].SummaryCount = 0;
+        pLists[i].pPrev = (i > 0) ? &pLists[i - 1] : NULL;
+        pLists[i].pNext = ((i + 1) < listCount) ? &pLists[i + 1] : NULL;
+    }
+    
+    // Summaries are added until a single element covers the whole level.
+    for (i = 0; i < listCount; i++)
+    {
+        elementCount = MEM_BUDDY_ELEMENTS(BlockCount / (topBlockSize >> i));
+        summaryCount = 0;
         
-        if (i == 0)
+        while (elementCount > 1)
         {
-            pTopList[i].pPrev = NULL;
+            OS_ASSERT(summaryCount < MEM_BUDDY_MAX_SUMMARIES);
+            
+            elementCount = MEM_BUDDY_ELEMENTS(elementCount);
+            
+            if (pLocation)
+            {
+                pBits = (uint32_t*) &pLocationBytes[bytesUsed];
+                pLists[i].pSummaryBits[summaryCount] = pBits;
+                
+                for (j = 0; j < elementCount; j++)
+                {
+                    pBits[j] = MEM_BUDDY_ELEMENT_FULL;
+                }
+            }
+            
+            bytesUsed += sizeof(uint32_t) * elementCount;
+            summaryCount++;
         }
-        else
+        
+        if (pLocation)
         {
-            pTopList[i].pPrev = &pTopList[i-1];
-            pTopList[i].pPrev->pNext = &pTopList[i];
+            pLists[i].SummaryCount = summaryCount;
         }
-        
-        pTopList[i].pNext = NULL;
-        
-        blockSize /= 2;
-        i++;
     }
-    listCount = i;
     
-    // Now fill out the block bit pointers and zero everything.
+    // Bits past the last block in the last element stay busy for good.
     for (i = 0; i < listCount; i++)
     {
-        uint32_t elementCount;
-        uint32_t j;
-        
-        pTopList[i].pBlockBits = (uint32_t*) &pLocationBytes[bytesUsed];
+        bytesUsed = (bytesUsed + KRN_CACHE_LINE_SIZE - 1) & ~(size_t) (KRN_CACHE_LINE_SIZE - 1);
+        elementCount = MEM_BUDDY_ELEMENTS(BlockCount / (topBlockSize >> i));
         
-        // Initialize the block bits to busy.  We are adding 1 here to ensure
-        // any remainders for the blockCount division are accounted for.
-        // NOTE: There shouldn't be any remainders since this will currently
-        // be a power of two, but this is just to be safe if that changes
-        // later.
-        elementCount = 1 + (pTopList[i].BlockCount / sizeof(uint32_t));
-        
-        bytesUsed += sizeof(uint32_t) * elementCount;
-        
-        if (bytesUsed > LocationSize)
+        if (pLocation)
         {
-            return NULL;
+            pBits = (uint32_t*) &pLocationBytes[bytesUsed];
+            pLists[i].pBlockBits = pBits;
+            
+            for (j = 0; j < elementCount; j++)
+            {
+                pBits[j] = MEM_BUDDY_ELEMENT_FULL;
+            }
         }
         
-        for (j = 0; j < elementCount; j++)
-        {
-            pTopList[i].pBlockBits[j] = 0xFFFFFFFF;
-        }
+        bytesUsed += sizeof(uint32_t) * elementCount;
     }
     
-    // Last, mark the whole provided bit range as free.
-    Mem_BuddyFreeBlocks(pTopList, 0, BlockCount);
-    
-    *pBytesUsed = bytesUsed;
-    
-    return pTopList;
+    return bytesUsed;
 }
 
-
 KRN_ERROR_CODE
 OSCALL
 Mem_BuddyAllocBlocks(
@@ -231,64 +626,140 @@ Mem_BuddyAllocBlocks(
     uint32_t blockStart;
     
     MEM_BUDDY_LIST* pCurrent;
+    MEM_BUDDY_LIST* pLowest;
     
     *pBlockStart = 0;
     
-    // Find the right level to do the allocation.
+    if ((BlockCount == 0) ||
+        (BlockCount > pList->BlockSize))
+    {
+        // Nothing to do, or larger than the largest block we track.
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // Find the right level to do the allocation, the smallest blocks which
+    // still cover the request.
     pCurrent = pList;
     while ((pCurrent->pNext) &&
-           (pCurrent->BlockSize > BlockCount))
+           (pCurrent->pNext->BlockSize >= BlockCount))
     {
         pCurrent = pCurrent->pNext;
     }
     
-    // Make sure there are free blocks in this level, if not then we need to
-    // split a larger block.
-    while ((pCurrent) &&
-           (pCurrent->BitsFree == 0))
+    // Find the lowest level too, for the exact size search.
+    pLowest = pCurrent;
+    while (pLowest->pNext)
+    {
+        pLowest = pLowest->pNext;
+    }
+    
+    // A free block at any larger level is also free at this level, so there
+    // is no need to look further up.
+    if (pCurrent->BitsFree)
     {
-        pCurrent = pCurrent->pPrev;
+        // There are free bits at this level, find a block.
+        i = Mem_BuddyFindFirstFree(pCurrent);
+        
+        // We should have found one... for sure.
+        OS_ASSERT(i < pCurrent->BlockCount);
+        
+        blockStart = i * (pCurrent->BlockSize / pLowest->BlockSize);
+        
+        // Mark the lowest level set, then propogate up as needed.  The rest
+        // of the block stays free below the level it came from.
+        Mem_BuddySetRange(pLowest, blockStart, BlockCount);
+        
+        *pBlockStart = blockStart;
+        
+        return KRN_ERR_SUCCESS;
     }
     
-    if (! pCurrent)
+    // 
+    // No covering block, but a request that is not a power of two only needs
+    // a free block of the next size down with the rest of the run free right
+    // after it.  9 pages fit in a free 8 page block and the page past it.
+    // 
+    // Powers of two keep their natural alignment.
+    if ((BlockCount & (BlockCount - 1)) == 0)
     {
         // We can't satisfy this request right now.
         return KRN_ERR_NOT_ENOUGH_MEM;
     }
     
-    // There are free bits at this level, find a block.
-    for (i = 0; i < pCurrent->BlockCount; i++)
+    pCurrent = pCurrent->pNext;
+    if ((! pCurrent) ||
+        (pCurrent->BitsFree == 0))
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    for (i = Mem_BuddyFindNextFree(pCurrent, 0);
+         i < pCurrent->BlockCount;
+         i = Mem_BuddyFindNextFree(pCurrent, i + 1))
     {
-        uint32_t elementIndex = i / MEM_BUDDY_BITS_PER_ELEMENT;
-        uint32_t bitIndex = i % MEM_BUDDY_BITS_PER_ELEMENT;
+        blockStart = i * (pCurrent->BlockSize / pLowest->BlockSize);
         
-        if ((pCurrent->pBlockBits[elementIndex] & (1UL << bitIndex)) == 0)
+        if ((blockStart + BlockCount <= pLowest->BlockCount) &&
+            (Mem_BuddyRangeIsFree(
+                    pLowest,
+                    blockStart + pCurrent->BlockSize,
+                    BlockCount - pCurrent->BlockSize)))
         {
-            break;
+            Mem_BuddySetRange(pLowest, blockStart, BlockCount);
+            
+            *pBlockStart = blockStart;
+            
+            return KRN_ERR_SUCCESS;
         }
     }
     
-    // We should have found one... for sure.
-    OS_ASSERT(i < pCurrent->BlockCount);
-    
-    blockStart = i;
+    return KRN_ERR_NOT_ENOUGH_MEM;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_BuddyAllocColor(
+    MEM_BUDDY_LIST* pList,
+    uint32_t Color,
+    uint32_t ColorCount,
+    uint32_t* pBlockStart
+    )
+{
+    uint32_t candidate;
+    uint32_t probe;
+    uint32_t i;
     
-    // Go down to the lowest level now, multiply blockStart by 2 each time.
-    while (pCurrent->pNext)
-    {
-        pCurrent = pCurrent->pNext;
-        blockStart *= 2;
-    }
+    // pList is a lowest level, ColorCount a power of two.
+    OS_ASSERT(pList->pNext == NULL);
     
-    // Mark the lowest level set, then propogate up as needed.
-    for (i = blockStart; i < (blockStart + BlockCount); i++)
+    // Each probe either hits or skips to the next block of the color past a
+    // free one of the wrong color.
+    candidate = Color;
+    for (probe = 0; probe < MEM_COLOR_PROBES; probe++)
     {
-        Mem_BuddySetBit(pCurrent, i);
+        i = Mem_BuddyFindNextFree(pList, candidate);
+        
+        if (i >= pList->BlockCount)
+        {
+            break;
+        }
+        
+        if ((i & (ColorCount - 1)) == Color)
+        {
+            Mem_BuddySetRange(pList, i, 1);
+            *pBlockStart = i;
+            
+            return KRN_ERR_SUCCESS;
+        }
+        
+        candidate = (i & ~(ColorCount - 1)) + Color;
+        if (candidate < i)
+        {
+            candidate += ColorCount;
+        }
     }
     
-    *pBlockStart = blockStart;
-    
-    return KRN_ERR_SUCCESS;
+    return KRN_ERR_NOT_ENOUGH_MEM;
 }
 
 KRN_ERROR_CODE
@@ -299,7 +770,6 @@ Mem_BuddyFreeBlocks(
     uint32_t BlockCount
     )
 {
-    uint32_t i;
     MEM_BUDDY_LIST* pCurrent;
     
     // Find the end (lowest level).
@@ -311,85 +781,2254 @@ Mem_BuddyFreeBlocks(
     
     // Check bounds.
     if ((BlockStart >= pCurrent->BlockCount) ||
-        (BlockCount >= pCurrent->BlockCount) ||
-        (BlockCount < BlockStart) ||
-        ((BlockCount - BlockStart) > pCurrent->BlockCount))
+        (BlockCount > (pCurrent->BlockCount - BlockStart)))
     {
         return KRN_ERR_INV_PARAMETER;
     }
     
     // Mark the lowest level free, then propogate up as needed.
-    for (i = BlockStart; i < (BlockStart + BlockCount); i++)
+    Mem_BuddyClearRange(pCurrent, BlockStart, BlockCount);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+void
+OSCALL
+Mem_BuddySetRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    )
+{
+    Mem_BuddyFillRange(pList, BlockStart, BlockCount, MEM_BUDDY_ELEMENT_FULL);
+}
+
+void
+OSCALL
+Mem_BuddyClearRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    )
+{
+    Mem_BuddyFillRange(pList, BlockStart, BlockCount, 0);
+}
+
+void
+OSCALL
+Mem_BuddyFillRange(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount,
+    uint32_t Fill
+    )
+{
+    uint32_t firstElement;
+    uint32_t lastElement;
+    uint32_t i;
+    
+    if (BlockCount == 0)
     {
-        Mem_BuddyClearBit(pCurrent, i);
+        return;
     }
     
-    return KRN_ERR_SUCCESS;
+    firstElement = BlockStart / MEM_BUDDY_BITS_PER_ELEMENT;
+    lastElement = (BlockStart + BlockCount - 1) / MEM_BUDDY_BITS_PER_ELEMENT;
+    
+    // Whole elements in the middle, partial masks at the ends.
+    for (i = firstElement; i <= lastElement; i++)
+    {
+        uint32_t mask = MEM_BUDDY_ELEMENT_FULL;
+        
+        if (i == firstElement)
+        {
+            mask &= MEM_BUDDY_ELEMENT_FULL << (BlockStart % MEM_BUDDY_BITS_PER_ELEMENT);
+        }
+        
+        if (i == lastElement)
+        {
+            mask &= MEM_BUDDY_ELEMENT_FULL >>
+                (MEM_BUDDY_BITS_PER_ELEMENT - 1 - ((BlockStart + BlockCount - 1) % MEM_BUDDY_BITS_PER_ELEMENT));
+        }
+        
+        Mem_BuddyWriteElement(
+                pList,
+                i,
+                (pList->pBlockBits[i] & ~mask) | (Fill & mask));
+    }
+    
+    Mem_BuddyUpdateParents(pList, firstElement, lastElement);
 }
 
 void
 OSCALL
-Mem_BuddySetBit(
+Mem_BuddyUpdateParents(
     MEM_BUDDY_LIST* pList,
-    uint32_t BlockIndex
+    uint32_t FirstElement,
+    uint32_t LastElement
     )
 {
-    while (pList)
+    // A parent block is busy when either of its two children is busy, so
+    // each parent element is rebuilt from the two child elements below it.
+    // Stop as soon as a level comes out unchanged.
+    while (pList->pPrev)
     {
-        uint32_t elementIndex = BlockIndex / MEM_BUDDY_BITS_PER_ELEMENT;
-        uint32_t bitIndex = BlockIndex % MEM_BUDDY_BITS_PER_ELEMENT;
+        MEM_BUDDY_LIST* pParent = pList->pPrev;
+        uint32_t childElements;
+        uint32_t changed;
+        uint32_t i;
         
-        // Set the bit.
-        pList->pBlockBits[elementIndex] |= 1UL << bitIndex;
-        pList->BitsFree--;
+        childElements = (pList->BlockCount + MEM_BUDDY_BITS_PER_ELEMENT - 1) /
+            MEM_BUDDY_BITS_PER_ELEMENT;
         
-        bitIndex &= ~0x01;  // Zero least significant bit.
+        FirstElement /= 2;
+        LastElement /= 2;
+        changed = 0;
         
-        // Are both these bits set now?
-        if ((pList->pBlockBits[elementIndex] & (3UL << bitIndex)) == (3UL << bitIndex))
+        for (i = FirstElement; i <= LastElement; i++)
         {
-            // Jump up a level, and divide BlockIndex for the correct index in the
-            // next level.
-            pList = pList->pPrev;
-            BlockIndex /= 2;
+            uint32_t low;
+            uint32_t high;
+            uint32_t value;
+            
+            low = pList->pBlockBits[2 * i];
+            high = MEM_BUDDY_ELEMENT_FULL;
+            
+            if ((2 * i + 1) < childElements)
+            {
+                high = pList->pBlockBits[2 * i + 1];
+            }
+            
+            value = Mem_BuddyFoldElement(low) | (Mem_BuddyFoldElement(high) << 16);
+            
+            if (value != pParent->pBlockBits[i])
+            {
+                Mem_BuddyWriteElement(pParent, i, value);
+                changed = 1;
+            }
         }
-        else
+        
+        if (! changed)
         {
             break;
         }
+        
+        pList = pParent;
+    }
+}
+
+uint32_t
+OSCALL
+Mem_BuddyFoldElement(
+    uint32_t Element
+    )
+{
+    // OR each pair of bits together, then pack the 16 results into the low
+    // half of the element.
+    Element = (Element | (Element >> 1)) & 0x55555555;
+    Element = (Element | (Element >> 1)) & 0x33333333;
+    Element = (Element | (Element >> 2)) & 0x0F0F0F0F;
+    Element = (Element | (Element >> 4)) & 0x00FF00FF;
+    Element = (Element | (Element >> 8)) & 0x0000FFFF;
+    
+    return Element;
+}
+
+uint32_t
+OSCALL
+Mem_BuddyFindFirstFree(
+    MEM_BUDDY_LIST* pList
+    )
+{
+    uint32_t index;
+    uint32_t element;
+    uint32_t i;
+    
+    // Start at the single top element and walk down, picking the first
+    // element with a clear bit at each step (bsf on the inverted value).
+    index = 0;
+    i = pList->SummaryCount;
+    
+    while (i > 0)
+    {
+        i--;
+        element = pList->pSummaryBits[i][index];
+        
+        if (element == MEM_BUDDY_ELEMENT_FULL)
+        {
+            return pList->BlockCount;
+        }
+        
+        index = (index * MEM_BUDDY_BITS_PER_ELEMENT) + __builtin_ctz(~element);
+    }
+    
+    element = pList->pBlockBits[index];
+    
+    if (element == MEM_BUDDY_ELEMENT_FULL)
+    {
+        return pList->BlockCount;
+    }
+    
+    index = (index * MEM_BUDDY_BITS_PER_ELEMENT) + __builtin_ctz(~element);
+    
+    // Bits past the end of the level are never cleared.
+    OS_ASSERT(index < pList->BlockCount);
+    
+    return index;
+}
+
+uint32_t
+OSCALL
+Mem_BuddyFindNextFree(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart
+    )
+{
+    uint32_t elementCount;
+    uint32_t index;
+    uint32_t element;
+    uint32_t summary;
+    
+    if (BlockStart >= pList->BlockCount)
+    {
+        return pList->BlockCount;
+    }
+    
+    elementCount = MEM_BUDDY_ELEMENTS(pList->BlockCount);
+    index = BlockStart / MEM_BUDDY_BITS_PER_ELEMENT;
+    
+    // Blocks below the start count as busy.
+    element = pList->pBlockBits[index] |
+        ((1U << (BlockStart % MEM_BUDDY_BITS_PER_ELEMENT)) - 1);
+    
+    while (element == MEM_BUDDY_ELEMENT_FULL)
+    {
+        index++;
+        
+        // The first summary skips busy elements 32 at a time.
+        while ((pList->SummaryCount) &&
+               (index < elementCount))
+        {
+            summary = pList->pSummaryBits[0][index / MEM_BUDDY_BITS_PER_ELEMENT] |
+                ((1U << (index % MEM_BUDDY_BITS_PER_ELEMENT)) - 1);
+            
+            if (summary != MEM_BUDDY_ELEMENT_FULL)
+            {
+                index = (index & ~(MEM_BUDDY_BITS_PER_ELEMENT - 1)) + __builtin_ctz(~summary);
+                break;
+            }
+            
+            index = (index | (MEM_BUDDY_BITS_PER_ELEMENT - 1)) + 1;
+        }
+        
+        if (index >= elementCount)
+        {
+            return pList->BlockCount;
+        }
+        
+        element = pList->pBlockBits[index];
+    }
+    
+    index = (index * MEM_BUDDY_BITS_PER_ELEMENT) + __builtin_ctz(~element);
+    
+    // Bits past the end of the level are never cleared.
+    OS_ASSERT(index < pList->BlockCount);
+    
+    return index;
+}
+
+int
+OSCALL
+Mem_BuddyRangeIsFree(
+    MEM_BUDDY_LIST* pList,
+    uint32_t BlockStart,
+    uint32_t BlockCount
+    )
+{
+    uint32_t firstElement;
+    uint32_t lastElement;
+    uint32_t i;
+    
+    firstElement = BlockStart / MEM_BUDDY_BITS_PER_ELEMENT;
+    lastElement = (BlockStart + BlockCount - 1) / MEM_BUDDY_BITS_PER_ELEMENT;
+    
+    // Same masks as Mem_BuddyFillRange.
+    for (i = firstElement; i <= lastElement; i++)
+    {
+        uint32_t mask = MEM_BUDDY_ELEMENT_FULL;
+        
+        if (i == firstElement)
+        {
+            mask &= MEM_BUDDY_ELEMENT_FULL << (BlockStart % MEM_BUDDY_BITS_PER_ELEMENT);
+        }
+        
+        if (i == lastElement)
+        {
+            mask &= MEM_BUDDY_ELEMENT_FULL >>
+                (MEM_BUDDY_BITS_PER_ELEMENT - 1 - ((BlockStart + BlockCount - 1) % MEM_BUDDY_BITS_PER_ELEMENT));
+        }
+        
+        if (pList->pBlockBits[i] & mask)
+        {
+            return 0;
+        }
     }
+    
+    return 1;
 }
 
 void
 OSCALL
-Mem_BuddyClearBit(
+Mem_BuddyWriteElement(
     MEM_BUDDY_LIST* pList,
-    uint32_t BlockIndex
+    uint32_t ElementIndex,
+    uint32_t Value
     )
 {
-    while (pList)
+    uint32_t oldValue;
+    uint32_t i;
+    
+    oldValue = pList->pBlockBits[ElementIndex];
+    pList->pBlockBits[ElementIndex] = Value;
+    
+    // Freed bits, then busied bits.
+    pList->BitsFree += __builtin_popcount(oldValue & ~Value);
+    pList->BitsFree -= __builtin_popcount(Value & ~oldValue);
+    
+    // Push any change in fullness up through the summaries.
+    for (i = 0; i < pList->SummaryCount; i++)
     {
-        uint32_t elementIndex = BlockIndex / MEM_BUDDY_BITS_PER_ELEMENT;
-        uint32_t bitIndex = BlockIndex % MEM_BUDDY_BITS_PER_ELEMENT;
+        uint32_t* pSummary = pList->pSummaryBits[i];
+        uint32_t summaryIndex = ElementIndex / MEM_BUDDY_BITS_PER_ELEMENT;
+        uint32_t summaryBit = 1UL << (ElementIndex % MEM_BUDDY_BITS_PER_ELEMENT);
         
-        // Clear the bit.
-        pList->pBlockBits[elementIndex] &= ~(1UL << bitIndex);
-        pList->BitsFree++;
+        if ((oldValue == MEM_BUDDY_ELEMENT_FULL) == (Value == MEM_BUDDY_ELEMENT_FULL))
+        {
+            break;
+        }
         
-        bitIndex &= ~0x01;  // Zero least significant bit.
+        oldValue = pSummary[summaryIndex];
         
-        // Are both these bits clear now?
-        if ((pList->pBlockBits[elementIndex] & (3UL << bitIndex)) == 0)
+        if (Value == MEM_BUDDY_ELEMENT_FULL)
         {
-            // Jump up a level, and divide BlockIndex for the correct index in the
-            // next level.
-            pList = pList->pPrev;
-            BlockIndex /= 2;
+            Value = oldValue | summaryBit;
         }
         else
         {
-            break;
+            Value = oldValue & ~summaryBit;
+        }
+        
+        pSummary[summaryIndex] = Value;
+        ElementIndex = summaryIndex;
+    }
+}
+
+// 
+// Physical page allocator.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesInit(
+    const HAL_BOOT_INFO* pBootInfo
+    )
+{
+    MEM_PAGE_STATE* pState;
+    const HAL_MEM_RANGE* pRange;
+    uint64_t endPa;
+    uintptr_t infoPa;
+    size_t infoSize;
+    size_t dbSize;
+    size_t buddySize;
+    size_t zoneSize[MEM_ZONE_COUNT];
+    size_t bytesUsed;
+    uint32_t zoneEnd[MEM_ZONE_COUNT];
+    uint32_t zoneStart;
+    char* pLocation;
+    uint32_t pageCount;
+    HAL_CACHE_INFO cacheInfo;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    
+    // Start clean, so the host harness can initialize more than once.
+    memset(pState, 0, sizeof(*pState));
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        Krn_SpinLockInit(&pState->Zones[i].Lock);
+    }
+    
+    // The highest available page decides how many pages we track.
+    endPa = 0;
+    for (i = 0; i < pBootInfo->MemRangeCount; i++)
+    {
+        pRange = &pBootInfo->pMemRanges[i];
+        
+        if ((pRange->Type == HAL_MEM_RANGE_AVAILABLE) &&
+            ((pRange->Base + pRange->Length) > endPa))
+        {
+            endPa = pRange->Base + pRange->Length;
+        }
+    }
+    
+    pageCount = MEM_PAGE_MAX_COUNT;
+    if ((endPa >> MEM_PAGE_SHIFT) < MEM_PAGE_MAX_COUNT)
+    {
+        pageCount = (uint32_t) (endPa >> MEM_PAGE_SHIFT);
+    }
+    
+    // Zone boundaries sit on large pages.  A last zone too small to be
+    // worth its own lists joins the one below it, unless that is DMA, which
+    // must not reach past 16 MB.
+    zoneEnd[MEM_ZONE_DMA] = MEM_ZONE_DMA_END >> MEM_PAGE_SHIFT;
+    zoneEnd[MEM_ZONE_LOW] = (pBootInfo->MappedLength >> MEM_PAGE_SHIFT) & ~(MEM_LARGE_PAGE_COUNT - 1);
+    zoneEnd[MEM_ZONE_HIGH] = pageCount;
+    
+    zoneStart = 0;
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        if (zoneEnd[i] > pageCount)
+        {
+            zoneEnd[i] = pageCount;
+        }
+        
+        if (zoneEnd[i] < zoneStart)
+        {
+            zoneEnd[i] = zoneStart;
+        }
+        
+        pState->Zones[i].BasePage = zoneStart;
+        pState->Zones[i].PageCount = zoneEnd[i] - zoneStart;
+        zoneStart = zoneEnd[i];
+    }
+    
+    for (i = MEM_ZONE_COUNT - 1; i > MEM_ZONE_DMA + 1; i--)
+    {
+        if ((pState->Zones[i].PageCount > 0) &&
+            (pState->Zones[i].PageCount < MEM_LARGE_PAGE_COUNT))
+        {
+            pState->Zones[i - 1].PageCount += pState->Zones[i].PageCount;
+            pState->Zones[i].BasePage += pState->Zones[i].PageCount;
+            pState->Zones[i].PageCount = 0;
+        }
+    }
+    
+    // Each zone's lists start on a cache line.
+    buddySize = 0;
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        if (pState->Zones[i].PageCount == 0)
+        {
+            continue;
+        }
+        
+        zoneSize[i] = Mem_BuddyListSize(pState->Zones[i].PageCount);
+        if (zoneSize[i] == 0)
+        {
+            return KRN_ERR_INV_PARAMETER;
+        }
+        
+        buddySize += (zoneSize[i] + KRN_CACHE_LINE_SIZE - 1) & ~(size_t) (KRN_CACHE_LINE_SIZE - 1);
+    }
+    
+    if (buddySize == 0)
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // The page database and buddy bits share one run of pages, which has to
+    // be mapped since nothing else can map memory yet.  The buddy bits start
+    // on a cache line.
+    dbSize = sizeof(MEM_PAGE_DB_ENTRY) * pageCount;
+    dbSize = (dbSize + KRN_CACHE_LINE_SIZE - 1) & ~(size_t) (KRN_CACHE_LINE_SIZE - 1);
+    infoSize = dbSize + buddySize;
+    infoSize = (infoSize + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+    
+    infoPa = Mem_PagesFindBootRegion(pBootInfo, infoSize);
+    if (infoPa == 0)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    pState->PageCount = pageCount;
+    pState->MappedBaseVa = pBootInfo->MappedBaseVa;
+    pState->MappedPageCount = pBootInfo->MappedLength >> MEM_PAGE_SHIFT;
+    pState->pPageDb = (MEM_PAGE_DB_ENTRY*) (pState->MappedBaseVa + infoPa);
+    
+    pState->PageDbBytes = sizeof(MEM_PAGE_DB_ENTRY) * pageCount;
+    pState->BuddyBytes = buddySize;
+    
+    // One way of the cache, in pages, rounded down to a power of two.  A
+    // fully associative cache has no conflicts to color away.
+    Hal_CacheInfoGet(&cacheInfo);
+    pState->ColorCount = 1;
+    if (cacheInfo.Ways)
+    {
+        while ((pState->ColorCount < MEM_COLOR_MAX) &&
+               ((uint64_t) pState->ColorCount * 2 * MEM_PAGE_SIZE * cacheInfo.Ways <= cacheInfo.Size))
+        {
+            pState->ColorCount *= 2;
+        }
+    }
+    
+    pLocation = (char*) pState->pPageDb + dbSize;
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        MEM_ZONE* pZone = &pState->Zones[i];
+        
+        if (pZone->PageCount == 0)
+        {
+            continue;
+        }
+        
+        pZone->ReservePages = pZone->PageCount >> MEM_ZONE_RESERVE_SHIFT;
+        pZone->pBuddy = Mem_InitBuddyList(pLocation, zoneSize[i], pZone->PageCount, &bytesUsed);
+        
+        if (! pZone->pBuddy)
+        {
+            return KRN_ERR_NOT_ENOUGH_MEM;
+        }
+        
+        OS_ASSERT(bytesUsed == zoneSize[i]);
+        pLocation += (zoneSize[i] + KRN_CACHE_LINE_SIZE - 1) & ~(size_t) (KRN_CACHE_LINE_SIZE - 1);
+        
+        pZone->pBuddyPages = pZone->pBuddy;
+        while (pZone->pBuddyPages->pNext)
+        {
+            pZone->pBuddyPages = pZone->pBuddyPages->pNext;
+        }
+    }
+    
+    // Start with everything busy and reserved, then open up the available
+    // ranges, then close off anything else the ranges call out.
+    Mem_PagesBuddyFill(0, pageCount, MEM_BUDDY_ELEMENT_FULL);
+    Mem_PagesSetDb(0, pageCount, MEM_PAGE_0_FLAG_USED | (MEM_TYPE_RESERVED << MEM_PAGE_0_SHIFT_TYPE));
+    
+    for (i = 0; i < pBootInfo->MemRangeCount; i++)
+    {
+        uint64_t startPage;
+        uint64_t endPage;
+        
+        pRange = &pBootInfo->pMemRanges[i];
+        
+        if (pRange->Type != HAL_MEM_RANGE_AVAILABLE)
+        {
+            continue;
+        }
+        
+        // Only whole pages are usable.
+        startPage = (pRange->Base + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT;
+        endPage = (pRange->Base + pRange->Length) >> MEM_PAGE_SHIFT;
+        
+        if (endPage > pageCount)
+        {
+            endPage = pageCount;
+        }
+        
+        if (startPage < endPage)
+        {
+            Mem_PagesBuddyFill(startPage, endPage - startPage, 0);
+            Mem_PagesSetDb(startPage, endPage - startPage, 0);
+        }
+    }
+    
+    for (i = 0; i < pBootInfo->MemRangeCount; i++)
+    {
+        uint64_t startPage;
+        uint64_t endPage;
+        uint32_t type;
+        
+        pRange = &pBootInfo->pMemRanges[i];
+        
+        if (pRange->Type == HAL_MEM_RANGE_AVAILABLE)
+        {
+            continue;
+        }
+        
+        type = MEM_TYPE_RESERVED;
+        if (pRange->Type == HAL_MEM_RANGE_BOOT)
+        {
+            type = MEM_TYPE_BOOT;
+        }
+        
+        // Any page touched by a reserved range is reserved.
+        startPage = pRange->Base >> MEM_PAGE_SHIFT;
+        endPage = (pRange->Base + pRange->Length + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT;
+        
+        if (endPage > pageCount)
+        {
+            endPage = pageCount;
+        }
+        
+        if (startPage < endPage)
+        {
+            Mem_PagesBuddyFill(startPage, endPage - startPage, MEM_BUDDY_ELEMENT_FULL);
+            Mem_PagesSetDb(
+                    startPage,
+                    endPage - startPage,
+                    MEM_PAGE_0_FLAG_USED | (type << MEM_PAGE_0_SHIFT_TYPE));
         }
     }
+    
+    // Finally, our own bookkeeping.
+    Mem_PagesBuddyFill(
+            infoPa >> MEM_PAGE_SHIFT,
+            infoSize >> MEM_PAGE_SHIFT,
+            MEM_BUDDY_ELEMENT_FULL);
+    Mem_PagesSetDb(
+            infoPa >> MEM_PAGE_SHIFT,
+            infoSize >> MEM_PAGE_SHIFT,
+            MEM_PAGE_0_FLAG_USED | MEM_PAGE_0_FLAG_CRIT | (MEM_TYPE_MEM_INFO << MEM_PAGE_0_SHIFT_TYPE));
+    
+    Hal_conprintf(
+            "Mem: %u pages tracked, %u free, %u KB page info at %08X\n",
+            pageCount,
+            Mem_PagesFreeTotal(),
+            (uint32_t) (infoSize / 1024),
+            (uint32_t) infoPa);
+    
+    // Scaled in two steps to stay clear of 64 bit division.
+    Hal_conprintf(
+            "Mem: %u bytes of buddy bits, %u per GB, page database %u KB per GB\n",
+            (uint32_t) buddySize,
+            (uint32_t) ((buddySize * 1024) / pageCount) * 256,
+            (uint32_t) (sizeof(MEM_PAGE_DB_ENTRY) * 256));
+    Hal_conprintf(
+            "Mem: %u KB %u way cache, %u page colors\n",
+            cacheInfo.Size / 1024,
+            cacheInfo.Ways,
+            pState->ColorCount);
+    
+    return KRN_ERR_SUCCESS;
 }
 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesMarkBusy(
+    uintptr_t BasePa,
+    size_t PageCount,
+    uint32_t Flags
+    )
+{
+    MEM_PAGE_STATE* pState;
+    uint32_t pageStart;
+    uint32_t pageFlags;
+    uint32_t intState;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    pageStart = BasePa >> MEM_PAGE_SHIFT;
+    
+    if ((BasePa & (MEM_PAGE_SIZE - 1)) ||
+        (pageStart >= pState->PageCount) ||
+        (PageCount > (pState->PageCount - pageStart)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pageFlags = MEM_PAGE_0_FLAG_USED;
+    pageFlags |= ((Flags & MEM_TYPE_MASK) ? (Flags & MEM_TYPE_MASK) : MEM_TYPE_RESERVED) << MEM_PAGE_0_SHIFT_TYPE;
+    
+    if (Flags & MEM_OPTS_SYS_CRITICAL)
+    {
+        pageFlags |= MEM_PAGE_0_FLAG_CRIT;
+    }
+    
+    intState = Mem_PagesLock(pageStart, PageCount);
+    
+    // Only free pages can be claimed.
+    for (i = pageStart; i < (pageStart + PageCount); i++)
+    {
+        if (pState->pPageDb[i].PageFlags0 & MEM_PAGE_0_FLAG_USED)
+        {
+            Mem_PagesUnlock(pageStart, PageCount, intState);
+            return KRN_ERR_INV_PARAMETER;
+        }
+    }
+    
+    Mem_PagesBuddyFill(pageStart, PageCount, MEM_BUDDY_ELEMENT_FULL);
+    Mem_PagesSetDb(pageStart, PageCount, pageFlags);
+    
+    Mem_PagesUnlock(pageStart, PageCount, intState);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAlloc(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    )
+{
+    KRN_ERROR_CODE status;
+    uint64_t cycles;
+    uint32_t bucket;
+    
+    cycles = Hal_TimestampGet();
+    status = Mem_PagesAllocInternal(PageCount, Flags, pBasePa);
+    cycles = Hal_TimestampGet() - cycles;
+    
+    if (status != KRN_ERR_SUCCESS)
+    {
+        Krn_CounterInc(KRN_COUNTER_MEM_ALLOC_FAIL);
+        return status;
+    }
+    
+    bucket = 0;
+    while ((bucket < MEM_PAGE_STATS_LATENCY - 1) &&
+           (cycles >= (64ULL << bucket)))
+    {
+        bucket++;
+    }
+    
+    Krn_CounterInc(KRN_COUNTER_MEM_ALLOC);
+    Krn_CounterInc(KRN_COUNTER_MEM_ALLOC_LATENCY + bucket);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAllocInternal(
+    size_t PageCount,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    )
+{
+    MEM_PAGE_STATE* pState;
+    KRN_ERROR_CODE status;
+    uint32_t pageStart;
+    uint32_t pageFlags;
+    uint32_t intState;
+    uint32_t zeroed;
+    
+    pState = &g_Mem_PageState;
+    *pBasePa = 0;
+    
+    if ((PageCount == 0) ||
+        (PageCount > pState->PageCount))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // We can only clear pages we can reach.
+    if (Flags & MEM_OPTS_ZERO)
+    {
+        Flags |= MEM_OPTS_MAPPED;
+    }
+    
+    // Runs start on a buddy block of at least half their size, so any run
+    // of whole large pages is large page aligned.
+    if ((Flags & MEM_OPTS_LARGE_PAGE) &&
+        (PageCount % MEM_LARGE_PAGE_COUNT))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pageFlags = MEM_PAGE_0_FLAG_USED;
+    pageFlags |= ((Flags & MEM_TYPE_MASK) ? (Flags & MEM_TYPE_MASK) : MEM_TYPE_SYSTEM) << MEM_PAGE_0_SHIFT_TYPE;
+    
+    if (Flags & MEM_OPTS_SYS_CRITICAL)
+    {
+        pageFlags |= MEM_PAGE_0_FLAG_CRIT;
+    }
+    
+    status = KRN_ERR_NOT_ENOUGH_MEM;
+    zeroed = 0;
+    
+    // The color matters more than the zero pool, clearing is cheap next to
+    // a cache full of conflicts.
+    if ((PageCount == 1) &&
+        (Flags & MEM_OPTS_COLOR) &&
+        (pState->ColorCount > 1))
+    {
+        status = Mem_PagesColorPop(Flags, &pageStart);
+        
+        if (status != KRN_ERR_SUCCESS)
+        {
+            Krn_CounterInc(KRN_COUNTER_MEM_COLOR_MISS);
+        }
+    }
+    
+    if ((PageCount == 1) &&
+        (status != KRN_ERR_SUCCESS) &&
+        (Flags & MEM_OPTS_ZERO))
+    {
+        status = Mem_PagesZeroPoolPop(&pageStart);
+        zeroed = (status == KRN_ERR_SUCCESS);
+    }
+    
+    // Single pages come from this CPU's magazine when it can serve them.
+    if ((PageCount == 1) &&
+        (status != KRN_ERR_SUCCESS))
+    {
+        status = Mem_PagesMagazinePop(Flags, &pageStart);
+    }
+    
+    if (status == KRN_ERR_SUCCESS)
+    {
+        // Already ours, nobody else touches the entries.
+        Mem_PagesSetDb(pageStart, PageCount, pageFlags);
+    }
+    else
+    {
+        intState = Hal_InterruptsDisable();
+        status = Mem_PagesBuddyAlloc(PageCount, Flags, MEM_COLOR_ANY, pageFlags, &pageStart);
+        Hal_InterruptsRestore(intState);
+        
+        // Under pressure the zero pool is just free memory.  A single page
+        // comes straight out of it, DMA permitting, anything else gets the
+        // pool back in the buddy lists and tries again.
+        if ((status == KRN_ERR_NOT_ENOUGH_MEM) &&
+            (PageCount == 1) &&
+            ((Flags & MEM_OPTS_DMA) == 0))
+        {
+            status = Mem_PagesZeroPoolPop(&pageStart);
+            
+            if (status == KRN_ERR_SUCCESS)
+            {
+                Mem_PagesSetDb(pageStart, PageCount, pageFlags);
+                zeroed = 1;
+            }
+        }
+        
+        if ((status == KRN_ERR_NOT_ENOUGH_MEM) &&
+            (Mem_PagesZeroPoolDrain() > 0))
+        {
+            intState = Hal_InterruptsDisable();
+            status = Mem_PagesBuddyAlloc(PageCount, Flags, MEM_COLOR_ANY, pageFlags, &pageStart);
+            Hal_InterruptsRestore(intState);
+        }
+        
+        // Free memory may just be too scattered, try to make room.  The
+        // whole block is ours, anything past the request goes back.
+        if ((status == KRN_ERR_NOT_ENOUGH_MEM) &&
+            (PageCount > 1))
+        {
+            uint32_t blockSize;
+            
+            status = Mem_PagesCompact(PageCount, Flags, &pageStart, &blockSize);
+            
+            if (status == KRN_ERR_SUCCESS)
+            {
+                Mem_PagesSetDb(pageStart, PageCount, pageFlags);
+                Mem_PagesCompactRelease(pageStart + PageCount, blockSize - PageCount);
+            }
+        }
+        
+        if (status != KRN_ERR_SUCCESS)
+        {
+            return status;
+        }
+    }
+    
+    *pBasePa = ((uintptr_t) pageStart) << MEM_PAGE_SHIFT;
+    
+    if ((Flags & MEM_OPTS_ZERO) &&
+        (! zeroed))
+    {
+        memset(Mem_PagesPaToVa(*pBasePa), 0, PageCount * MEM_PAGE_SIZE);
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesAllocColor(
+    uintptr_t ColorPa,
+    uint32_t Flags,
+    uintptr_t* pBasePa
+    )
+{
+    MEM_PAGE_STATE* pState;
+    KRN_ERROR_CODE status;
+    uint32_t pageStart;
+    uint32_t pageFlags;
+    uint32_t intState;
+    
+    pState = &g_Mem_PageState;
+    *pBasePa = 0;
+    
+    // Every page has the one color.
+    if (pState->ColorCount == 1)
+    {
+        return Mem_PagesAllocInternal(1, Flags & ~MEM_OPTS_COLOR, pBasePa);
+    }
+    
+    if (Flags & (MEM_OPTS_ZERO | MEM_OPTS_LARGE_PAGE))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pageFlags = MEM_PAGE_0_FLAG_USED;
+    pageFlags |= ((Flags & MEM_TYPE_MASK) ? (Flags & MEM_TYPE_MASK) : MEM_TYPE_SYSTEM) << MEM_PAGE_0_SHIFT_TYPE;
+    
+    if (Flags & MEM_OPTS_SYS_CRITICAL)
+    {
+        pageFlags |= MEM_PAGE_0_FLAG_CRIT;
+    }
+    
+    // Straight from the buddy lists, pages move rarely enough.
+    intState = Hal_InterruptsDisable();
+    status = Mem_PagesBuddyAlloc(
+            1,
+            Flags,
+            (uint32_t) (ColorPa >> MEM_PAGE_SHIFT) & (pState->ColorCount - 1),
+            pageFlags,
+            &pageStart);
+    Hal_InterruptsRestore(intState);
+    
+    if (status == KRN_ERR_SUCCESS)
+    {
+        *pBasePa = ((uintptr_t) pageStart) << MEM_PAGE_SHIFT;
+    }
+    
+    return status;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesFree(
+    uintptr_t BasePa,
+    size_t PageCount
+    )
+{
+    KRN_ERROR_CODE status;
+    
+    status = Mem_PagesFreeInternal(BasePa, PageCount);
+    
+    Krn_CounterInc((status == KRN_ERR_SUCCESS) ? KRN_COUNTER_MEM_FREE : KRN_COUNTER_MEM_FREE_FAIL);
+    
+    return status;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesFreeInternal(
+    uintptr_t BasePa,
+    size_t PageCount
+    )
+{
+    MEM_PAGE_STATE* pState;
+    uint32_t pageStart;
+    uint32_t pageFlags;
+    uint32_t type;
+    uint32_t intState;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    pageStart = BasePa >> MEM_PAGE_SHIFT;
+    
+    if ((BasePa & (MEM_PAGE_SIZE - 1)) ||
+        (pageStart >= pState->PageCount) ||
+        (PageCount > (pState->PageCount - pageStart)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    // Never hand out pages that were not RAM to begin with, or our own
+    // bookkeeping.  Each page is claimed as it is checked, so two frees of
+    // the same page on different CPUs can't both get through.
+    for (i = pageStart; i < (pageStart + PageCount); i++)
+    {
+        pageFlags = pState->pPageDb[i].PageFlags0;
+        type = (pageFlags & MEM_PAGE_0_MASK_TYPE) >> MEM_PAGE_0_SHIFT_TYPE;
+        
+        if (((pageFlags & MEM_PAGE_0_FLAG_USED) == 0) ||
+            (pageFlags & MEM_PAGE_0_FLAG_FREEING) ||
+            (type == MEM_TYPE_RESERVED) ||
+            (type == MEM_TYPE_MEM_INFO) ||
+            (type == MEM_TYPE_CACHED) ||
+            (type == MEM_TYPE_ZEROED) ||
+            (Krn_InterlockedCmpExg32(
+                    &pState->pPageDb[i].PageFlags0,
+                    pageFlags | MEM_PAGE_0_FLAG_FREEING,
+                    pageFlags) != pageFlags))
+        {
+            // Give back what we claimed, only we write claimed entries.
+            while (i-- > pageStart)
+            {
+                pState->pPageDb[i].PageFlags0 &= ~MEM_PAGE_0_FLAG_FREEING;
+            }
+            
+            return KRN_ERR_INV_PARAMETER;
+        }
+    }
+    
+    if (PageCount == 1)
+    {
+        Mem_PagesMagazinePush(pageStart);
+        return KRN_ERR_SUCCESS;
+    }
+    
+    intState = Mem_PagesLock(pageStart, PageCount);
+    
+    Mem_PagesSetDb(pageStart, PageCount, 0);
+    Mem_PagesBuddyFill(pageStart, PageCount, 0);
+    
+    Mem_PagesUnlock(pageStart, PageCount, intState);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+// Takes the locks of every zone the range touches, in zone order.
+uint32_t
+OSCALL
+Mem_PagesLock(
+    uint32_t PageStart,
+    uint32_t PageCount
+    )
+{
+    uint32_t intState;
+    uint32_t i;
+    
+    intState = Hal_InterruptsDisable();
+    
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        MEM_ZONE* pZone = &g_Mem_PageState.Zones[i];
+        
+        if ((pZone->pBuddy) &&
+            (PageStart < pZone->BasePage + pZone->PageCount) &&
+            (PageStart + PageCount > pZone->BasePage))
+        {
+            Krn_SpinLockAcquire(&pZone->Lock);
+        }
+    }
+    
+    return intState;
+}
+
+void
+OSCALL
+Mem_PagesUnlock(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t IntState
+    )
+{
+    uint32_t i;
+    
+    for (i = MEM_ZONE_COUNT; i > 0; i--)
+    {
+        MEM_ZONE* pZone = &g_Mem_PageState.Zones[i - 1];
+        
+        if ((pZone->pBuddy) &&
+            (PageStart < pZone->BasePage + pZone->PageCount) &&
+            (PageStart + PageCount > pZone->BasePage))
+        {
+            Krn_SpinLockRelease(&pZone->Lock);
+        }
+    }
+    
+    Hal_InterruptsRestore(IntState);
+}
+
+uint32_t
+OSCALL
+Mem_PagesZoneOrder(
+    uint32_t Flags,
+    MEM_ZONE** ppZones
+    )
+{
+    uint32_t zone;
+    uint32_t count;
+    
+    // Preferred zone first, then the more precious ones below it.
+    if (Flags & MEM_OPTS_DMA)
+    {
+        zone = MEM_ZONE_DMA;
+    }
+    else if (Flags & MEM_OPTS_MAPPED)
+    {
+        zone = MEM_ZONE_LOW;
+    }
+    else
+    {
+        zone = MEM_ZONE_HIGH;
+    }
+    
+    count = 0;
+    for (zone++; zone > 0; zone--)
+    {
+        MEM_ZONE* pZone = &g_Mem_PageState.Zones[zone - 1];
+        
+        if (pZone->pBuddy)
+        {
+            ppZones[count++] = pZone;
+        }
+    }
+    
+    return count;
+}
+
+// Index of the zone holding Page.  The zones tile the tracked pages.
+uint32_t
+OSCALL
+Mem_PagesZoneOf(
+    uint32_t Page
+    )
+{
+    uint32_t zone;
+    
+    for (zone = 0; zone < MEM_ZONE_COUNT - 1; zone++)
+    {
+        if (Page < g_Mem_PageState.Zones[zone].BasePage + g_Mem_PageState.Zones[zone].PageCount)
+        {
+            break;
+        }
+    }
+    
+    return zone;
+}
+
+void
+OSCALL
+Mem_PagesBuddyFill(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t Fill
+    )
+{
+    uint32_t pageEnd;
+    uint32_t i;
+    
+    pageEnd = PageStart + PageCount;
+    
+    // The range may straddle zones, each one gets its own share.
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        MEM_ZONE* pZone = &g_Mem_PageState.Zones[i];
+        uint32_t start;
+        uint32_t end;
+        
+        if (! pZone->pBuddy)
+        {
+            continue;
+        }
+        
+        start = (PageStart > pZone->BasePage) ? PageStart : pZone->BasePage;
+        end = (pageEnd < pZone->BasePage + pZone->PageCount) ? pageEnd : pZone->BasePage + pZone->PageCount;
+        
+        if (start < end)
+        {
+            Mem_BuddyFillRange(pZone->pBuddyPages, start - pZone->BasePage, end - start, Fill);
+        }
+    }
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesBuddyAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    uint32_t Color,
+    uint32_t PageFlags0,
+    uint32_t* pPageStart
+    )
+{
+    MEM_ZONE* pZones[MEM_ZONE_COUNT];
+    KRN_ERROR_CODE status;
+    KRN_ERROR_CODE result;
+    uint32_t zoneCount;
+    uint32_t i;
+    
+    // Too large for every zone stays a parameter error, running short in
+    // any of them is a memory error.
+    result = KRN_ERR_INV_PARAMETER;
+    
+    zoneCount = Mem_PagesZoneOrder(Flags, pZones);
+    
+    // Falling back into a lower zone must leave its reserve alone.
+    for (i = 0; i < zoneCount; i++)
+    {
+        status = Mem_PagesZoneAlloc(
+                pZones[i],
+                PageCount,
+                Flags,
+                Color,
+                (i > 0) ? pZones[i]->ReservePages : 0,
+                PageFlags0,
+                pPageStart);
+        
+        if (status == KRN_ERR_SUCCESS)
+        {
+            return KRN_ERR_SUCCESS;
+        }
+        
+        if (status == KRN_ERR_NOT_ENOUGH_MEM)
+        {
+            result = status;
+        }
+    }
+    
+    return result;
+}
+
+// 
+// Takes PageCount pages from one zone's buddy lists, leaving at least
+// ReservePages free there, and records PageFlags0 for them.  Called with
+// interrupts disabled.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesZoneAlloc(
+    MEM_ZONE* pZone,
+    uint32_t PageCount,
+    uint32_t Flags,
+    uint32_t Color,
+    uint32_t ReservePages,
+    uint32_t PageFlags0,
+    uint32_t* pPageStart
+    )
+{
+    KRN_ERROR_CODE status;
+    uint32_t pageStart;
+    
+    Krn_SpinLockAcquire(&pZone->Lock);
+    
+    if ((ReservePages) &&
+        (pZone->pBuddyPages->BitsFree < PageCount + ReservePages))
+    {
+        Krn_SpinLockRelease(&pZone->Lock);
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    if (Color == MEM_COLOR_ANY)
+    {
+        status = Mem_BuddyAllocBlocks(pZone->pBuddy, PageCount, &pageStart);
+    }
+    else
+    {
+        OS_ASSERT(PageCount == 1);
+        status = Mem_BuddyAllocColor(pZone->pBuddyPages, Color, g_Mem_PageState.ColorCount, &pageStart);
+    }
+    
+    if (status != KRN_ERR_SUCCESS)
+    {
+        Krn_SpinLockRelease(&pZone->Lock);
+        return status;
+    }
+    
+    pageStart += pZone->BasePage;
+    
+    // The buddy lists always hand out the lowest free block, so if this
+    // one is past the mapping there is nothing lower to try here.
+    if ((Flags & MEM_OPTS_MAPPED) &&
+        ((pageStart + PageCount) > g_Mem_PageState.MappedPageCount))
+    {
+        Mem_BuddyFreeBlocks(pZone->pBuddy, pageStart - pZone->BasePage, PageCount);
+        Krn_SpinLockRelease(&pZone->Lock);
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    // The DB has to agree with the buddy bits before the lock drops.
+    Mem_PagesSetDb(pageStart, PageCount, PageFlags0);
+    Krn_SpinLockRelease(&pZone->Lock);
+    
+    *pPageStart = pageStart;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+uint32_t
+OSCALL
+Mem_PagesFreeTotal(
+    )
+{
+    uint32_t freePages;
+    uint32_t i;
+    
+    freePages = 0;
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        if (g_Mem_PageState.Zones[i].pBuddy)
+        {
+            freePages += g_Mem_PageState.Zones[i].pBuddyPages->BitsFree;
+        }
+    }
+    
+    return freePages;
+}
+
+void*
+OSCALL
+Mem_PagesPaToVa(
+    uintptr_t Pa
+    )
+{
+    if ((Pa >> MEM_PAGE_SHIFT) >= g_Mem_PageState.MappedPageCount)
+    {
+        return NULL;
+    }
+    
+    return (void*) (g_Mem_PageState.MappedBaseVa + Pa);
+}
+
+uint32_t
+OSCALL
+Mem_PagesZeroIdle(
+    )
+{
+    MEM_PAGE_STATE* pState;
+    uintptr_t pa;
+    void* pPage;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    
+    if (! pState->pPageDb)
+    {
+        return 0;
+    }
+    
+    // A few pages per call, so whatever else the idle loop does still runs.
+    for (i = 0; (i < MEM_ZERO_POOL_STEP) && (pState->ZeroPoolCount < MEM_ZERO_POOL_TARGET); i++)
+    {
+        if (Mem_PagesAllocInternal(1, MEM_TYPE_ZEROED | MEM_OPTS_MAPPED, &pa) != KRN_ERR_SUCCESS)
+        {
+            break;
+        }
+        
+        // Pool pages wait a while before use, keep them out of the cache.
+        pPage = Mem_PagesPaToVa(pa);
+        Krn_MemSetNt(pPage, 0, MEM_PAGE_SIZE);
+        
+        Krn_TaggedStackPush(&pState->ZeroPool, (KRN_STACK_ENTRY*) pPage);
+        Krn_InterlockedInc32(&pState->ZeroPoolCount);
+    }
+    
+    return i;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesZeroPoolPop(
+    uint32_t* pPage
+    )
+{
+    MEM_PAGE_STATE* pState;
+    KRN_STACK_ENTRY* pEntry;
+    
+    pState = &g_Mem_PageState;
+    
+    pEntry = Krn_TaggedStackPop(&pState->ZeroPool);
+    if (! pEntry)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    Krn_InterlockedDec32(&pState->ZeroPoolCount);
+    
+    // The link was the only word written since the page was zeroed.
+    pEntry->pNext = NULL;
+    
+    *pPage = ((uintptr_t) pEntry - pState->MappedBaseVa) >> MEM_PAGE_SHIFT;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+uint32_t
+OSCALL
+Mem_PagesZeroPoolDrain(
+    )
+{
+    uint32_t page;
+    uint32_t count;
+    
+    // Straight to the buddy lists, so the pages can merge into the blocks
+    // the failed request was after.
+    count = 0;
+    while (Mem_PagesZeroPoolPop(&page) == KRN_ERR_SUCCESS)
+    {
+        Mem_PagesCompactRelease(page, 1);
+        count++;
+    }
+    
+    return count;
+}
+
+void
+OSCALL
+Mem_PagesSetMovable(
+    uintptr_t Pa,
+    uint32_t Cookie
+    )
+{
+    MEM_PAGE_DB_ENTRY* pEntry;
+    uint32_t pageFlags;
+    
+    OS_ASSERT(Cookie <= MEM_MOVABLE_COOKIE_MAX);
+    
+    pEntry = &g_Mem_PageState.pPageDb[Pa >> MEM_PAGE_SHIFT];
+    
+    // The owner holds the page, but a bad free may be claiming it.
+    do
+    {
+        pageFlags = pEntry->PageFlags0;
+    } while (Krn_InterlockedCmpExg32(
+                &pEntry->PageFlags0,
+                (pageFlags & ~MEM_PAGE_0_MASK_KRN) | Cookie,
+                pageFlags) != pageFlags);
+}
+
+uint32_t
+OSCALL
+Mem_PagesGetMovable(
+    uintptr_t Pa
+    )
+{
+    MEM_PAGE_STATE* pState;
+    uint32_t pageFlags;
+    
+    pState = &g_Mem_PageState;
+    
+    if ((Pa >> MEM_PAGE_SHIFT) >= pState->PageCount)
+    {
+        return 0;
+    }
+    
+    pageFlags = pState->pPageDb[Pa >> MEM_PAGE_SHIFT].PageFlags0;
+    
+    return Mem_PagesIsMovable(pageFlags) ? (pageFlags & MEM_PAGE_0_MASK_KRN) : 0;
+}
+
+uint32_t
+OSCALL
+Mem_PagesIsMovable(
+    uint32_t PageFlags0
+    )
+{
+    return ((PageFlags0 & (MEM_PAGE_0_FLAG_USED | MEM_PAGE_0_FLAG_CRIT | MEM_PAGE_0_FLAG_FREEING | MEM_PAGE_0_MASK_TYPE)) ==
+            (MEM_PAGE_0_FLAG_USED | (MEM_TYPE_MOVABLE << MEM_PAGE_0_SHIFT_TYPE))) &&
+           (PageFlags0 & MEM_PAGE_0_MASK_KRN);
+}
+
+// 
+// Empties a block big enough for PageCount pages by migrating the movable
+// pages out of it, trying the zones Flags allow in order.  On success every
+// page of the block is left claimed by the caller, who hands back what it
+// does not use with Mem_PagesCompactRelease.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesCompact(
+    size_t PageCount,
+    uint32_t Flags,
+    uint32_t* pBlockStart,
+    uint32_t* pBlockSize
+    )
+{
+    MEM_PAGE_STATE* pState;
+    MEM_PAGE_DB_ENTRY* pPageDb;
+    MEM_ZONE* pZones[MEM_ZONE_COUNT];
+    MEM_BUDDY_LIST* pLevel;
+    KRN_ERROR_CODE status;
+    uint32_t zoneCount;
+    uint32_t blockStart;
+    uint32_t blockEnd;
+    uint32_t pageFlags;
+    uint32_t intState;
+    uint32_t moved;
+    uint32_t run;
+    uint32_t i;
+    uint32_t z;
+    
+    pState = &g_Mem_PageState;
+    pPageDb = pState->pPageDb;
+    *pBlockStart = 0;
+    *pBlockSize = 0;
+    
+    if (Krn_InterlockedCmpExg32(&pState->Compacting, 1, 0) != 0)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    // A fallback zone is only used if the block leaves its reserve alone.
+    zoneCount = Mem_PagesZoneOrder(Flags, pZones);
+    status = KRN_ERR_NOT_ENOUGH_MEM;
+    blockStart = 0;
+    blockEnd = 0;
+    pLevel = NULL;
+    
+    for (z = 0; (z < zoneCount) && (status != KRN_ERR_SUCCESS); z++)
+    {
+        if ((PageCount > pZones[z]->pBuddy->BlockSize) ||
+            ((z > 0) &&
+             (pZones[z]->pBuddyPages->BitsFree < PageCount + pZones[z]->ReservePages)))
+        {
+            continue;
+        }
+        
+        // Same level Mem_BuddyAllocBlocks would take the request from.
+        pLevel = pZones[z]->pBuddy;
+        while ((pLevel->pNext) &&
+               (pLevel->pNext->BlockSize >= PageCount))
+        {
+            pLevel = pLevel->pNext;
+        }
+        
+        status = Mem_PagesCompactFind(pZones[z], pLevel->BlockSize, Flags, &blockStart);
+    }
+    
+    // Claim the free pages so nothing new lands in the block while it
+    // empties, after checking it still only holds free and movable pages.
+    if (status == KRN_ERR_SUCCESS)
+    {
+        blockEnd = blockStart + pLevel->BlockSize;
+        intState = Mem_PagesLock(blockStart, pLevel->BlockSize);
+        
+        for (i = blockStart; i < blockEnd; i++)
+        {
+            pageFlags = pPageDb[i].PageFlags0;
+            
+            if ((pageFlags & MEM_PAGE_0_FLAG_USED) &&
+                (! Mem_PagesIsMovable(pageFlags)))
+            {
+                status = KRN_ERR_NOT_ENOUGH_MEM;
+                break;
+            }
+        }
+        
+        for (i = blockStart; (status == KRN_ERR_SUCCESS) && (i < blockEnd); i += run + 1)
+        {
+            run = 0;
+            while (((i + run) < blockEnd) &&
+                   ((pPageDb[i + run].PageFlags0 & MEM_PAGE_0_FLAG_USED) == 0))
+            {
+                run++;
+            }
+            
+            Mem_PagesBuddyFill(i, run, MEM_BUDDY_ELEMENT_FULL);
+            Mem_PagesSetDb(i, run, MEM_PAGE_0_CLAIMED);
+        }
+        
+        Mem_PagesUnlock(blockStart, pLevel->BlockSize, intState);
+    }
+    
+    // The moved out pages are ours.  A page freed or pinned meanwhile ends
+    // the attempt.
+    moved = 0;
+    for (i = blockStart; (status == KRN_ERR_SUCCESS) && (i < blockEnd); i++)
+    {
+        pageFlags = pPageDb[i].PageFlags0;
+        
+        if (pageFlags == MEM_PAGE_0_CLAIMED)
+        {
+            continue;
+        }
+        
+        status = KRN_ERR_NOT_ENOUGH_MEM;
+        if (Mem_PagesIsMovable(pageFlags))
+        {
+            status = Mem_KvaMovePage(pageFlags & MEM_PAGE_0_MASK_KRN, (uintptr_t) i << MEM_PAGE_SHIFT);
+        }
+        
+        if (status == KRN_ERR_SUCCESS)
+        {
+            Mem_PagesSetDb(i, 1, MEM_PAGE_0_CLAIMED);
+            moved++;
+        }
+    }
+    
+    if (moved)
+    {
+        Krn_CounterAdd(KRN_COUNTER_MEM_COMPACT_MOVED, moved);
+    }
+    
+    if (status != KRN_ERR_SUCCESS)
+    {
+        // Every claimed page in the block is ours.
+        intState = Mem_PagesLock(blockStart, blockEnd - blockStart);
+        
+        for (i = blockStart; i < blockEnd; i++)
+        {
+            if (pPageDb[i].PageFlags0 == MEM_PAGE_0_CLAIMED)
+            {
+                Mem_PagesSetDb(i, 1, 0);
+                Mem_PagesBuddyFill(i, 1, 0);
+            }
+        }
+        
+        Mem_PagesUnlock(blockStart, blockEnd - blockStart, intState);
+        
+        Krn_CounterInc(KRN_COUNTER_MEM_COMPACT_FAIL);
+    }
+    else
+    {
+        Krn_CounterInc(KRN_COUNTER_MEM_COMPACT);
+        *pBlockStart = blockStart;
+        *pBlockSize = pLevel->BlockSize;
+    }
+    
+    Krn_InterlockedExg32(&pState->Compacting, 0);
+    
+    return status;
+}
+
+// 
+// Picks the block of BlockSize pages in the zone, holding only free and
+// movable pages, that needs the fewest moves and leaves enough free pages
+// elsewhere to move them to.  Only MEM_COMPACT_SCAN_PAGES are looked at,
+// starting where the last scan of the zone stopped, so a failing allocation
+// does not walk the whole page DB.  This is a lockless look,
+// Mem_PagesCompact checks again.
+// 
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesCompactFind(
+    MEM_ZONE* pZone,
+    uint32_t BlockSize,
+    uint32_t Flags,
+    uint32_t* pBlockStart
+    )
+{
+    MEM_PAGE_STATE* pState;
+    uint32_t pageFlags;
+    uint32_t freePages;
+    uint32_t bestMoves;
+    uint32_t moves;
+    uint32_t limit;
+    uint32_t blockCount;
+    uint32_t scanCount;
+    uint32_t index;
+    uint32_t block;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    *pBlockStart = 0;
+    
+    limit = pZone->BasePage + pZone->PageCount;
+    if ((Flags & MEM_OPTS_MAPPED) &&
+        (pState->MappedPageCount < limit))
+    {
+        limit = pState->MappedPageCount;
+    }
+    
+    if (limit < pZone->BasePage + BlockSize)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    blockCount = (limit - pZone->BasePage) / BlockSize;
+    index = (pZone->CompactCursor / BlockSize) % blockCount;
+    
+    scanCount = MEM_COMPACT_SCAN_PAGES / BlockSize;
+    if (scanCount == 0)
+    {
+        scanCount = 1;
+    }
+    else if (scanCount > blockCount)
+    {
+        scanCount = blockCount;
+    }
+    
+    freePages = Mem_PagesFreeTotal();
+    bestMoves = UINT32_MAX;
+    
+    for (; (scanCount > 0) && (bestMoves != 0); scanCount--)
+    {
+        block = pZone->BasePage + (index * BlockSize);
+        index = (index + 1 == blockCount) ? 0 : index + 1;
+        moves = 0;
+        
+        for (i = block; i < (block + BlockSize); i++)
+        {
+            pageFlags = pState->pPageDb[i].PageFlags0;
+            
+            if ((pageFlags & MEM_PAGE_0_FLAG_USED) == 0)
+            {
+                continue;
+            }
+            
+            if ((! Mem_PagesIsMovable(pageFlags)) ||
+                (moves >= bestMoves))
+            {
+                break;
+            }
+            
+            moves++;
+        }
+        
+        // Pages can only move to free pages outside the block.
+        if ((i == (block + BlockSize)) &&
+            (BlockSize <= freePages) &&
+            (moves <= freePages - (BlockSize - moves)))
+        {
+            bestMoves = moves;
+            *pBlockStart = block;
+        }
+    }
+    
+    // Only Mem_PagesCompact gets here, one at a time.
+    pZone->CompactCursor = index * BlockSize;
+    
+    return (bestMoves == UINT32_MAX) ? KRN_ERR_NOT_ENOUGH_MEM : KRN_ERR_SUCCESS;
+}
+
+// Hands claimed pages back to the buddy lists.
+void
+OSCALL
+Mem_PagesCompactRelease(
+    uint32_t PageStart,
+    uint32_t PageCount
+    )
+{
+    uint32_t intState;
+    
+    if (PageCount == 0)
+    {
+        return;
+    }
+    
+    intState = Mem_PagesLock(PageStart, PageCount);
+    
+    Mem_PagesSetDb(PageStart, PageCount, 0);
+    Mem_PagesBuddyFill(PageStart, PageCount, 0);
+    
+    Mem_PagesUnlock(PageStart, PageCount, intState);
+}
+
+uint32_t
+OSCALL
+Mem_PagesCompactIdle(
+    )
+{
+    MEM_PAGE_STATE* pState;
+    MEM_ZONE* pZones[MEM_ZONE_COUNT];
+    MEM_BUDDY_LIST* pLevel;
+    uint32_t zoneCount;
+    uint32_t blockStart;
+    uint32_t blockSize;
+    uint32_t freeCount;
+    uint32_t moved;
+    uint32_t z;
+    
+    pState = &g_Mem_PageState;
+    
+    if (! pState->pPageDb)
+    {
+        return 0;
+    }
+    
+    // Nothing to do while ordinary allocations can find a free large page,
+    // or without room to make one and still have somewhere to move pages
+    // to.  Fragmentation only gets worse through frees, so a fruitless scan
+    // is not repeated until one happens.
+    zoneCount = Mem_PagesZoneOrder(0, pZones);
+    
+    for (z = 0; z < zoneCount; z++)
+    {
+        if (pZones[z]->pBuddy->BlockSize < MEM_COMPACT_IDLE_PAGES)
+        {
+            continue;
+        }
+        
+        pLevel = pZones[z]->pBuddy;
+        while ((pLevel->pNext) &&
+               (pLevel->pNext->BlockSize >= MEM_COMPACT_IDLE_PAGES))
+        {
+            pLevel = pLevel->pNext;
+        }
+        
+        if (pLevel->BitsFree != 0)
+        {
+            return 0;
+        }
+    }
+    
+    freeCount = Krn_CounterRead(KRN_COUNTER_MEM_FREE);
+    
+    if ((Mem_PagesFreeTotal() < 2 * MEM_COMPACT_IDLE_PAGES) ||
+        (freeCount == pState->CompactIdleFreeCount))
+    {
+        return 0;
+    }
+    
+    moved = Krn_CounterRead(KRN_COUNTER_MEM_COMPACT_MOVED);
+    
+    // Each try only scans part of memory, so only give up once the tries
+    // add up to all of it.
+    if (Mem_PagesCompact(MEM_COMPACT_IDLE_PAGES, 0, &blockStart, &blockSize) != KRN_ERR_SUCCESS)
+    {
+        pState->CompactIdleScanned += MEM_COMPACT_SCAN_PAGES;
+        
+        if (pState->CompactIdleScanned >= pState->PageCount)
+        {
+            pState->CompactIdleFreeCount = freeCount;
+            pState->CompactIdleScanned = 0;
+        }
+        
+        return 0;
+    }
+    
+    pState->CompactIdleScanned = 0;
+    
+    Mem_PagesCompactRelease(blockStart, blockSize);
+    
+    return Krn_CounterRead(KRN_COUNTER_MEM_COMPACT_MOVED) - moved;
+}
+
+void
+OSCALL
+Mem_PagesStatsGet(
+    MEM_PAGE_STATS* pStats
+    )
+{
+    MEM_PAGE_STATE* pState;
+    MEM_BUDDY_LIST* pLevel;
+    uint32_t parentFree;
+    uint32_t order;
+    uint32_t i;
+    
+    pState = &g_Mem_PageState;
+    
+    memset(pStats, 0, sizeof(*pStats));
+    
+    pStats->PageCount = pState->PageCount;
+    pStats->PageDbBytes = pState->PageDbBytes;
+    pStats->BuddyBytes = pState->BuddyBytes;
+    pStats->ZeroPoolPages = pState->ZeroPoolCount;
+    pStats->AllocCount = Krn_CounterRead(KRN_COUNTER_MEM_ALLOC);
+    pStats->AllocFailCount = Krn_CounterRead(KRN_COUNTER_MEM_ALLOC_FAIL);
+    pStats->FreeCount = Krn_CounterRead(KRN_COUNTER_MEM_FREE);
+    pStats->FreeFailCount = Krn_CounterRead(KRN_COUNTER_MEM_FREE_FAIL);
+    for (i = 0; i < MEM_PAGE_STATS_LATENCY; i++)
+    {
+        pStats->AllocLatency[i] = Krn_CounterRead(KRN_COUNTER_MEM_ALLOC_LATENCY + i);
+    }
+    pStats->CompactCount = Krn_CounterRead(KRN_COUNTER_MEM_COMPACT);
+    pStats->CompactFailCount = Krn_CounterRead(KRN_COUNTER_MEM_COMPACT_FAIL);
+    pStats->CompactMovedPages = Krn_CounterRead(KRN_COUNTER_MEM_COMPACT_MOVED);
+    pStats->ColorCount = pState->ColorCount;
+    pStats->ColorMissCount = Krn_CounterRead(KRN_COUNTER_MEM_COLOR_MISS);
+    
+    // A free parent means both children are free, so every free block not
+    // inside a larger one is counted exactly once.  Readers race with the
+    // allocator, the numbers are a snapshot and may not add up exactly.
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        MEM_ZONE* pZone = &pState->Zones[i];
+        
+        pStats->Zones[i].BasePage = pZone->BasePage;
+        pStats->Zones[i].PageCount = pZone->PageCount;
+        pStats->Zones[i].ReservePages = pZone->ReservePages;
+        
+        if (! pZone->pBuddy)
+        {
+            continue;
+        }
+        
+        pStats->Zones[i].FreePages = pZone->pBuddyPages->BitsFree;
+        pStats->FreePages += pZone->pBuddyPages->BitsFree;
+        
+        order = 0;
+        for (pLevel = pZone->pBuddyPages; pLevel; pLevel = pLevel->pPrev)
+        {
+            parentFree = pLevel->pPrev ? pLevel->pPrev->BitsFree : 0;
+            
+            if ((order < MEM_PAGE_STATS_ORDERS) &&
+                (pLevel->BitsFree > 2 * parentFree))
+            {
+                pStats->FreeBlocks[order] += pLevel->BitsFree - 2 * parentFree;
+            }
+            
+            if ((pLevel->BitsFree) &&
+                (order > pStats->LargestFreeOrder))
+            {
+                pStats->LargestFreeOrder = order;
+            }
+            
+            order++;
+        }
+        
+        if (order > pStats->OrderCount)
+        {
+            pStats->OrderCount = order;
+        }
+    }
+}
+
+void
+OSCALL
+Mem_PagesStatsPrint(
+    )
+{
+    MEM_PAGE_STATS stats;
+    uint32_t i;
+    
+    Mem_PagesStatsGet(&stats);
+    
+    Hal_conprintf(
+            "Mem: %u of %u pages free, %u zeroed, largest free order %u\n",
+            stats.FreePages,
+            stats.PageCount,
+            stats.ZeroPoolPages,
+            stats.LargestFreeOrder);
+    Hal_conprintf(
+            "Mem: %u allocs, %u failed, %u frees, %u failed\n",
+            stats.AllocCount,
+            stats.AllocFailCount,
+            stats.FreeCount,
+            stats.FreeFailCount);
+    Hal_conprintf(
+            "Mem: %u blocks compacted, %u pages moved, %u attempts failed\n",
+            stats.CompactCount,
+            stats.CompactMovedPages,
+            stats.CompactFailCount);
+    Hal_conprintf(
+            "Mem: %u page colors, %u colored requests missed\n",
+            stats.ColorCount,
+            stats.ColorMissCount);
+    
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        if (stats.Zones[i].PageCount)
+        {
+            Hal_conprintf(
+                    "Mem: %s zone from %u MB, %u of %u pages free, %u reserved\n",
+                    g_Mem_ZoneNames[i],
+                    stats.Zones[i].BasePage >> (20 - MEM_PAGE_SHIFT),
+                    stats.Zones[i].FreePages,
+                    stats.Zones[i].PageCount,
+                    stats.Zones[i].ReservePages);
+        }
+    }
+    
+    Hal_conprintf("Mem: free blocks by order:");
+    for (i = 0; (i < stats.OrderCount) && (i < MEM_PAGE_STATS_ORDERS); i++)
+    {
+        Hal_conprintf(" %u", stats.FreeBlocks[i]);
+    }
+    
+    Hal_conprintf("\nMem: alloc cycles under 2^6, then doubling:");
+    for (i = 0; i < MEM_PAGE_STATS_LATENCY; i++)
+    {
+        Hal_conprintf(" %u", stats.AllocLatency[i]);
+    }
+    Hal_conprintf("\n");
+}
+
+uintptr_t
+OSCALL
+Mem_PagesFindBootRegion(
+    const HAL_BOOT_INFO* pBootInfo,
+    size_t ByteCount
+    )
+{
+    uint32_t i;
+    uint32_t j;
+    
+    // Lowest page aligned spot inside an available range, clear of every
+    // other range, and inside the boot mapping.  Page 0 is never used.
+    for (i = 0; i < pBootInfo->MemRangeCount; i++)
+    {
+        const HAL_MEM_RANGE* pRange = &pBootInfo->pMemRanges[i];
+        uint64_t start;
+        uint64_t end;
+        
+        if (pRange->Type != HAL_MEM_RANGE_AVAILABLE)
+        {
+            continue;
+        }
+        
+        start = (pRange->Base + MEM_PAGE_SIZE - 1) & ~((uint64_t) MEM_PAGE_SIZE - 1);
+        end = pRange->Base + pRange->Length;
+        
+        if (start == 0)
+        {
+            start = MEM_PAGE_SIZE;
+        }
+        
+        if (end > pBootInfo->MappedLength)
+        {
+            end = pBootInfo->MappedLength;
+        }
+        
+        // Slide past any reserved range in the way, then start over since
+        // sliding may have hit another one.
+        j = 0;
+        while ((j < pBootInfo->MemRangeCount) &&
+               ((start + ByteCount) <= end))
+        {
+            const HAL_MEM_RANGE* pOther = &pBootInfo->pMemRanges[j];
+            
+            if ((pOther->Type != HAL_MEM_RANGE_AVAILABLE) &&
+                (pOther->Base < (start + ByteCount)) &&
+                ((pOther->Base + pOther->Length) > start))
+            {
+                start = (pOther->Base + pOther->Length + MEM_PAGE_SIZE - 1) &
+                    ~((uint64_t) MEM_PAGE_SIZE - 1);
+                j = 0;
+                continue;
+            }
+            
+            j++;
+        }
+        
+        if ((start + ByteCount) <= end)
+        {
+            return (uintptr_t) start;
+        }
+    }
+    
+    return 0;
+}
+
+void
+OSCALL
+Mem_PagesSetDb(
+    uint32_t PageStart,
+    uint32_t PageCount,
+    uint32_t PageFlags0
+    )
+{
+    MEM_PAGE_DB_ENTRY* pEntry;
+    
+    pEntry = &g_Mem_PageState.pPageDb[PageStart];
+    
+    while (PageCount-- > 0)
+    {
+        pEntry->PageFlags0 = PageFlags0;
+        pEntry->PageFlags1 = 0;
+        pEntry++;
+    }
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesMagazinePop(
+    uint32_t Flags,
+    uint32_t* pPage
+    )
+{
+    MEM_PAGE_STATE* pState;
+    MEM_PAGE_MAGAZINE* pMagazine;
+    MEM_ZONE* pZones[MEM_ZONE_COUNT];
+    KRN_ERROR_CODE status;
+    uint32_t* pCount;
+    uint32_t* pPages;
+    uint32_t zoneCount;
+    uint32_t intState;
+    uint32_t page;
+    uint32_t z;
+    
+    pState = &g_Mem_PageState;
+    status = KRN_ERR_NOT_ENOUGH_MEM;
+    zoneCount = Mem_PagesZoneOrder(Flags, pZones);
+    
+    intState = Hal_InterruptsDisable();
+    pMagazine = &Hal_GetCpuData()->PageMagazine;
+    
+    for (z = 0; (z < zoneCount) && (status != KRN_ERR_SUCCESS); z++)
+    {
+        if (! Mem_PagesMagazineUsable(pZones, z))
+        {
+            continue;
+        }
+        
+        pCount = &pMagazine->Count[pZones[z] - pState->Zones];
+        pPages = pMagazine->Pages[pZones[z] - pState->Zones];
+        
+        // Only the preferred zone refills, with one aligned batch if we can,
+        // single pages if not.
+        if ((*pCount == 0) &&
+            (z == 0))
+        {
+            if (Mem_PagesZoneAlloc(
+                        pZones[0],
+                        MEM_PAGE_MAGAZINE_BATCH,
+                        Flags & MEM_OPTS_MAPPED,
+                        MEM_COLOR_ANY,
+                        0,
+                        MEM_PAGE_0_FLAG_USED | (MEM_TYPE_CACHED << MEM_PAGE_0_SHIFT_TYPE),
+                        &page) == KRN_ERR_SUCCESS)
+            {
+                // Push high to low so the lowest page comes off first.
+                while (*pCount < MEM_PAGE_MAGAZINE_BATCH)
+                {
+                    pPages[*pCount] = page + MEM_PAGE_MAGAZINE_BATCH - 1 - *pCount;
+                    (*pCount)++;
+                }
+            }
+            else
+            {
+                while ((*pCount < MEM_PAGE_MAGAZINE_BATCH) &&
+                       (Mem_PagesZoneAlloc(
+                                pZones[0],
+                                1,
+                                Flags & MEM_OPTS_MAPPED,
+                                MEM_COLOR_ANY,
+                                0,
+                                MEM_PAGE_0_FLAG_USED | (MEM_TYPE_CACHED << MEM_PAGE_0_SHIFT_TYPE),
+                                &page) == KRN_ERR_SUCCESS))
+                {
+                    pPages[*pCount] = page;
+                    (*pCount)++;
+                }
+            }
+        }
+        
+        // A zone can reach past the mapping when the one above it was folded in.
+        if (*pCount > 0)
+        {
+            page = pPages[*pCount - 1];
+            
+            if (((Flags & MEM_OPTS_MAPPED) == 0) || (page < pState->MappedPageCount))
+            {
+                (*pCount)--;
+                *pPage = page;
+                status = KRN_ERR_SUCCESS;
+            }
+        }
+    }
+    
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
+
+// 
+// Whether the zone at Index in a request's zone order may hand it cached
+// pages.  The same rule as Mem_PagesBuddyAlloc: the preferred zone always
+// can, a fallback zone only while its reserve is still free.  This is a
+// lockless look, being a page or two off only moves the line slightly.
+// 
+int
+OSCALL
+Mem_PagesMagazineUsable(
+    MEM_ZONE** ppZones,
+    uint32_t Index
+    )
+{
+    return (Index == 0) ||
+           (ppZones[Index]->pBuddyPages->BitsFree >= ppZones[Index]->ReservePages);
+}
+
+KRN_ERROR_CODE
+OSCALL
+Mem_PagesColorPop(
+    uint32_t Flags,
+    uint32_t* pPage
+    )
+{
+    MEM_PAGE_STATE* pState;
+    MEM_PAGE_MAGAZINE* pMagazine;
+    MEM_ZONE* pZones[MEM_ZONE_COUNT];
+    KRN_ERROR_CODE status;
+    uint32_t* pCount;
+    uint32_t* pPages;
+    uint32_t zoneCount;
+    uint32_t intState;
+    uint32_t color;
+    uint32_t page;
+    uint32_t i;
+    uint32_t z;
+    
+    pState = &g_Mem_PageState;
+    status = KRN_ERR_NOT_ENOUGH_MEM;
+    zoneCount = Mem_PagesZoneOrder(Flags, pZones);
+    
+    intState = Hal_InterruptsDisable();
+    pMagazine = &Hal_GetCpuData()->PageMagazine;
+    
+    // Round robin per CPU, so a run of requests walks the whole cache.
+    color = pMagazine->NextColor & (pState->ColorCount - 1);
+    pMagazine->NextColor = color + 1;
+    
+    // The magazines usually hold batches of consecutive pages, try them
+    // first, in zone order.
+    for (z = 0; (z < zoneCount) && (status != KRN_ERR_SUCCESS); z++)
+    {
+        if (! Mem_PagesMagazineUsable(pZones, z))
+        {
+            continue;
+        }
+        
+        pCount = &pMagazine->Count[pZones[z] - pState->Zones];
+        pPages = pMagazine->Pages[pZones[z] - pState->Zones];
+        
+        for (i = *pCount; i > 0; i--)
+        {
+            page = pPages[i - 1];
+            
+            if (((page & (pState->ColorCount - 1)) == color) &&
+                (((Flags & MEM_OPTS_MAPPED) == 0) || (page < pState->MappedPageCount)))
+            {
+                (*pCount)--;
+                pPages[i - 1] = pPages[*pCount];
+                *pPage = page;
+                status = KRN_ERR_SUCCESS;
+                break;
+            }
+        }
+    }
+    
+    // Held like a magazine page until the caller records its own type.
+    if (status != KRN_ERR_SUCCESS)
+    {
+        status = Mem_PagesBuddyAlloc(
+                1,
+                Flags,
+                color,
+                MEM_PAGE_0_FLAG_USED | (MEM_TYPE_CACHED << MEM_PAGE_0_SHIFT_TYPE),
+                pPage);
+    }
+    
+    Hal_InterruptsRestore(intState);
+    
+    return status;
+}
+
+void
+OSCALL
+Mem_PagesMagazinePush(
+    uint32_t Page
+    )
+{
+    MEM_PAGE_MAGAZINE* pMagazine;
+    MEM_ZONE* pZone;
+    uint32_t* pCount;
+    uint32_t* pPages;
+    uint32_t intState;
+    uint32_t zone;
+    
+    zone = Mem_PagesZoneOf(Page);
+    pZone = &g_Mem_PageState.Zones[zone];
+    
+    intState = Hal_InterruptsDisable();
+    pMagazine = &Hal_GetCpuData()->PageMagazine;
+    pCount = &pMagazine->Count[zone];
+    pPages = pMagazine->Pages[zone];
+    
+    // Full, send the oldest batch back to the zone's buddy lists.
+    if (*pCount == MEM_PAGE_MAGAZINE_SIZE)
+    {
+        uint32_t i;
+        
+        Krn_SpinLockAcquire(&pZone->Lock);
+        
+        for (i = 0; i < MEM_PAGE_MAGAZINE_BATCH; i++)
+        {
+            Mem_PagesSetDb(pPages[i], 1, 0);
+            Mem_BuddyFillRange(pZone->pBuddyPages, pPages[i] - pZone->BasePage, 1, 0);
+        }
+        
+        Krn_SpinLockRelease(&pZone->Lock);
+        
+        for (i = MEM_PAGE_MAGAZINE_BATCH; i < MEM_PAGE_MAGAZINE_SIZE; i++)
+        {
+            pPages[i - MEM_PAGE_MAGAZINE_BATCH] = pPages[i];
+        }
+        
+        *pCount -= MEM_PAGE_MAGAZINE_BATCH;
+    }
+    
+    Mem_PagesSetDb(Page, 1, MEM_PAGE_0_FLAG_USED | (MEM_TYPE_CACHED << MEM_PAGE_0_SHIFT_TYPE));
+    pPages[*pCount] = Page;
+    (*pCount)++;
+    
+    Hal_InterruptsRestore(intState);
+}
@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Host test harness shared definitions.
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <krn_base.h>
+
+#include <stdio.h>
+
+#define TEST_CHECK(X) \
+    if (!(X)) { Test_Fail(#X, __FILE__, __LINE__); return 1; }
+
+// Run by test_main.c, each returns non-zero on failure.
+int
+OSCALL
+Test_Base(
+    int Bench
+    );
+
+int
+OSCALL
+Test_Mem(
+    int Bench
+    );
+
+int
+OSCALL
+Test_Cache(
+    int Bench
+    );
+
+int
+OSCALL
+Test_Epoch(
+    int Bench
+    );
+
+int
+OSCALL
+Test_Kva(
+    int Bench
+    );
+
+int
+OSCALL
+Test_Counter(
+    int Bench
+    );
+
+// Page allocator setup from test_mem.c, for tests that need pages.
+int
+OSCALL
+Test_MemInit(
+    uint64_t MemBytes
+    );
+
+void
+OSCALL
+Test_MemDone(
+    );
+
+uint32_t
+OSCALL
+Test_MemCountFree(
+    );
+
+// Host memory standing in for kernel VA, from test_stubs.c.  Mappings made
+// through the HAL stubs become accessible, everything else faults.  Mapped
+// pages share the contents of their PA.
+void*
+OSCALL
+Test_KvaReserve(
+    size_t Length
+    );
+
+void
+OSCALL
+Test_KvaRelease(
+    );
+
+int
+OSCALL
+Test_KvaIsMapped(
+    uintptr_t Va
+    );
+
+uintptr_t
+OSCALL
+Test_KvaPa(
+    uintptr_t Va
+    );
+
+// Helpers from test_main.c.
+void
+OSCALL
+Test_Fail(
+    const char* pExpr,
+    const char* pSourceFile,
+    int SourceLine
+    );
+
+void
+OSCALL
+Test_Seed(
+    uint64_t Seed
+    );
+
+uint32_t
+OSCALL
+Test_Rand(
+    );
+
+uint64_t
+OSCALL
+Test_Ns(
+    );
+
+#endif // __TEST_H__
@@ -0,0 +1,1518 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Memory primitive tests.  Every size, alignment and overlap near the
+// boundaries the kernel versions switch strategy at is checked against byte
+// loops, which also serve as the baseline for the benchmark.  The tagged
+// stack is run from several threads and checked for lost or doubled entries,
+// the locks for lost updates and readers for torn reads, the rings for lost
+// or reordered items.  The tree and hash table are checked against brute
+// force searches, with the tree's red-black rules checked as it changes.
+// The atomics are checked for carries between the halves of 64 bit values.
+
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Large enough for the non-temporal path at every offset.
+#define TEST_BASE_BUFFER        (1024*1024)
+#define TEST_BASE_BENCH_BYTES   (256ULL*1024*1024)
+
+// The old kernel loops, a byte at a time.  Kept from turning into library
+// calls or vector code, so they measure what the kernel used to run.
+#define TEST_BASE_BYTE_LOOP     __attribute__((optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+
+#define TEST_BASE_STACK_ENTRIES 1024
+#define TEST_BASE_STACK_THREADS 4
+#define TEST_BASE_STACK_OPS     400000
+
+typedef struct _TEST_BASE_ENTRY
+{
+    KRN_STACK_ENTRY Link;
+    volatile uint32_t Owned;
+} TEST_BASE_ENTRY;
+
+typedef struct _TEST_BASE_THREAD
+{
+    pthread_t Thread;
+    TEST_BASE_ENTRY* pHeld[TEST_BASE_STACK_ENTRIES];
+    uint32_t HeldCount;
+    uint32_t Seed;
+    int Failed;
+} TEST_BASE_THREAD;
+
+#define TEST_BASE_LOCK_THREADS  4
+#define TEST_BASE_LOCK_OPS      200000
+
+// Fair locks hand over to the next waiter even when it isn't running, which
+// costs a time slice once threads outnumber CPUs.
+#define TEST_BASE_LOCK_OPS_SHARED 200
+
+#define TEST_BASE_LOCK_SPIN     0
+#define TEST_BASE_LOCK_TICKET   1
+#define TEST_BASE_LOCK_MCS      2
+#define TEST_BASE_LOCK_RW       3
+#define TEST_BASE_LOCK_SEQ      4
+#define TEST_BASE_LOCK_COUNT    5
+
+// Reader-writer and sequence locks write one round in this many.
+#define TEST_BASE_LOCK_WRITES   8
+
+typedef struct _TEST_BASE_LOCK_THREAD
+{
+    pthread_t Thread;
+    uint32_t Kind;
+    uint32_t OpCount;
+    int Failed;
+} TEST_BASE_LOCK_THREAD;
+
+#define TEST_BASE_RING_SLOTS    256
+#define TEST_BASE_RING_ITEMS    2000000
+#define TEST_BASE_RING_BATCH    32
+#define TEST_BASE_RING_PRODUCERS 4
+
+// Items carry the producer in the top bits and a count from 1 below.
+#define TEST_BASE_RING_SHIFT    28
+
+typedef struct _TEST_BASE_RING_THREAD
+{
+    pthread_t Thread;
+    KRN_RING* pRing;
+    uint32_t Producer;
+    uint32_t ItemCount;
+    int Multi;
+} TEST_BASE_RING_THREAD;
+
+#define TEST_BASE_TREE_ENTRIES  2048
+#define TEST_BASE_TREE_KEYS     4096
+#define TEST_BASE_TREE_OPS      200000
+
+#define TEST_BASE_HASH_SLOTS    4096
+#define TEST_BASE_HASH_ENTRIES  4096
+#define TEST_BASE_HASH_OPS      400000
+
+#define TEST_BASE_BENCH_ENTRIES 100000
+#define TEST_BASE_BENCH_LIST    1000
+
+typedef struct _TEST_BASE_NODE
+{
+    KRN_TREE_ENTRY TreeEntry;
+    KRN_HASH_ENTRY HashEntry;
+    KRN_LIST_ENTRY ListEntry;
+    uint32_t Sequence;          // Insertion order, for equal tree keys.
+    int Present;
+} TEST_BASE_NODE;
+
+#define TEST_BASE_TREE_NODE(P)  ((TEST_BASE_NODE*) ((char*) (P) - offsetof(TEST_BASE_NODE, TreeEntry)))
+#define TEST_BASE_HASH_NODE(P)  ((TEST_BASE_NODE*) ((char*) (P) - offsetof(TEST_BASE_NODE, HashEntry)))
+#define TEST_BASE_LIST_NODE(P)  ((TEST_BASE_NODE*) ((char*) (P) - offsetof(TEST_BASE_NODE, ListEntry)))
+
+KRN_TAGGED_STACK g_Test_BaseStack;
+TEST_BASE_ENTRY g_Test_BaseEntries[TEST_BASE_STACK_ENTRIES];
+
+KRN_SPINLOCK g_Test_BaseSpinLock;
+KRN_TICKET_LOCK g_Test_BaseTicketLock;
+KRN_MCS_LOCK g_Test_BaseMcsLock;
+KRN_RWLOCK g_Test_BaseRwLock;
+KRN_SEQLOCK g_Test_BaseSeqLock;
+
+// Only ever changed under the lock being tested.  Writers keep both copies
+// equal to the count.
+volatile uint32_t g_Test_BaseLockCount;
+volatile uint32_t g_Test_BaseLockCopies[2];
+
+extern __thread uint32_t g_Test_IntEnabled;
+
+void
+OSCALL
+Test_BaseByteSet(
+    void* pDest,
+    int Value,
+    size_t Count
+    ) TEST_BASE_BYTE_LOOP;
+
+void
+OSCALL
+Test_BaseByteCopy(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    ) TEST_BASE_BYTE_LOOP;
+
+int
+OSCALL
+Test_BaseCheck(
+    uint8_t* pBuffer,
+    uint8_t* pExpect
+    );
+
+int
+OSCALL
+Test_BaseBench(
+    );
+
+int
+OSCALL
+Test_BaseAtomics(
+    );
+
+int
+OSCALL
+Test_BaseStack(
+    );
+
+void*
+Test_BaseStackThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_BaseStackThreads(
+    );
+
+void*
+Test_BaseLockThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_BaseLocks(
+    );
+
+int
+OSCALL
+Test_BaseRing(
+    );
+
+void*
+Test_BaseRingThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_BaseRingThreads(
+    int Multi
+    );
+
+int
+OSCALL
+Test_BaseTreeHeight(
+    const KRN_TREE_ENTRY* pEntry,
+    const KRN_TREE_ENTRY* pParent
+    );
+
+int
+OSCALL
+Test_BaseTreeCheck(
+    const KRN_TREE* pTree
+    );
+
+int
+OSCALL
+Test_BaseTree(
+    );
+
+int
+OSCALL
+Test_BaseHash(
+    );
+
+int
+OSCALL
+Test_BaseContainerBench(
+    );
+
+void
+OSCALL
+Test_BaseByteSet(
+    void* pDest,
+    int Value,
+    size_t Count
+    )
+{
+    char* pDestChar = (char*) pDest;
+    
+    while (Count-- > 0)
+    {
+        *pDestChar++ = (char) Value;
+    }
+}
+
+void
+OSCALL
+Test_BaseByteCopy(
+    void* pDest,
+    const void* pSource,
+    size_t Count
+    )
+{
+    char* pDestChar = (char*) pDest;
+    const char* pSourceChar = (const char*) pSource;
+    
+    while (Count-- > 0)
+    {
+        *pDestChar++ = *pSourceChar++;
+    }
+}
+
+int
+OSCALL
+Test_BaseCheck(
+    uint8_t* pBuffer,
+    uint8_t* pExpect
+    )
+{
+    static const size_t sizes[] =
+    {
+        0, 1, 3, 4, 5, 15, 16, 17, 31, 33, 63, 64, 65, 255, 4095, 4096, 4099,
+        65537, 256 * 1024, 256 * 1024 + 7, 300001
+    };
+    static const int shifts[] = { 1, 2, 3, 4, 5, 8, 17, 4096 };
+    uint8_t* pSource;
+    size_t size;
+    uint32_t checks;
+    uint32_t offset;
+    uint32_t i;
+    uint32_t j;
+    int left;
+    int right;
+    
+    pSource = pBuffer + TEST_BASE_BUFFER;
+    checks = 0;
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        size = sizes[i];
+        
+        for (offset = 0; offset < 8; offset++)
+        {
+            // Fill, nothing outside the range touched.
+            for (j = 0; j < TEST_BASE_BUFFER; j++)
+            {
+                pBuffer[j] = pExpect[j] = (uint8_t) Test_Rand();
+            }
+            
+            TEST_CHECK(memset(pBuffer + offset, 0xC3, size) == pBuffer + offset);
+            Test_BaseByteSet(pExpect + offset, 0xC3, size);
+            TEST_CHECK(memcmp(pBuffer, pExpect, TEST_BASE_BUFFER) == 0);
+            
+            TEST_CHECK(Krn_MemSetNt(pBuffer + offset, 0, size) == pBuffer + offset);
+            Test_BaseByteSet(pExpect + offset, 0, size);
+            TEST_CHECK(memcmp(pBuffer, pExpect, TEST_BASE_BUFFER) == 0);
+            
+            // Copy between different alignments.
+            for (j = 0; j < TEST_BASE_BUFFER; j++)
+            {
+                pSource[j] = (uint8_t) Test_Rand();
+            }
+            
+            TEST_CHECK(memcpy(pBuffer + offset, pSource + (7 - offset), size) == pBuffer + offset);
+            Test_BaseByteCopy(pExpect + offset, pSource + (7 - offset), size);
+            TEST_CHECK(memcmp(pBuffer, pExpect, TEST_BASE_BUFFER) == 0);
+            
+            // Compare agrees with the byte loop on where and which way.
+            if (size > 0)
+            {
+                j = Test_Rand() % size;
+                pBuffer[offset + j] ^= 1 << (Test_Rand() % 8);
+                left = memcmp(pBuffer + offset, pExpect + offset, size);
+                right = (int) pBuffer[offset + j] - (int) pExpect[offset + j];
+                TEST_CHECK((left < 0) == (right < 0));
+                TEST_CHECK((left > 0) == (right > 0));
+                TEST_CHECK(memcmp(pBuffer + offset, pExpect + offset, j) == 0);
+                pBuffer[offset + j] = pExpect[offset + j];
+            }
+            
+            // Overlapping moves both ways.
+            for (j = 0; j < _countof(shifts); j++)
+            {
+                if (size + shifts[j] + 8 > TEST_BASE_BUFFER)
+                {
+                    continue;
+                }
+                
+                memcpy(pExpect, pBuffer, TEST_BASE_BUFFER);
+                TEST_CHECK(memmove(pBuffer + offset + shifts[j], pBuffer + offset, size) == pBuffer + offset + shifts[j]);
+                Test_BaseByteCopy(pSource, pExpect + offset, size);
+                Test_BaseByteCopy(pExpect + offset + shifts[j], pSource, size);
+                TEST_CHECK(memcmp(pBuffer, pExpect, TEST_BASE_BUFFER) == 0);
+                
+                TEST_CHECK(memmove(pBuffer + offset, pBuffer + offset + shifts[j], size) == pBuffer + offset);
+                Test_BaseByteCopy(pSource, pExpect + offset + shifts[j], size);
+                Test_BaseByteCopy(pExpect + offset, pSource, size);
+                TEST_CHECK(memcmp(pBuffer, pExpect, TEST_BASE_BUFFER) == 0);
+                
+                checks++;
+            }
+            
+            checks += 4;
+        }
+    }
+    
+    printf("  %u checks: ok\n", checks);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseBench(
+    )
+{
+    static const size_t sizes[] = { 64, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    uint8_t* pLarge;
+    uint64_t rounds;
+    uint64_t ns[4];
+    uint64_t k;
+    size_t size;
+    uint32_t i;
+    
+    // Source and destination, with room for the largest size.
+    pLarge = malloc(2 * sizes[_countof(sizes) - 1]);
+    TEST_CHECK(pLarge != NULL);
+    memset(pLarge, 1, 2 * sizes[_countof(sizes) - 1]);
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        size = sizes[i];
+        rounds = TEST_BASE_BENCH_BYTES / size;
+        
+        ns[0] = Test_Ns();
+        for (k = 0; k < rounds; k++)
+        {
+            Test_BaseByteSet(pLarge, (int) k, size);
+        }
+        ns[0] = Test_Ns() - ns[0];
+        
+        ns[1] = Test_Ns();
+        for (k = 0; k < rounds; k++)
+        {
+            memset(pLarge, (int) k, size);
+        }
+        ns[1] = Test_Ns() - ns[1];
+        
+        ns[2] = Test_Ns();
+        for (k = 0; k < rounds; k++)
+        {
+            Test_BaseByteCopy(pLarge, pLarge + size, size);
+        }
+        ns[2] = Test_Ns() - ns[2];
+        
+        ns[3] = Test_Ns();
+        for (k = 0; k < rounds; k++)
+        {
+            memcpy(pLarge, pLarge + size, size);
+        }
+        ns[3] = Test_Ns() - ns[3];
+        
+        // Bytes per ns is GB/s.
+        printf(
+                "  %8u bytes: set %5.2f -> %5.2f GB/s, copy %5.2f -> %5.2f GB/s\n",
+                (uint32_t) size,
+                (double) TEST_BASE_BENCH_BYTES / ns[0],
+                (double) TEST_BASE_BENCH_BYTES / ns[1],
+                (double) TEST_BASE_BENCH_BYTES / ns[2],
+                (double) TEST_BASE_BENCH_BYTES / ns[3]);
+    }
+    
+    free(pLarge);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseAtomics(
+    )
+{
+    volatile uint64_t value64;
+    volatile uint32_t value32;
+    void* volatile pValue;
+    
+    // 64 bit operations carry into and borrow from the high half.
+    value64 = 0xFFFFFFFFULL;
+    TEST_CHECK(Krn_InterlockedInc64(&value64) == 0xFFFFFFFFULL);
+    TEST_CHECK(value64 == 0x100000000ULL);
+    TEST_CHECK(Krn_InterlockedDec64(&value64) == 0x100000000ULL);
+    TEST_CHECK(value64 == 0xFFFFFFFFULL);
+    TEST_CHECK(Krn_InterlockedAdd64(&value64, 0x100000001ULL) == 0xFFFFFFFFULL);
+    TEST_CHECK(value64 == 0x200000000ULL);
+    
+    // A compare that differs only in the high half fails.
+    TEST_CHECK(Krn_InterlockedCmpExg64(&value64, 1, 0x300000000ULL) == 0x200000000ULL);
+    TEST_CHECK(value64 == 0x200000000ULL);
+    TEST_CHECK(Krn_InterlockedCmpExg64(&value64, 0x123456789ULL, 0x200000000ULL) == 0x200000000ULL);
+    TEST_CHECK(Krn_AtomicLoad64Acquire(&value64) == 0x123456789ULL);
+    TEST_CHECK(Krn_InterlockedExg64(&value64, 0xFEDCBA987ULL) == 0x123456789ULL);
+    Krn_AtomicStore64Release(&value64, 0xABCDEF012ULL);
+    TEST_CHECK(Krn_AtomicLoad64Relaxed(&value64) == 0xABCDEF012ULL);
+    
+    // 32 bit operations return the old value.
+    value32 = 0xFFFFFFFF;
+    TEST_CHECK(Krn_InterlockedInc32(&value32) == 0xFFFFFFFF);
+    TEST_CHECK(Krn_InterlockedDec32(&value32) == 0);
+    TEST_CHECK(Krn_InterlockedAdd32(&value32, 0x11) == 0xFFFFFFFF);
+    TEST_CHECK(Krn_InterlockedOr32(&value32, 0x100) == 0x10);
+    TEST_CHECK(Krn_InterlockedAnd32(&value32, 0x1F0) == 0x110);
+    TEST_CHECK(Krn_InterlockedCmpExg32(&value32, 5, 0x111) == 0x110);
+    TEST_CHECK(Krn_InterlockedCmpExg32(&value32, 5, 0x110) == 0x110);
+    TEST_CHECK(Krn_InterlockedExg32(&value32, 7) == 5);
+    Krn_AtomicStore32Release(&value32, 9);
+    TEST_CHECK(Krn_AtomicLoad32Acquire(&value32) == 9);
+    
+    pValue = NULL;
+    TEST_CHECK(Krn_InterlockedCmpExgPtr(&pValue, (void*) &value32, NULL) == NULL);
+    TEST_CHECK(Krn_InterlockedExgPtr(&pValue, (void*) &value64) == (void*) &value32);
+    TEST_CHECK(Krn_AtomicLoadPtrAcquire(&pValue) == (void*) &value64);
+    
+    Krn_AtomicFence();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseStack(
+    )
+{
+    KRN_TAGGED_STACK stack;
+    KRN_STACK_ENTRY entries[6];
+    uint64_t head;
+    
+    Krn_TaggedStackInit(&stack);
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == NULL);
+    TEST_CHECK(Krn_TaggedStackPopAll(&stack) == NULL);
+    
+    Krn_TaggedStackPush(&stack, &entries[0]);
+    Krn_TaggedStackPush(&stack, &entries[1]);
+    
+    // Pops change the generation even when the same entry goes back.
+    head = stack.Head;
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == &entries[1]);
+    Krn_TaggedStackPush(&stack, &entries[1]);
+    TEST_CHECK(stack.Head != head);
+    TEST_CHECK((stack.Head & KRN_TAGGED_PTR_MASK) == (uintptr_t) &entries[1]);
+    
+    // A list goes on top in its own order.
+    entries[2].pNext = &entries[3];
+    entries[3].pNext = &entries[4];
+    Krn_TaggedStackPushList(&stack, &entries[2], &entries[4]);
+    
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == &entries[2]);
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == &entries[3]);
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == &entries[4]);
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == &entries[1]);
+    
+    Krn_TaggedStackPush(&stack, &entries[5]);
+    
+    // Everything comes back top first.
+    TEST_CHECK(Krn_TaggedStackPopAll(&stack) == &entries[5]);
+    TEST_CHECK(entries[5].pNext == &entries[0]);
+    TEST_CHECK(entries[0].pNext == NULL);
+    TEST_CHECK(Krn_TaggedStackPop(&stack) == NULL);
+    
+    return 0;
+}
+
+void*
+Test_BaseStackThread(
+    void* pContext
+    )
+{
+    TEST_BASE_THREAD* pThread;
+    KRN_STACK_ENTRY* pEntry;
+    uint32_t seed;
+    uint32_t i;
+    uint32_t j;
+    
+    pThread = pContext;
+    seed = pThread->Seed;
+    
+    for (i = 0; (i < TEST_BASE_STACK_OPS) && (! pThread->Failed); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        
+        switch ((seed >> 16) & 0xF)
+        {
+            // Chain everything held and push it at once.
+            case 0:
+                if (pThread->HeldCount == 0)
+                {
+                    break;
+                }
+                
+                for (j = 0; j < pThread->HeldCount; j++)
+                {
+                    if (j + 1 < pThread->HeldCount)
+                    {
+                        pThread->pHeld[j]->Link.pNext = &pThread->pHeld[j + 1]->Link;
+                    }
+                    
+                    __sync_lock_release(&pThread->pHeld[j]->Owned);
+                }
+                
+                Krn_TaggedStackPushList(
+                        &g_Test_BaseStack,
+                        &pThread->pHeld[0]->Link,
+                        &pThread->pHeld[pThread->HeldCount - 1]->Link);
+                pThread->HeldCount = 0;
+                break;
+            
+            case 1:
+                pEntry = Krn_TaggedStackPopAll(&g_Test_BaseStack);
+                
+                while (pEntry)
+                {
+                    if (__sync_lock_test_and_set(&((TEST_BASE_ENTRY*) pEntry)->Owned, 1))
+                    {
+                        pThread->Failed = 1;
+                    }
+                    
+                    pThread->pHeld[pThread->HeldCount++] = (TEST_BASE_ENTRY*) pEntry;
+                    pEntry = pEntry->pNext;
+                }
+                break;
+            
+            // Mostly single pushes and pops, where ABA would show.
+            default:
+                if ((pThread->HeldCount > 0) &&
+                    (seed & 0x100000))
+                {
+                    pThread->HeldCount--;
+                    __sync_lock_release(&pThread->pHeld[pThread->HeldCount]->Owned);
+                    Krn_TaggedStackPush(&g_Test_BaseStack, &pThread->pHeld[pThread->HeldCount]->Link);
+                    break;
+                }
+                
+                pEntry = Krn_TaggedStackPop(&g_Test_BaseStack);
+                
+                if (pEntry)
+                {
+                    if (__sync_lock_test_and_set(&((TEST_BASE_ENTRY*) pEntry)->Owned, 1))
+                    {
+                        pThread->Failed = 1;
+                    }
+                    
+                    pThread->pHeld[pThread->HeldCount++] = (TEST_BASE_ENTRY*) pEntry;
+                }
+                break;
+        }
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_BaseStackThreads(
+    )
+{
+    static TEST_BASE_THREAD threads[TEST_BASE_STACK_THREADS];
+    KRN_STACK_ENTRY* pEntry;
+    uint32_t count;
+    uint32_t i;
+    uint32_t j;
+    
+    Krn_TaggedStackInit(&g_Test_BaseStack);
+    memset(g_Test_BaseEntries, 0, sizeof(g_Test_BaseEntries));
+    
+    for (i = 0; i < TEST_BASE_STACK_ENTRIES; i++)
+    {
+        Krn_TaggedStackPush(&g_Test_BaseStack, &g_Test_BaseEntries[i].Link);
+    }
+    
+    for (i = 0; i < TEST_BASE_STACK_THREADS; i++)
+    {
+        threads[i].HeldCount = 0;
+        threads[i].Seed = Test_Rand();
+        threads[i].Failed = 0;
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_BaseStackThread, &threads[i]) == 0);
+    }
+    
+    for (i = 0; i < TEST_BASE_STACK_THREADS; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+        TEST_CHECK(! threads[i].Failed);
+        
+        for (j = 0; j < threads[i].HeldCount; j++)
+        {
+            threads[i].pHeld[j]->Owned = 0;
+            Krn_TaggedStackPush(&g_Test_BaseStack, &threads[i].pHeld[j]->Link);
+        }
+    }
+    
+    // Every entry once, nothing else.
+    count = 0;
+    while ((pEntry = Krn_TaggedStackPop(&g_Test_BaseStack)) != NULL)
+    {
+        TEST_CHECK((TEST_BASE_ENTRY*) pEntry >= &g_Test_BaseEntries[0]);
+        TEST_CHECK((TEST_BASE_ENTRY*) pEntry < &g_Test_BaseEntries[TEST_BASE_STACK_ENTRIES]);
+        TEST_CHECK(! __sync_lock_test_and_set(&((TEST_BASE_ENTRY*) pEntry)->Owned, 1));
+        count++;
+    }
+    
+    TEST_CHECK(count == TEST_BASE_STACK_ENTRIES);
+    
+    printf("  tagged stack %u threads x %u ops: ok\n", TEST_BASE_STACK_THREADS, TEST_BASE_STACK_OPS);
+    
+    return 0;
+}
+
+void*
+Test_BaseLockThread(
+    void* pContext
+    )
+{
+    TEST_BASE_LOCK_THREAD* pThread;
+    KRN_MCS_NODE node;
+    uint32_t intState;
+    uint32_t copies[2];
+    uint32_t sequence;
+    uint32_t i;
+    
+    pThread = pContext;
+    
+    for (i = 0; i < pThread->OpCount; i++)
+    {
+        // Every other round through the Irq variants.
+        switch (pThread->Kind)
+        {
+            case TEST_BASE_LOCK_SPIN:
+                if (i & 1)
+                {
+                    intState = Krn_SpinLockAcquireIrq(&g_Test_BaseSpinLock);
+                    pThread->Failed |= g_Test_IntEnabled;
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_SpinLockReleaseIrq(&g_Test_BaseSpinLock, intState);
+                }
+                else
+                {
+                    Krn_SpinLockAcquire(&g_Test_BaseSpinLock);
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_SpinLockRelease(&g_Test_BaseSpinLock);
+                }
+                break;
+            
+            case TEST_BASE_LOCK_TICKET:
+                if (i & 1)
+                {
+                    intState = Krn_TicketLockAcquireIrq(&g_Test_BaseTicketLock);
+                    pThread->Failed |= g_Test_IntEnabled;
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_TicketLockReleaseIrq(&g_Test_BaseTicketLock, intState);
+                }
+                else
+                {
+                    Krn_TicketLockAcquire(&g_Test_BaseTicketLock);
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_TicketLockRelease(&g_Test_BaseTicketLock);
+                }
+                break;
+            
+            case TEST_BASE_LOCK_MCS:
+                if (i & 1)
+                {
+                    intState = Krn_McsLockAcquireIrq(&g_Test_BaseMcsLock, &node);
+                    pThread->Failed |= g_Test_IntEnabled;
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_McsLockReleaseIrq(&g_Test_BaseMcsLock, &node, intState);
+                }
+                else
+                {
+                    Krn_McsLockAcquire(&g_Test_BaseMcsLock, &node);
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    Krn_McsLockRelease(&g_Test_BaseMcsLock, &node);
+                }
+                break;
+            
+            case TEST_BASE_LOCK_RW:
+                if ((i % TEST_BASE_LOCK_WRITES) == 0)
+                {
+                    Krn_RwLockAcquireWrite(&g_Test_BaseRwLock);
+                    pThread->Failed |= (g_Test_BaseRwLock.Value & KRN_RWLOCK_WRITER) == 0;
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    g_Test_BaseLockCopies[0] = g_Test_BaseLockCount;
+                    g_Test_BaseLockCopies[1] = g_Test_BaseLockCount;
+                    Krn_RwLockReleaseWrite(&g_Test_BaseRwLock);
+                }
+                else
+                {
+                    Krn_RwLockAcquireRead(&g_Test_BaseRwLock);
+                    copies[0] = g_Test_BaseLockCopies[0];
+                    copies[1] = g_Test_BaseLockCopies[1];
+                    pThread->Failed |= copies[0] != copies[1];
+                    Krn_RwLockReleaseRead(&g_Test_BaseRwLock);
+                }
+                break;
+            
+            case TEST_BASE_LOCK_SEQ:
+                if ((i % TEST_BASE_LOCK_WRITES) == 0)
+                {
+                    Krn_SeqLockWriteBegin(&g_Test_BaseSeqLock);
+                    g_Test_BaseLockCount = g_Test_BaseLockCount + 1;
+                    g_Test_BaseLockCopies[0] = g_Test_BaseLockCount;
+                    g_Test_BaseLockCopies[1] = g_Test_BaseLockCount;
+                    Krn_SeqLockWriteEnd(&g_Test_BaseSeqLock);
+                }
+                else
+                {
+                    do
+                    {
+                        sequence = Krn_SeqLockReadBegin(&g_Test_BaseSeqLock);
+                        copies[0] = g_Test_BaseLockCopies[0];
+                        copies[1] = g_Test_BaseLockCopies[1];
+                    } while (Krn_SeqLockReadRetry(&g_Test_BaseSeqLock, sequence));
+                    
+                    pThread->Failed |= copies[0] != copies[1];
+                }
+                break;
+        }
+        
+        pThread->Failed |= ! g_Test_IntEnabled;
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_BaseLocks(
+    )
+{
+    static const char* names[TEST_BASE_LOCK_COUNT] = { "spin", "ticket", "mcs", "rw", "seq" };
+    TEST_BASE_LOCK_THREAD threads[TEST_BASE_LOCK_THREADS];
+    uint32_t threadCount;
+    uint32_t opCount;
+    uint32_t expect;
+    uint64_t ns;
+    uint32_t kind;
+    uint32_t i;
+    
+    // At least two threads so the locks are contended.
+    threadCount = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = (threadCount < 2) ? 2 : threadCount;
+    threadCount = (threadCount > TEST_BASE_LOCK_THREADS) ? TEST_BASE_LOCK_THREADS : threadCount;
+    
+    opCount = TEST_BASE_LOCK_OPS;
+    if (threadCount > sysconf(_SC_NPROCESSORS_ONLN))
+    {
+        opCount = TEST_BASE_LOCK_OPS_SHARED;
+    }
+    
+    Krn_SpinLockInit(&g_Test_BaseSpinLock);
+    Krn_TicketLockInit(&g_Test_BaseTicketLock);
+    Krn_McsLockInit(&g_Test_BaseMcsLock);
+    Krn_RwLockInit(&g_Test_BaseRwLock);
+    Krn_SeqLockInit(&g_Test_BaseSeqLock);
+    
+    for (kind = 0; kind < TEST_BASE_LOCK_COUNT; kind++)
+    {
+        g_Test_BaseLockCount = 0;
+        
+        ns = Test_Ns();
+        for (i = 0; i < threadCount; i++)
+        {
+            threads[i].Kind = kind;
+            threads[i].OpCount = opCount;
+            threads[i].Failed = 0;
+            TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_BaseLockThread, &threads[i]) == 0);
+        }
+        
+        for (i = 0; i < threadCount; i++)
+        {
+            pthread_join(threads[i].Thread, NULL);
+            TEST_CHECK(! threads[i].Failed);
+        }
+        ns = Test_Ns() - ns;
+        
+        expect = threadCount * opCount;
+        if ((kind == TEST_BASE_LOCK_RW) ||
+            (kind == TEST_BASE_LOCK_SEQ))
+        {
+            expect = threadCount * ((opCount + TEST_BASE_LOCK_WRITES - 1) / TEST_BASE_LOCK_WRITES);
+        }
+        
+        TEST_CHECK(g_Test_BaseLockCount == expect);
+        
+        printf("  %-6s lock %u threads x %u ops, %u ns/op wall: ok\n",
+               names[kind],
+               threadCount,
+               opCount,
+               (uint32_t) (ns / (threadCount * opCount)));
+    }
+    
+    // Released locks are back to their initial state.
+    TEST_CHECK(g_Test_BaseSpinLock.Locked == 0);
+    TEST_CHECK(g_Test_BaseTicketLock.Next == g_Test_BaseTicketLock.Owner);
+    TEST_CHECK(g_Test_BaseMcsLock.pTail == NULL);
+    TEST_CHECK(g_Test_BaseRwLock.Value == 0);
+    TEST_CHECK((g_Test_BaseSeqLock.Sequence & 1) == 0);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseRing(
+    )
+{
+    KRN_RING ring;
+    KRN_RING ringMp;
+    void* slots[8];
+    void* slotsMp[8];
+    void* items[16];
+    uintptr_t i;
+    uint32_t round;
+    
+    TEST_CHECK(Krn_RingInit(&ring, slots, 0) == KRN_ERR_INV_PARAMETER);
+    TEST_CHECK(Krn_RingInit(&ring, slots, 6) == KRN_ERR_INV_PARAMETER);
+    TEST_CHECK(Krn_RingInit(&ring, slots, _countof(slots)) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Krn_RingInit(&ringMp, slotsMp, _countof(slotsMp)) == KRN_ERR_SUCCESS);
+    
+    TEST_CHECK(Krn_RingDequeue(&ring, items, 1) == 0);
+    
+    for (i = 0; i < _countof(items); i++)
+    {
+        items[i] = (void*) (i + 1);
+    }
+    
+    // Partial batches at full and empty, across the wrap many times.
+    for (round = 0; round < 20; round++)
+    {
+        TEST_CHECK(Krn_RingEnqueue(&ring, items, 5) == 5);
+        TEST_CHECK(Krn_RingEnqueue(&ring, items + 5, 5) == 3);
+        TEST_CHECK(Krn_RingEnqueue(&ring, items, 1) == 0);
+        
+        memset(items + 8, 0, 8 * sizeof(void*));
+        TEST_CHECK(Krn_RingDequeue(&ring, items + 8, 8) == 8);
+        
+        for (i = 0; i < 8; i++)
+        {
+            TEST_CHECK(items[8 + i] == (void*) (i + 1));
+            items[8 + i] = (void*) (8 + i + 1);
+        }
+        
+        TEST_CHECK(Krn_RingDequeue(&ring, items + 8, 8) == 0);
+        
+        // Same again through the multi-producer path.
+        TEST_CHECK(Krn_RingEnqueueMp(&ringMp, items, 7) == 7);
+        TEST_CHECK(Krn_RingEnqueueMp(&ringMp, items, 7) == 1);
+        TEST_CHECK(Krn_RingEnqueueMp(&ringMp, items, 1) == 0);
+        TEST_CHECK(Krn_RingDequeue(&ringMp, items + 8, 3) == 3);
+        TEST_CHECK(items[8] == (void*) 1);
+        TEST_CHECK(Krn_RingDequeue(&ringMp, items + 8, 8) == 5);
+        TEST_CHECK(items[12] == (void*) 1);
+        
+        for (i = 0; i < 8; i++)
+        {
+            items[8 + i] = (void*) (8 + i + 1);
+        }
+    }
+    
+    return 0;
+}
+
+void*
+Test_BaseRingThread(
+    void* pContext
+    )
+{
+    TEST_BASE_RING_THREAD* pThread;
+    void* items[TEST_BASE_RING_BATCH];
+    uint32_t sent;
+    uint32_t batch;
+    uint32_t done;
+    uint32_t seed;
+    uint32_t i;
+    
+    pThread = pContext;
+    seed = pThread->Producer + 1;
+    sent = 0;
+    
+    while (sent < pThread->ItemCount)
+    {
+        seed = seed * 1103515245 + 12345;
+        batch = 1 + ((seed >> 16) % TEST_BASE_RING_BATCH);
+        batch = (batch > pThread->ItemCount - sent) ? pThread->ItemCount - sent : batch;
+        
+        for (i = 0; i < batch; i++)
+        {
+            items[i] = (void*) (uintptr_t) ((pThread->Producer << TEST_BASE_RING_SHIFT) | (sent + i + 1));
+        }
+        
+        if (pThread->Multi)
+        {
+            done = Krn_RingEnqueueMp(pThread->pRing, items, batch);
+        }
+        else
+        {
+            done = Krn_RingEnqueue(pThread->pRing, items, batch);
+        }
+        
+        // Let the consumer run when threads outnumber CPUs.
+        if (done == 0)
+        {
+            sched_yield();
+        }
+        
+        sent += done;
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_BaseRingThreads(
+    int Multi
+    )
+{
+    static void* slots[TEST_BASE_RING_SLOTS];
+    TEST_BASE_RING_THREAD threads[TEST_BASE_RING_PRODUCERS];
+    uint32_t expect[TEST_BASE_RING_PRODUCERS];
+    void* items[TEST_BASE_RING_BATCH];
+    KRN_RING ring;
+    uint32_t producers;
+    uint32_t received;
+    uint32_t total;
+    uint32_t producer;
+    uint32_t count;
+    uint64_t ns;
+    uint32_t i;
+    
+    producers = Multi ? TEST_BASE_RING_PRODUCERS : 1;
+    total = (TEST_BASE_RING_ITEMS / producers) * producers;
+    
+    TEST_CHECK(Krn_RingInit(&ring, slots, TEST_BASE_RING_SLOTS) == KRN_ERR_SUCCESS);
+    
+    ns = Test_Ns();
+    for (i = 0; i < producers; i++)
+    {
+        threads[i].pRing = &ring;
+        threads[i].Producer = i;
+        threads[i].ItemCount = total / producers;
+        threads[i].Multi = Multi;
+        expect[i] = 1;
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_BaseRingThread, &threads[i]) == 0);
+    }
+    
+    // Every producer's items arrive once each, in the order it sent them.
+    received = 0;
+    while (received < total)
+    {
+        count = Krn_RingDequeue(&ring, items, TEST_BASE_RING_BATCH);
+        
+        if (count == 0)
+        {
+            sched_yield();
+        }
+        
+        for (i = 0; i < count; i++)
+        {
+            producer = (uint32_t) ((uintptr_t) items[i] >> TEST_BASE_RING_SHIFT);
+            
+            TEST_CHECK(producer < producers);
+            TEST_CHECK(((uintptr_t) items[i] & ((1 << TEST_BASE_RING_SHIFT) - 1)) == expect[producer]);
+            expect[producer]++;
+        }
+        
+        received += count;
+    }
+    
+    for (i = 0; i < producers; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+    }
+    ns = Test_Ns() - ns;
+    
+    TEST_CHECK(Krn_RingDequeue(&ring, items, 1) == 0);
+    
+    printf("  %s ring %u producers, %u items, %u ns/item wall: ok\n",
+           Multi ? "mpsc" : "spsc",
+           producers,
+           total,
+           (uint32_t) (ns / total));
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseTreeHeight(
+    const KRN_TREE_ENTRY* pEntry,
+    const KRN_TREE_ENTRY* pParent
+    )
+{
+    int left;
+    int right;
+    
+    if (! pEntry)
+    {
+        return 1;
+    }
+    
+    if ((pEntry->pParent != pParent) ||
+        ((pEntry->Red) && (pParent) && (pParent->Red)))
+    {
+        return -1;
+    }
+    
+    left = Test_BaseTreeHeight(pEntry->pLeft, pEntry);
+    right = Test_BaseTreeHeight(pEntry->pRight, pEntry);
+    
+    if ((left < 0) ||
+        (left != right))
+    {
+        return -1;
+    }
+    
+    return left + (pEntry->Red ? 0 : 1);
+}
+
+int
+OSCALL
+Test_BaseTreeCheck(
+    const KRN_TREE* pTree
+    )
+{
+    const KRN_TREE_ENTRY* pEntry;
+    const KRN_TREE_ENTRY* pPrev;
+    uint32_t count;
+    
+    // Black root, no red pairs, the same blacks down every path.
+    TEST_CHECK((! pTree->pRoot) || (! pTree->pRoot->Red));
+    TEST_CHECK(Test_BaseTreeHeight(pTree->pRoot, NULL) > 0);
+    
+    // In order both ways, equal keys in insertion order.
+    count = 0;
+    pPrev = NULL;
+    for (pEntry = Krn_TreeFirst(pTree); pEntry; pEntry = Krn_TreeNext(pEntry))
+    {
+        if (pPrev)
+        {
+            TEST_CHECK(pPrev->Key <= pEntry->Key);
+            TEST_CHECK((pPrev->Key < pEntry->Key) ||
+                       (TEST_BASE_TREE_NODE(pPrev)->Sequence < TEST_BASE_TREE_NODE(pEntry)->Sequence));
+            TEST_CHECK(Krn_TreePrev(pEntry) == pPrev);
+        }
+        
+        pPrev = pEntry;
+        count++;
+    }
+    
+    TEST_CHECK(pPrev == Krn_TreeLast(pTree));
+    TEST_CHECK(count == pTree->Count);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseTree(
+    )
+{
+    TEST_BASE_NODE* pNodes;
+    TEST_BASE_NODE* pNode;
+    TEST_BASE_NODE* pExpect[3];
+    KRN_TREE_ENTRY* pFound[3];
+    KRN_TREE tree;
+    uint32_t sequence;
+    uint32_t present;
+    uint64_t key;
+    uint32_t op;
+    uint32_t i;
+    
+    pNodes = calloc(TEST_BASE_TREE_ENTRIES, sizeof(TEST_BASE_NODE));
+    TEST_CHECK(pNodes != NULL);
+    
+    Krn_TreeInit(&tree);
+    TEST_CHECK(Krn_TreeFirst(&tree) == NULL);
+    TEST_CHECK(Krn_TreeFindFloor(&tree, 0) == NULL);
+    
+    sequence = 0;
+    present = 0;
+    
+    for (op = 0; op < TEST_BASE_TREE_OPS; op++)
+    {
+        pNode = &pNodes[Test_Rand() % TEST_BASE_TREE_ENTRIES];
+        
+        // Fill to about half, then churn.
+        if (pNode->Present)
+        {
+            Krn_TreeRemove(&tree, &pNode->TreeEntry);
+            pNode->Present = 0;
+            present--;
+        }
+        else
+        {
+            // Keys near the top check the comparisons use all 64 bits.
+            pNode->TreeEntry.Key = Test_Rand() % TEST_BASE_TREE_KEYS;
+            if (Test_Rand() & 1)
+            {
+                pNode->TreeEntry.Key |= 0xFFFFFFFF00000000ULL;
+            }
+            
+            pNode->Sequence = sequence++;
+            Krn_TreeInsert(&tree, &pNode->TreeEntry);
+            pNode->Present = 1;
+            present++;
+        }
+        
+        TEST_CHECK(tree.Count == present);
+        
+        if ((op % 256) == 0)
+        {
+            TEST_CHECK(Test_BaseTreeCheck(&tree) == 0);
+        }
+        
+        if ((op % 16) == 0)
+        {
+            key = Test_Rand() % (TEST_BASE_TREE_KEYS + 2);
+            if (Test_Rand() & 1)
+            {
+                key |= 0xFFFFFFFF00000000ULL;
+            }
+            
+            // Find and ceiling want the earliest of equals, floor the last.
+            pExpect[0] = NULL;
+            pExpect[1] = NULL;
+            pExpect[2] = NULL;
+            
+            for (i = 0; i < TEST_BASE_TREE_ENTRIES; i++)
+            {
+                pNode = &pNodes[i];
+                
+                if (! pNode->Present)
+                {
+                    continue;
+                }
+                
+                if ((pNode->TreeEntry.Key == key) &&
+                    ((! pExpect[0]) || (pNode->Sequence < pExpect[0]->Sequence)))
+                {
+                    pExpect[0] = pNode;
+                }
+                
+                if ((pNode->TreeEntry.Key <= key) &&
+                    ((! pExpect[1]) ||
+                     (pNode->TreeEntry.Key > pExpect[1]->TreeEntry.Key) ||
+                     ((pNode->TreeEntry.Key == pExpect[1]->TreeEntry.Key) && (pNode->Sequence > pExpect[1]->Sequence))))
+                {
+                    pExpect[1] = pNode;
+                }
+                
+                if ((pNode->TreeEntry.Key >= key) &&
+                    ((! pExpect[2]) ||
+                     (pNode->TreeEntry.Key < pExpect[2]->TreeEntry.Key) ||
+                     ((pNode->TreeEntry.Key == pExpect[2]->TreeEntry.Key) && (pNode->Sequence < pExpect[2]->Sequence))))
+                {
+                    pExpect[2] = pNode;
+                }
+            }
+            
+            pFound[0] = Krn_TreeFind(&tree, key);
+            pFound[1] = Krn_TreeFindFloor(&tree, key);
+            pFound[2] = Krn_TreeFindCeiling(&tree, key);
+            
+            for (i = 0; i < 3; i++)
+            {
+                TEST_CHECK(pFound[i] == (pExpect[i] ? &pExpect[i]->TreeEntry : NULL));
+            }
+        }
+    }
+    
+    // Drain in order.
+    while (tree.Count)
+    {
+        Krn_TreeRemove(&tree, Krn_TreeFirst(&tree));
+    }
+    
+    TEST_CHECK(tree.pRoot == NULL);
+    
+    free(pNodes);
+    
+    printf("  tree %u ops: ok\n", TEST_BASE_TREE_OPS);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseHash(
+    )
+{
+    static KRN_HASH_ENTRY* slots[TEST_BASE_HASH_SLOTS];
+    TEST_BASE_NODE* pNodes;
+    TEST_BASE_NODE* pNode;
+    KRN_HASH_TABLE table;
+    KRN_ERROR_CODE status;
+    uint32_t present;
+    uint32_t full;
+    uint32_t op;
+    uint32_t i;
+    
+    TEST_CHECK(Krn_HashInit(&table, slots, 12) == KRN_ERR_INV_PARAMETER);
+    TEST_CHECK(Krn_HashInit(&table, slots, TEST_BASE_HASH_SLOTS) == KRN_ERR_SUCCESS);
+    
+    // One node per key, keys page aligned like addresses.
+    pNodes = calloc(TEST_BASE_HASH_ENTRIES, sizeof(TEST_BASE_NODE));
+    TEST_CHECK(pNodes != NULL);
+    
+    for (i = 0; i < TEST_BASE_HASH_ENTRIES; i++)
+    {
+        pNodes[i].HashEntry.Key = (uintptr_t) i << 12;
+    }
+    
+    present = 0;
+    full = 0;
+    
+    for (op = 0; op < TEST_BASE_HASH_OPS; op++)
+    {
+        pNode = &pNodes[Test_Rand() % TEST_BASE_HASH_ENTRIES];
+        
+        // Removing a quarter as often as inserting runs the table into its
+        // limit.
+        if ((pNode->Present) &&
+            ((Test_Rand() & 3) != 0))
+        {
+            TEST_CHECK(Krn_HashFind(&table, pNode->HashEntry.Key) == &pNode->HashEntry);
+        }
+        else if (pNode->Present)
+        {
+            // Now and then try a duplicate first.
+            if ((op & 7) == 0)
+            {
+                TEST_CHECK(Krn_HashInsert(&table, &pNode->HashEntry) == KRN_ERR_INV_PARAMETER);
+            }
+            
+            TEST_CHECK(Krn_HashRemove(&table, &pNode->HashEntry) == KRN_ERR_SUCCESS);
+            TEST_CHECK(Krn_HashRemove(&table, &pNode->HashEntry) == KRN_ERR_INV_PARAMETER);
+            pNode->Present = 0;
+            present--;
+        }
+        else
+        {
+            status = Krn_HashInsert(&table, &pNode->HashEntry);
+            
+            if (present == (TEST_BASE_HASH_SLOTS / 4) * 3)
+            {
+                TEST_CHECK(status == KRN_ERR_NOT_ENOUGH_MEM);
+                full++;
+            }
+            else
+            {
+                TEST_CHECK(status == KRN_ERR_SUCCESS);
+                pNode->Present = 1;
+                present++;
+            }
+        }
+        
+        TEST_CHECK(table.Count == present);
+        
+        // Every key, present or not, after a removal has shifted entries.
+        if ((op % 4096) == 0)
+        {
+            for (i = 0; i < TEST_BASE_HASH_ENTRIES; i++)
+            {
+                TEST_CHECK(Krn_HashFind(&table, pNodes[i].HashEntry.Key) ==
+                           (pNodes[i].Present ? &pNodes[i].HashEntry : NULL));
+            }
+        }
+        else
+        {
+            pNode = &pNodes[Test_Rand() % TEST_BASE_HASH_ENTRIES];
+            TEST_CHECK(Krn_HashFind(&table, pNode->HashEntry.Key) ==
+                       (pNode->Present ? &pNode->HashEntry : NULL));
+        }
+    }
+    
+    free(pNodes);
+    
+    printf("  hash %u ops, %u refused when full: ok\n", TEST_BASE_HASH_OPS, full);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_BaseContainerBench(
+    )
+{
+    KRN_HASH_ENTRY** ppSlots;
+    TEST_BASE_NODE* pNodes;
+    KRN_LIST_ENTRY* pEntry;
+    KRN_HASH_TABLE table;
+    KRN_LIST_ENTRY list;
+    KRN_TREE tree;
+    uint64_t ns[4];
+    uint32_t slotCount;
+    uint32_t i;
+    
+    pNodes = calloc(TEST_BASE_BENCH_ENTRIES, sizeof(TEST_BASE_NODE));
+    slotCount = 1;
+    while (slotCount < TEST_BASE_BENCH_ENTRIES * 2)
+    {
+        slotCount *= 2;
+    }
+    ppSlots = malloc(slotCount * sizeof(KRN_HASH_ENTRY*));
+    TEST_CHECK((pNodes != NULL) && (ppSlots != NULL));
+    
+    // Distinct random keys, the low bits count up.
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        pNodes[i].TreeEntry.Key = ((uint64_t) Test_Rand() << 20) | i;
+        pNodes[i].HashEntry.Key = (uintptr_t) pNodes[i].TreeEntry.Key;
+    }
+    
+    Krn_TreeInit(&tree);
+    TEST_CHECK(Krn_HashInit(&table, ppSlots, slotCount) == KRN_ERR_SUCCESS);
+    
+    ns[0] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        Krn_TreeInsert(&tree, &pNodes[i].TreeEntry);
+    }
+    ns[1] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        TEST_CHECK(Krn_TreeFind(&tree, pNodes[i].TreeEntry.Key) == &pNodes[i].TreeEntry);
+    }
+    ns[2] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        Krn_TreeRemove(&tree, &pNodes[i].TreeEntry);
+    }
+    ns[3] = Test_Ns();
+    
+    printf("  tree %u entries: insert %u, find %u, remove %u ns/op\n",
+           TEST_BASE_BENCH_ENTRIES,
+           (uint32_t) ((ns[1] - ns[0]) / TEST_BASE_BENCH_ENTRIES),
+           (uint32_t) ((ns[2] - ns[1]) / TEST_BASE_BENCH_ENTRIES),
+           (uint32_t) ((ns[3] - ns[2]) / TEST_BASE_BENCH_ENTRIES));
+    
+    ns[0] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        TEST_CHECK(Krn_HashInsert(&table, &pNodes[i].HashEntry) == KRN_ERR_SUCCESS);
+    }
+    ns[1] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        TEST_CHECK(Krn_HashFind(&table, pNodes[i].HashEntry.Key) == &pNodes[i].HashEntry);
+    }
+    ns[2] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_ENTRIES; i++)
+    {
+        TEST_CHECK(Krn_HashRemove(&table, &pNodes[i].HashEntry) == KRN_ERR_SUCCESS);
+    }
+    ns[3] = Test_Ns();
+    
+    printf("  hash %u entries: insert %u, find %u, remove %u ns/op\n",
+           TEST_BASE_BENCH_ENTRIES,
+           (uint32_t) ((ns[1] - ns[0]) / TEST_BASE_BENCH_ENTRIES),
+           (uint32_t) ((ns[2] - ns[1]) / TEST_BASE_BENCH_ENTRIES),
+           (uint32_t) ((ns[3] - ns[2]) / TEST_BASE_BENCH_ENTRIES));
+    
+    // What a list walk costs at only a hundredth the size.
+    Krn_ListInit(&list);
+    for (i = 0; i < TEST_BASE_BENCH_LIST; i++)
+    {
+        Krn_ListAddTail(&list, &pNodes[i].ListEntry);
+    }
+    
+    ns[0] = Test_Ns();
+    for (i = 0; i < TEST_BASE_BENCH_LIST; i++)
+    {
+        for (pEntry = list.pNext; pEntry != &list; pEntry = pEntry->pNext)
+        {
+            if (TEST_BASE_LIST_NODE(pEntry)->TreeEntry.Key == pNodes[i].TreeEntry.Key)
+            {
+                break;
+            }
+        }
+        
+        TEST_CHECK(pEntry == &pNodes[i].ListEntry);
+    }
+    ns[1] = Test_Ns();
+    
+    printf("  list %u entries: find %u ns/op\n",
+           TEST_BASE_BENCH_LIST,
+           (uint32_t) ((ns[1] - ns[0]) / TEST_BASE_BENCH_LIST));
+    
+    free(ppSlots);
+    free(pNodes);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Base(
+    int Bench
+    )
+{
+    uint8_t* pBuffer;
+    uint8_t* pExpect;
+    int failed;
+    
+    pBuffer = malloc(2 * TEST_BASE_BUFFER);
+    pExpect = malloc(TEST_BASE_BUFFER);
+    
+    if ((! pBuffer) || (! pExpect))
+    {
+        return 1;
+    }
+    
+    failed = Test_BaseCheck(pBuffer, pExpect);
+    failed |= Test_BaseAtomics();
+    failed |= Test_BaseStack();
+    failed |= Test_BaseStackThreads();
+    failed |= Test_BaseLocks();
+    failed |= Test_BaseRing();
+    failed |= Test_BaseRingThreads(0);
+    failed |= Test_BaseRingThreads(1);
+    failed |= Test_BaseTree();
+    failed |= Test_BaseHash();
+    
+    if ((! failed) &&
+        (Bench))
+    {
+        failed = Test_BaseBench();
+        failed |= Test_BaseContainerBench();
+    }
+    
+    free(pBuffer);
+    free(pExpect);
+    
+    return failed;
+}
@@ -0,0 +1,378 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Object cache tests.  Objects are stamped with who owns them, so one handed
+// out twice shows up as soon as either owner looks.  Threads stand in for
+// CPUs as in the page allocator tests.
+
+#include "test.h"
+
+#include <krn_cache.h>
+#include <krn_counter.h>
+#include <krn_cpu.h>
+#include <krn_mem.h>
+
+#include <pthread.h>
+#include <string.h>
+
+// Live objects in the basic test, enough for several slabs of any size.
+#define TEST_CACHE_OBJECTS      1000
+
+#define TEST_CACHE_THREADS      4
+#define TEST_CACHE_THREAD_LIVE  256
+#define TEST_CACHE_THREAD_OPS   200000
+
+typedef struct _TEST_CACHE_THREAD
+{
+    pthread_t Thread;
+    KRN_CPU_DATA CpuData;
+    KRN_CACHE* pCache;
+    uint32_t Index;
+    int Failed;
+} TEST_CACHE_THREAD;
+
+volatile uint32_t g_Test_CacheStarted;
+
+extern __thread KRN_CPU_DATA* g_Test_pCpuData;
+
+void
+OSCALL
+Test_CacheStamp(
+    void* pObject,
+    uint32_t Size,
+    uint32_t Stamp
+    );
+
+int
+OSCALL
+Test_CacheCheckStamp(
+    void* pObject,
+    uint32_t Size,
+    uint32_t Stamp
+    );
+
+int
+OSCALL
+Test_CacheBasic(
+    size_t ObjectSize
+    );
+
+void*
+Test_CacheThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_CacheThreads(
+    );
+
+void
+OSCALL
+Test_CacheStamp(
+    void* pObject,
+    uint32_t Size,
+    uint32_t Stamp
+    )
+{
+    uint32_t* pWords;
+    uint32_t i;
+    
+    pWords = pObject;
+    for (i = 0; i < Size / sizeof(uint32_t); i++)
+    {
+        pWords[i] = Stamp;
+    }
+}
+
+int
+OSCALL
+Test_CacheCheckStamp(
+    void* pObject,
+    uint32_t Size,
+    uint32_t Stamp
+    )
+{
+    uint32_t* pWords;
+    uint32_t i;
+    
+    pWords = pObject;
+    for (i = 0; i < Size / sizeof(uint32_t); i++)
+    {
+        if (pWords[i] != Stamp)
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Grows over several slabs, reuses freed objects before growing again, and
+// gives every page back on destroy.
+int
+OSCALL
+Test_CacheBasic(
+    size_t ObjectSize
+    )
+{
+    static void* objects[TEST_CACHE_OBJECTS];
+    KRN_CACHE cache;
+    uint32_t freeBase;
+    uint32_t slabCount;
+    uint32_t count;
+    uint32_t i;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    freeBase = Test_MemCountFree();
+    
+    TEST_CHECK(Krn_CacheCreate(&cache, "test", ObjectSize) == KRN_ERR_SUCCESS);
+    
+    // Whole cache lines, at least 8 to a slab, in power of two slabs.
+    TEST_CHECK(cache.ObjectSize >= ObjectSize);
+    TEST_CHECK((cache.ObjectSize % KRN_CACHE_LINE_SIZE) == 0);
+    TEST_CHECK(cache.ObjectSize < ObjectSize + KRN_CACHE_LINE_SIZE);
+    TEST_CHECK(cache.ObjectsPerSlab >= 8);
+    TEST_CHECK((cache.SlabPages & (cache.SlabPages - 1)) == 0);
+    TEST_CHECK(cache.SlabCount == 0);
+    
+    // A few slabs' worth.
+    count = 4 * cache.ObjectsPerSlab + 1;
+    count = (count > TEST_CACHE_OBJECTS) ? TEST_CACHE_OBJECTS : count;
+    
+    for (i = 0; i < count; i++)
+    {
+        objects[i] = Krn_CacheAlloc(&cache);
+        TEST_CHECK(objects[i] != NULL);
+        TEST_CHECK(((uintptr_t) objects[i] & (KRN_CACHE_LINE_SIZE - 1)) == 0);
+        TEST_CHECK(cache.ObjectsInUse == i + 1);
+        
+        Test_CacheStamp(objects[i], cache.ObjectSize, i);
+    }
+    
+    slabCount = (count + cache.ObjectsPerSlab - 1) / cache.ObjectsPerSlab;
+    TEST_CHECK(cache.SlabCount == slabCount);
+    
+    for (i = 0; i < count; i++)
+    {
+        TEST_CHECK(Test_CacheCheckStamp(objects[i], cache.ObjectSize, i));
+    }
+    
+    // Refused while anything is live, and nothing disturbed.
+    TEST_CHECK(Krn_CacheDestroy(&cache) == KRN_ERR_INV_PARAMETER);
+    TEST_CHECK(cache.SlabCount == slabCount);
+    
+    for (i = 0; i < count; i++)
+    {
+        TEST_CHECK(Test_CacheCheckStamp(objects[i], cache.ObjectSize, i));
+        Krn_CacheFree(&cache, objects[i]);
+        TEST_CHECK(cache.ObjectsInUse == count - 1 - i);
+    }
+    
+    // Freed objects come back before the cache grows.
+    for (i = 0; i < count; i++)
+    {
+        objects[i] = Krn_CacheAlloc(&cache);
+        TEST_CHECK(objects[i] != NULL);
+    }
+    TEST_CHECK(cache.SlabCount == slabCount);
+    TEST_CHECK(cache.ObjectsInUse == count);
+    
+    for (i = 0; i < count; i++)
+    {
+        Krn_CacheFree(&cache, objects[i]);
+    }
+    
+    TEST_CHECK(Krn_CacheDestroy(&cache) == KRN_ERR_SUCCESS);
+    TEST_CHECK(cache.SlabCount == 0);
+    TEST_CHECK(Test_MemCountFree() == freeBase);
+    
+    printf("  %5u byte objects, %2u to a %u page slab, %u slabs: ok\n",
+           (uint32_t) ObjectSize,
+           cache.ObjectsPerSlab,
+           cache.SlabPages,
+           slabCount);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// One CPU's worth of allocations, stamped with the thread and a sequence
+// number while they are held.
+void*
+Test_CacheThread(
+    void* pContext
+    )
+{
+    TEST_CACHE_THREAD* pThread;
+    void* objects[TEST_CACHE_THREAD_LIVE];
+    uint32_t stamps[TEST_CACHE_THREAD_LIVE];
+    uint32_t live;
+    uint32_t index;
+    uint32_t seed;
+    uint32_t size;
+    uint32_t i;
+    
+    pThread = pContext;
+    g_Test_pCpuData = &pThread->CpuData;
+    size = pThread->pCache->ObjectSize;
+    
+    if (Krn_CounterCpuInit() != KRN_ERR_SUCCESS)
+    {
+        pThread->Failed = 1;
+        return NULL;
+    }
+    
+    // Start together so the pushes and pops overlap.
+    __sync_fetch_and_add(&g_Test_CacheStarted, 1);
+    while (g_Test_CacheStarted < TEST_CACHE_THREADS)
+    {
+        KRN_PAUSE();
+    }
+    
+    live = 0;
+    seed = pThread->Index + 1;
+    
+    for (i = 0; (i < TEST_CACHE_THREAD_OPS) && (! pThread->Failed); i++)
+    {
+        // Test_Rand is not thread safe, this is a plain LCG per thread.
+        seed = seed * 1103515245 + 12345;
+        
+        if ((live == TEST_CACHE_THREAD_LIVE) ||
+            ((live > 0) && (seed & 0x10000)))
+        {
+            index = (seed >> 17) % live;
+            
+            if (! Test_CacheCheckStamp(objects[index], size, stamps[index]))
+            {
+                printf("FAILED: object %p handed out twice\n", objects[index]);
+                pThread->Failed = 1;
+            }
+            
+            Krn_CacheFree(pThread->pCache, objects[index]);
+            
+            live--;
+            objects[index] = objects[live];
+            stamps[index] = stamps[live];
+            continue;
+        }
+        
+        objects[live] = Krn_CacheAlloc(pThread->pCache);
+        if (! objects[live])
+        {
+            pThread->Failed = 1;
+            break;
+        }
+        
+        stamps[live] = (pThread->Index << 24) | (i & 0xFFFFFF);
+        Test_CacheStamp(objects[live], size, stamps[live]);
+        live++;
+    }
+    
+    while (live > 0)
+    {
+        live--;
+        pThread->Failed |= ! Test_CacheCheckStamp(objects[live], size, stamps[live]);
+        Krn_CacheFree(pThread->pCache, objects[live]);
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_CacheThreads(
+    )
+{
+    // Static, the counters keep pointing at the CPU data until the next
+    // Test_MemInit.
+    static TEST_CACHE_THREAD threads[TEST_CACHE_THREADS];
+    KRN_CACHE cache;
+    uint32_t i;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    TEST_CHECK(Krn_CacheCreate(&cache, "test", 40) == KRN_ERR_SUCCESS);
+    
+    memset(threads, 0, sizeof(threads));
+    g_Test_CacheStarted = 0;
+    
+    for (i = 0; i < TEST_CACHE_THREADS; i++)
+    {
+        threads[i].pCache = &cache;
+        threads[i].Index = i;
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_CacheThread, &threads[i]) == 0);
+    }
+    
+    for (i = 0; i < TEST_CACHE_THREADS; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+        TEST_CHECK(! threads[i].Failed);
+    }
+    
+    // No more slabs than the threads ever held at once.
+    TEST_CHECK(cache.ObjectsInUse == 0);
+    TEST_CHECK(cache.SlabCount * cache.ObjectsPerSlab <
+               TEST_CACHE_THREADS * TEST_CACHE_THREAD_LIVE + cache.ObjectsPerSlab * TEST_CACHE_THREADS);
+    TEST_CHECK(Krn_CacheDestroy(&cache) == KRN_ERR_SUCCESS);
+    
+    printf("  threads %u x %u ops: ok\n",
+           TEST_CACHE_THREADS,
+           TEST_CACHE_THREAD_OPS);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Cache(
+    int Bench
+    )
+{
+    static const size_t sizes[] = { 1, 24, 64, 65, 200, 3000, 3 * MEM_PAGE_SIZE };
+    KRN_CACHE cache;
+    uint32_t i;
+    
+    TEST_CHECK(Krn_CacheCreate(&cache, "test", 0) == KRN_ERR_INV_PARAMETER);
+    TEST_CHECK(Krn_CacheCreate(&cache, "test", 64 * MEM_PAGE_SIZE + 1) == KRN_ERR_INV_PARAMETER);
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        if (Test_CacheBasic(sizes[i]))
+        {
+            return 1;
+        }
+    }
+    
+    if (Test_CacheThreads())
+    {
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Per-CPU counter tests.  Threads stand in for CPUs, each with its own
+// KRN_CPU_DATA.
+
+#include "test.h"
+
+#include <krn_counter.h>
+#include <krn_cpu.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#define TEST_COUNTER_THREADS    4
+#define TEST_COUNTER_OPS        1000000
+
+typedef struct _TEST_COUNTER_THREAD
+{
+    pthread_t Thread;
+    KRN_CPU_DATA CpuData;
+    int Failed;
+} TEST_COUNTER_THREAD;
+
+volatile uint32_t g_Test_CounterStarted;
+
+extern __thread KRN_CPU_DATA* g_Test_pCpuData;
+
+int
+OSCALL
+Test_CounterBasic(
+    );
+
+void*
+Test_CounterThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_CounterThreads(
+    int Bench
+    );
+
+int
+OSCALL
+Test_CounterBasic(
+    )
+{
+    KRN_CPU_DATA cpus[2];
+    
+    memset(cpus, 0, sizeof(cpus));
+    
+    Krn_CounterInit();
+    TEST_CHECK(Krn_CounterRead(KRN_COUNTER_TIMER_TICKS) == 0);
+    
+    g_Test_pCpuData = &cpus[0];
+    TEST_CHECK(Krn_CounterCpuInit() == KRN_ERR_SUCCESS);
+    Krn_CounterInc(KRN_COUNTER_TIMER_TICKS);
+    Krn_CounterAdd(KRN_COUNTER_TIMER_TICKS, 10);
+    
+    g_Test_pCpuData = &cpus[1];
+    TEST_CHECK(Krn_CounterCpuInit() == KRN_ERR_SUCCESS);
+    Krn_CounterAdd(KRN_COUNTER_TIMER_TICKS, 100);
+    
+    // Each CPU sees its own share, the fold sees both.
+    TEST_CHECK(Krn_CounterReadLocal(KRN_COUNTER_TIMER_TICKS) == 100);
+    g_Test_pCpuData = &cpus[0];
+    TEST_CHECK(Krn_CounterReadLocal(KRN_COUNTER_TIMER_TICKS) == 11);
+    TEST_CHECK(Krn_CounterRead(KRN_COUNTER_TIMER_TICKS) == 111);
+    
+    // Totals wrap like a plain 32 bit counter.
+    Krn_CounterAdd(KRN_COUNTER_TIMER_TICKS, 0xFFFFFFF0);
+    TEST_CHECK(Krn_CounterRead(KRN_COUNTER_TIMER_TICKS) == 111 - 0x10);
+    
+    g_Test_pCpuData = NULL;
+    
+    printf("  basic: ok\n");
+    
+    return 0;
+}
+
+void*
+Test_CounterThread(
+    void* pContext
+    )
+{
+    TEST_COUNTER_THREAD* pThread;
+    uint32_t i;
+    
+    pThread = pContext;
+    g_Test_pCpuData = &pThread->CpuData;
+    
+    if (Krn_CounterCpuInit() != KRN_ERR_SUCCESS)
+    {
+        pThread->Failed = 1;
+        return NULL;
+    }
+    
+    // Start together so the adds overlap.
+    __sync_fetch_and_add(&g_Test_CounterStarted, 1);
+    while (g_Test_CounterStarted < TEST_COUNTER_THREADS)
+    {
+        KRN_PAUSE();
+    }
+    
+    for (i = 0; i < TEST_COUNTER_OPS; i++)
+    {
+        Krn_CounterInc(KRN_COUNTER_TIMER_TICKS);
+    }
+    
+    pThread->Failed |= Krn_CounterReadLocal(KRN_COUNTER_TIMER_TICKS) != TEST_COUNTER_OPS;
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_CounterThreads(
+    int Bench
+    )
+{
+    static TEST_COUNTER_THREAD threads[TEST_COUNTER_THREADS];
+    uint64_t start;
+    uint64_t elapsed;
+    uint32_t i;
+    
+    Krn_CounterInit();
+    g_Test_CounterStarted = 0;
+    
+    memset(threads, 0, sizeof(threads));
+    
+    start = Test_Ns();
+    
+    for (i = 0; i < TEST_COUNTER_THREADS; i++)
+    {
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_CounterThread, &threads[i]) == 0);
+    }
+    
+    for (i = 0; i < TEST_COUNTER_THREADS; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+        TEST_CHECK(! threads[i].Failed);
+    }
+    
+    elapsed = Test_Ns() - start;
+    
+    // Nothing lost to the unlocked adds.
+    TEST_CHECK(Krn_CounterRead(KRN_COUNTER_TIMER_TICKS) ==
+               TEST_COUNTER_THREADS * TEST_COUNTER_OPS);
+    
+    printf("  threads %u x %u incs: ok\n",
+           TEST_COUNTER_THREADS,
+           TEST_COUNTER_OPS);
+    
+    if (Bench)
+    {
+        printf("  %.2f ns per inc\n",
+               (double) elapsed / ((double) TEST_COUNTER_THREADS * TEST_COUNTER_OPS));
+    }
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Counter(
+    int Bench
+    )
+{
+    if (Test_CounterBasic() ||
+        Test_CounterThreads(Bench))
+    {
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,333 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Epoch reclamation tests.  Threads stand in for CPUs, each with its own
+// KRN_CPU_DATA, and call the tick themselves.  Freed nodes are poisoned
+// rather than released, so a reader that could still see one notices.
+
+#include "test.h"
+
+#include <krn_cpu.h>
+#include <krn_epoch.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_EPOCH_LIVE         0x4C495645
+#define TEST_EPOCH_DEAD         0x44454144
+
+#define TEST_EPOCH_THREADS      4
+#define TEST_EPOCH_OPS          200000
+#define TEST_EPOCH_WRITES       16      // One op in this many is a write.
+#define TEST_EPOCH_TICK         64      // Ops between ticks.
+
+typedef struct _TEST_EPOCH_NODE
+{
+    KRN_DEFER_ENTRY Defer;
+    volatile uint32_t Magic;
+} TEST_EPOCH_NODE;
+
+typedef struct _TEST_EPOCH_THREAD
+{
+    pthread_t Thread;
+    KRN_CPU_DATA CpuData;
+    TEST_EPOCH_NODE* pNodes;
+    uint32_t WriteCount;
+    uint32_t Seed;
+    int Failed;
+} TEST_EPOCH_THREAD;
+
+TEST_EPOCH_NODE* volatile g_Test_EpochShared;
+volatile uint32_t g_Test_EpochFreed;
+
+extern __thread KRN_CPU_DATA* g_Test_pCpuData;
+
+void
+OSCALL
+Test_EpochFree(
+    KRN_DEFER_ENTRY* pEntry
+    );
+
+void
+OSCALL
+Test_EpochTickAll(
+    KRN_CPU_DATA** ppCpus,
+    uint32_t CpuCount
+    );
+
+int
+OSCALL
+Test_EpochBasic(
+    );
+
+void*
+Test_EpochThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_EpochThreads(
+    );
+
+void
+OSCALL
+Test_EpochFree(
+    KRN_DEFER_ENTRY* pEntry
+    )
+{
+    ((TEST_EPOCH_NODE*) pEntry)->Magic = TEST_EPOCH_DEAD;
+    __sync_fetch_and_add(&g_Test_EpochFreed, 1);
+}
+
+void
+OSCALL
+Test_EpochTickAll(
+    KRN_CPU_DATA** ppCpus,
+    uint32_t CpuCount
+    )
+{
+    KRN_CPU_DATA* pSaved;
+    uint32_t i;
+    
+    pSaved = g_Test_pCpuData;
+    
+    for (i = 0; i < CpuCount; i++)
+    {
+        g_Test_pCpuData = ppCpus[i];
+        Krn_EpochTick();
+    }
+    
+    g_Test_pCpuData = pSaved;
+}
+
+int
+OSCALL
+Test_EpochBasic(
+    )
+{
+    KRN_CPU_DATA cpus[2];
+    KRN_CPU_DATA* pCpus[2];
+    TEST_EPOCH_NODE nodes[2];
+    uint32_t i;
+    
+    memset(cpus, 0, sizeof(cpus));
+    pCpus[0] = &cpus[0];
+    pCpus[1] = &cpus[1];
+    
+    Krn_EpochInit();
+    g_Test_EpochFreed = 0;
+    
+    for (i = 0; i < 2; i++)
+    {
+        g_Test_pCpuData = pCpus[i];
+        TEST_CHECK(Krn_EpochCpuInit() == KRN_ERR_SUCCESS);
+    }
+    
+    // Freed on the deferring CPU's tick after the epoch has moved twice.
+    g_Test_pCpuData = pCpus[0];
+    nodes[0].Magic = TEST_EPOCH_LIVE;
+    Krn_DeferFree(&nodes[0].Defer, Test_EpochFree);
+    
+    Test_EpochTickAll(pCpus, 2);
+    TEST_CHECK(nodes[0].Magic == TEST_EPOCH_LIVE);
+    Test_EpochTickAll(pCpus, 1);
+    TEST_CHECK(nodes[0].Magic == TEST_EPOCH_DEAD);
+    
+    // A reader on the other CPU, nested, holds it up however many ticks.
+    g_Test_pCpuData = pCpus[1];
+    Krn_EpochEnter();
+    Krn_EpochEnter();
+    
+    g_Test_pCpuData = pCpus[0];
+    nodes[1].Magic = TEST_EPOCH_LIVE;
+    Krn_DeferFree(&nodes[1].Defer, Test_EpochFree);
+    
+    g_Test_pCpuData = pCpus[1];
+    Krn_EpochExit();
+    
+    for (i = 0; i < 10; i++)
+    {
+        Test_EpochTickAll(pCpus, 2);
+    }
+    TEST_CHECK(nodes[1].Magic == TEST_EPOCH_LIVE);
+    
+    Krn_EpochExit();
+    
+    for (i = 0; i < 3; i++)
+    {
+        Test_EpochTickAll(pCpus, 2);
+    }
+    TEST_CHECK(nodes[1].Magic == TEST_EPOCH_DEAD);
+    TEST_CHECK(g_Test_EpochFreed == 2);
+    
+    g_Test_pCpuData = NULL;
+    
+    printf("  basic: ok\n");
+    
+    return 0;
+}
+
+void*
+Test_EpochThread(
+    void* pContext
+    )
+{
+    TEST_EPOCH_THREAD* pThread;
+    TEST_EPOCH_NODE* pNode;
+    uint32_t seed;
+    uint32_t i;
+    uint32_t j;
+    
+    pThread = pContext;
+    g_Test_pCpuData = &pThread->CpuData;
+    
+    if (Krn_EpochCpuInit() != KRN_ERR_SUCCESS)
+    {
+        pThread->Failed = 1;
+        return NULL;
+    }
+    
+    seed = pThread->Seed;
+    
+    for (i = 0; (i < TEST_EPOCH_OPS) && (! pThread->Failed); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        
+        if (((seed >> 16) % TEST_EPOCH_WRITES) == 0)
+        {
+            // Swap in a new node, the old one may still be being read.
+            pNode = &pThread->pNodes[pThread->WriteCount++];
+            pNode->Magic = TEST_EPOCH_LIVE;
+            pNode = __sync_lock_test_and_set(&g_Test_EpochShared, pNode);
+            Krn_DeferFree(&pNode->Defer, Test_EpochFree);
+        }
+        else
+        {
+            Krn_EpochEnter();
+            
+            pNode = g_Test_EpochShared;
+            for (j = 0; j < 8; j++)
+            {
+                pThread->Failed |= pNode->Magic != TEST_EPOCH_LIVE;
+            }
+            
+            Krn_EpochExit();
+        }
+        
+        if ((i % TEST_EPOCH_TICK) == 0)
+        {
+            Krn_EpochTick();
+        }
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_EpochThreads(
+    )
+{
+    static TEST_EPOCH_THREAD threads[TEST_EPOCH_THREADS];
+    KRN_CPU_DATA* pCpus[TEST_EPOCH_THREADS];
+    TEST_EPOCH_NODE first;
+    uint32_t written;
+    uint32_t i;
+    
+    Krn_EpochInit();
+    g_Test_EpochFreed = 0;
+    
+    first.Magic = TEST_EPOCH_LIVE;
+    g_Test_EpochShared = &first;
+    
+    memset(threads, 0, sizeof(threads));
+    
+    for (i = 0; i < TEST_EPOCH_THREADS; i++)
+    {
+        // Enough nodes for every op to be a write.
+        threads[i].pNodes = calloc(TEST_EPOCH_OPS, sizeof(TEST_EPOCH_NODE));
+        TEST_CHECK(threads[i].pNodes != NULL);
+        threads[i].Seed = Test_Rand();
+        pCpus[i] = &threads[i].CpuData;
+    }
+    
+    for (i = 0; i < TEST_EPOCH_THREADS; i++)
+    {
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_EpochThread, &threads[i]) == 0);
+    }
+    
+    for (i = 0; i < TEST_EPOCH_THREADS; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+        TEST_CHECK(! threads[i].Failed);
+    }
+    
+    // With every CPU idle a few rounds of ticks free the rest.  Every write
+    // deferred one node, and only the one still published is live.
+    for (i = 0; i < 3; i++)
+    {
+        Test_EpochTickAll(pCpus, TEST_EPOCH_THREADS);
+    }
+    
+    written = 0;
+    for (i = 0; i < TEST_EPOCH_THREADS; i++)
+    {
+        TEST_CHECK(threads[i].CpuData.Epoch.PendingCount == 0);
+        written += threads[i].WriteCount;
+    }
+    
+    TEST_CHECK(g_Test_EpochFreed == written);
+    TEST_CHECK(g_Test_EpochShared->Magic == TEST_EPOCH_LIVE);
+    
+    for (i = 0; i < TEST_EPOCH_THREADS; i++)
+    {
+        free(threads[i].pNodes);
+    }
+    
+    printf("  threads %u x %u ops, %u deferred frees: ok\n",
+           TEST_EPOCH_THREADS,
+           TEST_EPOCH_OPS,
+           g_Test_EpochFreed);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Epoch(
+    int Bench
+    )
+{
+    if (Test_EpochBasic() ||
+        Test_EpochThreads())
+    {
+        return 1;
+    }
+    
+    return 0;
+}
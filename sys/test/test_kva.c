@@ -0,0 +1,662 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Kernel VA range allocator tests.  The HAL stubs back kernel VA with host
+// memory that only becomes accessible once mapped.
+
+#include "test.h"
+
+#include <hal_common.h>
+#include <krn_mem.h>
+#include <krn_kva.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_KVA_LENGTH         (256*1024*1024)
+#define TEST_KVA_PAGES          (TEST_KVA_LENGTH / MEM_PAGE_SIZE)
+#define TEST_KVA_MAX_RANGES     512
+#define TEST_KVA_CACHE_PAGES    16
+#define TEST_KVA_COMPACT_LARGE  32
+
+typedef struct _TEST_KVA_RANGE
+{
+    uintptr_t Va;
+    uint32_t PageCount;
+    uint32_t Flags;
+} TEST_KVA_RANGE;
+
+typedef struct _TEST_KVA_STATE
+{
+    HAL_BOOT_INFO BootInfo;
+    uintptr_t Base;
+    uint8_t* pOwned;            // One byte per VA page.
+    TEST_KVA_RANGE Ranges[TEST_KVA_MAX_RANGES];
+    uint32_t RangeCount;
+} TEST_KVA_STATE;
+
+TEST_KVA_STATE g_Test_Kva;
+
+int
+OSCALL
+Test_KvaInit(
+    uint64_t MemBytes
+    );
+
+void
+OSCALL
+Test_KvaDone(
+    );
+
+int
+OSCALL
+Test_KvaAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    int* pFailed
+    );
+
+int
+OSCALL
+Test_KvaFree(
+    uint32_t Index
+    );
+
+int
+OSCALL
+Test_KvaTouch(
+    uint32_t Index
+    );
+
+int
+OSCALL
+Test_KvaBestFit(
+    );
+
+int
+OSCALL
+Test_KvaFuzz(
+    uint32_t OpCount
+    );
+
+int
+OSCALL
+Test_KvaCompact(
+    uint64_t MemBytes,
+    uint32_t Flags
+    );
+
+int
+OSCALL
+Test_KvaColors(
+    );
+
+int
+OSCALL
+Test_KvaBench(
+    );
+
+int
+OSCALL
+Test_KvaInit(
+    uint64_t MemBytes
+    )
+{
+    TEST_KVA_STATE* pTest;
+    
+    pTest = &g_Test_Kva;
+    
+    memset(pTest, 0, sizeof(*pTest));
+    
+    TEST_CHECK(Test_MemInit(MemBytes) == 0);
+    
+    pTest->Base = (uintptr_t) Test_KvaReserve(TEST_KVA_LENGTH);
+    TEST_CHECK(pTest->Base != 0);
+    
+    pTest->pOwned = calloc(TEST_KVA_PAGES, 1);
+    TEST_CHECK(pTest->pOwned != NULL);
+    
+    pTest->BootInfo.KernelVaBase = pTest->Base;
+    pTest->BootInfo.KernelVaLength = TEST_KVA_LENGTH;
+    
+    TEST_CHECK(Mem_KvaInit(&pTest->BootInfo) == KRN_ERR_SUCCESS);
+    
+    return 0;
+}
+
+void
+OSCALL
+Test_KvaDone(
+    )
+{
+    free(g_Test_Kva.pOwned);
+    Test_KvaRelease();
+    Test_MemDone();
+}
+
+int
+OSCALL
+Test_KvaAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    int* pFailed
+    )
+{
+    TEST_KVA_STATE* pTest;
+    TEST_KVA_RANGE* pRange;
+    uint32_t page;
+    uintptr_t va;
+    uint32_t i;
+    
+    pTest = &g_Test_Kva;
+    *pFailed = 0;
+    
+    TEST_CHECK(pTest->RangeCount < TEST_KVA_MAX_RANGES);
+    
+    if (Mem_KvaAlloc(PageCount, Flags, &va) != KRN_ERR_SUCCESS)
+    {
+        TEST_CHECK(va == 0);
+        *pFailed = 1;
+        return 0;
+    }
+    
+    TEST_CHECK((va & (MEM_PAGE_SIZE - 1)) == 0);
+    TEST_CHECK(va >= pTest->Base);
+    TEST_CHECK(va + ((uintptr_t) PageCount << MEM_PAGE_SHIFT) <= pTest->Base + TEST_KVA_LENGTH);
+    
+    if (Flags & MEM_OPTS_LARGE_PAGE)
+    {
+        TEST_CHECK((va & (HAL_LARGE_PAGE_SIZE - 1)) == 0);
+    }
+    
+    page = (va - pTest->Base) >> MEM_PAGE_SHIFT;
+    for (i = 0; i < PageCount; i++)
+    {
+        TEST_CHECK(! pTest->pOwned[page + i]);
+        pTest->pOwned[page + i] = 1;
+        
+        // Only large pages are there before they are touched.
+        TEST_CHECK(Test_KvaIsMapped(va + ((uintptr_t) i << MEM_PAGE_SHIFT)) == !!(Flags & MEM_OPTS_LARGE_PAGE));
+    }
+    
+    pRange = &pTest->Ranges[pTest->RangeCount++];
+    pRange->Va = va;
+    pRange->PageCount = PageCount;
+    pRange->Flags = Flags;
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_KvaFree(
+    uint32_t Index
+    )
+{
+    TEST_KVA_STATE* pTest;
+    TEST_KVA_RANGE range;
+    uint32_t page;
+    uint32_t i;
+    
+    pTest = &g_Test_Kva;
+    range = pTest->Ranges[Index];
+    
+    TEST_CHECK(Mem_KvaFree(range.Va) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(range.Va) != KRN_ERR_SUCCESS);
+    
+    // Freed addresses are gone, and no longer fault in.
+    page = (range.Va - pTest->Base) >> MEM_PAGE_SHIFT;
+    for (i = 0; i < range.PageCount; i++)
+    {
+        TEST_CHECK(! Test_KvaIsMapped(range.Va + ((uintptr_t) i << MEM_PAGE_SHIFT)));
+        pTest->pOwned[page + i] = 0;
+    }
+    TEST_CHECK(Mem_KvaPageFault(range.Va) != KRN_ERR_SUCCESS);
+    
+    pTest->Ranges[Index] = pTest->Ranges[--pTest->RangeCount];
+    
+    return 0;
+}
+
+// Faults in a few pages of a range, checks they arrive zeroed, and dirties
+// them so reused physical pages would show.
+int
+OSCALL
+Test_KvaTouch(
+    uint32_t Index
+    )
+{
+    TEST_KVA_RANGE* pRange;
+    uint8_t* pPage;
+    uint32_t i;
+    uint32_t j;
+    
+    pRange = &g_Test_Kva.Ranges[Index];
+    
+    for (i = 0; i < 4; i++)
+    {
+        pPage = (uint8_t*) pRange->Va + ((uintptr_t) (Test_Rand() % pRange->PageCount) << MEM_PAGE_SHIFT);
+        
+        if (! Test_KvaIsMapped((uintptr_t) pPage))
+        {
+            TEST_CHECK(Mem_KvaPageFault((uintptr_t) pPage + 123) == KRN_ERR_SUCCESS);
+            TEST_CHECK(Test_KvaIsMapped((uintptr_t) pPage));
+            
+            for (j = 0; j < MEM_PAGE_SIZE; j++)
+            {
+                TEST_CHECK(pPage[j] == 0);
+            }
+        }
+        
+        memset(pPage, 0x5A, MEM_PAGE_SIZE);
+    }
+    
+    return 0;
+}
+
+// Holes of 16 and 32 pages, separated by live ranges.  Requests go to the
+// smallest hole that fits, not the first one.
+int
+OSCALL
+Test_KvaBestFit(
+    )
+{
+    uintptr_t va[6];
+    uintptr_t fit;
+    uint32_t i;
+    static const uint32_t sizes[6] = { 32, 1, 16, 1, 64, 1 };
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        TEST_CHECK(Mem_KvaAlloc(sizes[i], MEM_FLAGS_READ | MEM_FLAGS_WRITE, &va[i]) == KRN_ERR_SUCCESS);
+    }
+    
+    TEST_CHECK(Mem_KvaFree(va[0]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[2]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[4]) == KRN_ERR_SUCCESS);
+    
+    TEST_CHECK(Mem_KvaAlloc(10, MEM_FLAGS_READ, &fit) == KRN_ERR_SUCCESS);
+    TEST_CHECK(fit == va[2]);
+    TEST_CHECK(Mem_KvaAlloc(20, MEM_FLAGS_READ, &fit) == KRN_ERR_SUCCESS);
+    TEST_CHECK(fit == va[0]);
+    TEST_CHECK(Mem_KvaAlloc(33, MEM_FLAGS_READ, &fit) == KRN_ERR_SUCCESS);
+    TEST_CHECK(fit == va[4]);
+    
+    TEST_CHECK(Mem_KvaFree(va[2]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[0]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[4]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[1]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[3]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_KvaFree(va[5]) == KRN_ERR_SUCCESS);
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_KvaFuzz(
+    uint32_t OpCount
+    )
+{
+    TEST_KVA_STATE* pTest;
+    uint32_t freeBase;
+    uint32_t freeNow;
+    uint32_t pageCount;
+    uint32_t flags;
+    uint32_t failures;
+    uintptr_t va;
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Kva;
+    
+    TEST_CHECK(Test_KvaInit(512ULL << 20) == 0);
+    freeBase = Test_MemCountFree();
+    
+    TEST_CHECK(Test_KvaBestFit() == 0);
+    
+    failures = 0;
+    for (i = 0; i < OpCount; i++)
+    {
+        if ((pTest->RangeCount == TEST_KVA_MAX_RANGES) ||
+            ((pTest->RangeCount > 0) && (Test_Rand() & 1)))
+        {
+            TEST_CHECK(Test_KvaFree(Test_Rand() % pTest->RangeCount) == 0);
+            continue;
+        }
+        
+        flags = MEM_FLAGS_READ | MEM_FLAGS_WRITE;
+        if ((Test_Rand() % 16) == 0)
+        {
+            flags |= MEM_OPTS_LARGE_PAGE;
+            pageCount = MEM_LARGE_PAGE_COUNT * (1 + (Test_Rand() % 2));
+        }
+        else
+        {
+            pageCount = 1 + (Test_Rand() % ((Test_Rand() & 1) ? 16 : 2048));
+        }
+        
+        TEST_CHECK(Test_KvaAlloc(pageCount, flags, &failed) == 0);
+        failures += failed;
+        
+        if ((! failed) && (Test_Rand() & 1))
+        {
+            TEST_CHECK(Test_KvaTouch(pTest->RangeCount - 1) == 0);
+        }
+    }
+    
+    while (pTest->RangeCount > 0)
+    {
+        TEST_CHECK(Test_KvaFree(pTest->RangeCount - 1) == 0);
+    }
+    
+    // Everything coalesced back into one range behind the two pages kept for
+    // copies, and every page came back except for the slabs the range
+    // descriptor cache keeps.
+    TEST_CHECK(Mem_KvaAlloc(TEST_KVA_PAGES - 2, 0, &va) == KRN_ERR_SUCCESS);
+    TEST_CHECK(va == pTest->Base + 2 * MEM_PAGE_SIZE);
+    TEST_CHECK(Mem_KvaFree(va) == KRN_ERR_SUCCESS);
+    freeNow = Test_MemCountFree();
+    TEST_CHECK(freeNow <= freeBase);
+    TEST_CHECK(freeNow + TEST_KVA_CACHE_PAGES >= freeBase);
+    
+    printf("  fuzz %u ops, %u refused: ok\n", OpCount, failures);
+    
+    Test_KvaDone();
+    
+    return 0;
+}
+
+// 
+// Fills memory with touched single page ranges and frees seven in eight, so
+// no large page is free anywhere.  Compaction has to get them back out of
+// the holes, without disturbing the pages that are left.  Past 64 MB a scan
+// no longer covers a whole zone.  Pages of MEM_OPTS_COLOR ranges keep their
+// color when they move.  They were faulted in one color after another, so
+// they keep one in nine instead, or some colors would have no free page.
+// 
+int
+OSCALL
+Test_KvaCompact(
+    uint64_t MemBytes,
+    uint32_t Flags
+    )
+{
+    MEM_PAGE_STATS stats;
+    uintptr_t large[TEST_KVA_COMPACT_LARGE];
+    uintptr_t* pVas;
+    uintptr_t* pPas;
+    uintptr_t* pPage;
+    uint32_t freeBase;
+    uint32_t freeNow;
+    uint32_t count;
+    uint32_t live;
+    uint32_t moved;
+    uint32_t largeCount;
+    uint32_t mask;
+    uint32_t keep;
+    uint32_t i;
+    
+    TEST_CHECK(Test_KvaInit(MemBytes) == 0);
+    freeBase = Test_MemCountFree();
+    
+    Mem_PagesStatsGet(&stats);
+    mask = stats.ColorCount - 1;
+    keep = (Flags & MEM_OPTS_COLOR) ? 9 : 8;
+    
+    pVas = calloc(freeBase, sizeof(uintptr_t));
+    pPas = calloc(freeBase, sizeof(uintptr_t));
+    TEST_CHECK(pVas && pPas);
+    
+    // Reserve first, so the descriptor slabs don't pin every block.
+    count = 0;
+    while ((count < freeBase) &&
+           (Mem_KvaAlloc(1, MEM_FLAGS_READ | MEM_FLAGS_WRITE | Flags, &pVas[count]) == KRN_ERR_SUCCESS))
+    {
+        count++;
+    }
+    
+    // Each page says where it lives, at both ends.
+    live = 0;
+    for (i = 0; i < count; i++)
+    {
+        if ((live == i) &&
+            (Mem_KvaPageFault(pVas[i]) == KRN_ERR_SUCCESS))
+        {
+            pPage = (uintptr_t*) pVas[i];
+            pPage[0] = pVas[i];
+            pPage[MEM_PAGE_SIZE / sizeof(uintptr_t) - 1] = ~pVas[i];
+            pPas[i] = Test_KvaPa(pVas[i]);
+            live++;
+            continue;
+        }
+        
+        TEST_CHECK(Mem_KvaFree(pVas[i]) == KRN_ERR_SUCCESS);
+    }
+    
+    TEST_CHECK(Mem_PagesAlloc(1, 0, &large[0]) != KRN_ERR_SUCCESS);
+    
+    count = 0;
+    for (i = 0; i < live; i++)
+    {
+        if (i % keep)
+        {
+            TEST_CHECK(Mem_KvaFree(pVas[i]) == KRN_ERR_SUCCESS);
+            continue;
+        }
+        
+        pVas[count] = pVas[i];
+        pPas[count] = pPas[i];
+        count++;
+    }
+    live = count;
+    
+    // Idle time makes one large page, then has nothing more to do.
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.FreeBlocks[10] == 0);
+    
+    TEST_CHECK(Mem_PagesCompactIdle() > 0);
+    TEST_CHECK(Mem_PagesCompactIdle() == 0);
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.CompactCount == 1);
+    
+    // The rest come out of failed large page allocations.
+    freeNow = stats.FreePages;
+    largeCount = 0;
+    while ((largeCount < TEST_KVA_COMPACT_LARGE) &&
+           (Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT, MEM_OPTS_LARGE_PAGE, &large[largeCount]) == KRN_ERR_SUCCESS))
+    {
+        TEST_CHECK((large[largeCount] & (HAL_LARGE_PAGE_SIZE - 1)) == 0);
+        largeCount++;
+    }
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(largeCount >= (freeNow / MEM_LARGE_PAGE_COUNT) - 2);
+    TEST_CHECK(stats.CompactCount >= largeCount);
+    
+    // Nothing lost in the move, and fault free since they are still mapped.
+    moved = 0;
+    for (i = 0; i < live; i++)
+    {
+        pPage = (uintptr_t*) pVas[i];
+        
+        TEST_CHECK(Test_KvaIsMapped(pVas[i]));
+        TEST_CHECK(pPage[0] == pVas[i]);
+        TEST_CHECK(pPage[MEM_PAGE_SIZE / sizeof(uintptr_t) - 1] == ~pVas[i]);
+        
+        moved += (Test_KvaPa(pVas[i]) != pPas[i]);
+        
+        if (Flags & MEM_OPTS_COLOR)
+        {
+            TEST_CHECK(((Test_KvaPa(pVas[i]) ^ pPas[i]) >> MEM_PAGE_SHIFT & mask) == 0);
+        }
+    }
+    
+    TEST_CHECK(moved > 0);
+    TEST_CHECK(moved <= stats.CompactMovedPages);
+    
+    printf(
+            "  compaction%s: %u large pages out of %u scattered free pages, %u of %u pages moved: ok\n",
+            (Flags & MEM_OPTS_COLOR) ? ", colored" : "",
+            largeCount,
+            freeNow,
+            moved,
+            live);
+    
+    for (i = 0; i < largeCount; i++)
+    {
+        TEST_CHECK(Mem_PagesFree(large[i], MEM_LARGE_PAGE_COUNT) == KRN_ERR_SUCCESS);
+    }
+    
+    for (i = 0; i < live; i++)
+    {
+        TEST_CHECK(Mem_KvaFree(pVas[i]) == KRN_ERR_SUCCESS);
+    }
+    
+    // The descriptor cache keeps the slabs that held a range per page.  With
+    // the tree entries of a 64-bit host a descriptor takes 128 bytes, so a
+    // slab page holds 31.
+    freeNow = Test_MemCountFree();
+    TEST_CHECK(freeNow <= freeBase);
+    TEST_CHECK(freeNow + (freeBase / 31) + TEST_KVA_CACHE_PAGES >= freeBase);
+    
+    free(pVas);
+    free(pPas);
+    
+    Test_KvaDone();
+    
+    return 0;
+}
+
+// A colored range touched front to back gets one color after another.
+int
+OSCALL
+Test_KvaColors(
+    )
+{
+    MEM_PAGE_STATS stats;
+    uintptr_t va;
+    uint32_t mask;
+    uint32_t first;
+    uint32_t i;
+    
+    TEST_CHECK(Test_KvaInit(64ULL << 20) == 0);
+    
+    Mem_PagesStatsGet(&stats);
+    mask = stats.ColorCount - 1;
+    
+    TEST_CHECK(Mem_KvaAlloc(4 * stats.ColorCount, MEM_FLAGS_READ | MEM_FLAGS_WRITE | MEM_OPTS_COLOR, &va) == KRN_ERR_SUCCESS);
+    
+    for (i = 0; i < 4 * stats.ColorCount; i++)
+    {
+        TEST_CHECK(Mem_KvaPageFault(va + ((uintptr_t) i << MEM_PAGE_SHIFT)) == KRN_ERR_SUCCESS);
+    }
+    
+    first = (uint32_t) (Test_KvaPa(va) >> MEM_PAGE_SHIFT);
+    for (i = 0; i < 4 * stats.ColorCount; i++)
+    {
+        TEST_CHECK((((Test_KvaPa(va + ((uintptr_t) i << MEM_PAGE_SHIFT)) >> MEM_PAGE_SHIFT) - first) & mask) == (i & mask));
+    }
+    
+    TEST_CHECK(Mem_KvaFree(va) == KRN_ERR_SUCCESS);
+    
+    printf("  colors: %u pages in turn: ok\n", 4 * stats.ColorCount);
+    
+    Test_KvaDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_KvaBench(
+    )
+{
+    TEST_KVA_STATE* pTest;
+    uint64_t start;
+    uint64_t ns;
+    uint32_t index;
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Kva;
+    
+    TEST_CHECK(Test_KvaInit(512ULL << 20) == 0);
+    
+    // Steady state with a few hundred live ranges, reservations only.
+    while (pTest->RangeCount < TEST_KVA_MAX_RANGES / 2)
+    {
+        TEST_CHECK(Test_KvaAlloc(1 + (Test_Rand() % 64), MEM_FLAGS_READ, &failed) == 0);
+        TEST_CHECK(! failed);
+    }
+    
+    start = Test_Ns();
+    for (i = 0; i < 100000; i++)
+    {
+        index = Test_Rand() % pTest->RangeCount;
+        TEST_CHECK(Mem_KvaFree(pTest->Ranges[index].Va) == KRN_ERR_SUCCESS);
+        
+        pTest->Ranges[index].PageCount = 1 + (Test_Rand() % 64);
+        TEST_CHECK(Mem_KvaAlloc(pTest->Ranges[index].PageCount, MEM_FLAGS_READ, &pTest->Ranges[index].Va) == KRN_ERR_SUCCESS);
+    }
+    ns = Test_Ns() - start;
+    
+    printf("  %u live ranges: %u ns/op\n", pTest->RangeCount, (uint32_t) (ns / 200000));
+    
+    while (pTest->RangeCount > 0)
+    {
+        TEST_CHECK(Mem_KvaFree(pTest->Ranges[--pTest->RangeCount].Va) == KRN_ERR_SUCCESS);
+    }
+    
+    Test_KvaDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Kva(
+    int Bench
+    )
+{
+    if (Test_KvaFuzz(20000) ||
+        Test_KvaCompact(64ULL << 20, 0) ||
+        Test_KvaCompact(128ULL << 20, 0) ||
+        Test_KvaCompact(64ULL << 20, MEM_OPTS_COLOR) ||
+        Test_KvaColors())
+    {
+        return 1;
+    }
+    
+    if (Bench &&
+        Test_KvaBench())
+    {
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Host test harness.  Runs the kernel sources against reference models and
+// reports timings, so allocator changes can be judged before they boot.
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t g_Test_RandState = 0x9E3779B97F4A7C15ULL;
+
+void
+OSCALL
+Test_Fail(
+    const char* pExpr,
+    const char* pSourceFile,
+    int SourceLine
+    )
+{
+    printf("FAILED: %s (%s:%d)\n", pExpr, pSourceFile, SourceLine);
+}
+
+void
+OSCALL
+Test_Seed(
+    uint64_t Seed
+    )
+{
+    g_Test_RandState = Seed ? Seed : 1;
+}
+
+uint32_t
+OSCALL
+Test_Rand(
+    )
+{
+    // xorshift64*, repeatable for a given seed on every host.
+    g_Test_RandState ^= g_Test_RandState >> 12;
+    g_Test_RandState ^= g_Test_RandState << 25;
+    g_Test_RandState ^= g_Test_RandState >> 27;
+    
+    return (uint32_t) ((g_Test_RandState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+uint64_t
+OSCALL
+Test_Ns(
+    )
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+int
+main(
+    int argc,
+    char** argv
+    )
+{
+    int bench;
+    int failed;
+    int i;
+    
+    // -b also runs the benchmarks, -s <seed> changes the fuzz sequence.
+    bench = 0;
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-b") == 0)
+        {
+            bench = 1;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+        {
+            Test_Seed(strtoull(argv[++i], NULL, 0));
+        }
+    }
+    
+    failed = 0;
+    
+    Krn_BaseInit();
+    
+    printf("base:\n");
+    failed |= Test_Base(bench);
+    
+    printf("mem:\n");
+    failed |= Test_Mem(bench);
+    
+    printf("cache:\n");
+    failed |= Test_Cache(bench);
+    
+    printf("kva:\n");
+    failed |= Test_Kva(bench);
+    
+    printf("epoch:\n");
+    failed |= Test_Epoch(bench);
+    
+    printf("counter:\n");
+    failed |= Test_Counter(bench);
+    
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    
+    return failed;
+}
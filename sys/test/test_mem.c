@@ -0,0 +1,1351 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Physical page allocator fuzz and benchmark.
+//
+// Every allocation is checked against a page ownership model, and the page
+// contents are checked where the allocator promises something about them.
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "test.h"
+
+#include <hal_common.h>
+#include <krn_counter.h>
+#include <krn_cpu.h>
+#include <krn_mem.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Looks like a PC: low memory, a BIOS hole, and the image loaded at 1 MB.
+#define TEST_MEM_LOW_END        0x9F000
+#define TEST_MEM_BIOS_BASE      0xF0000
+#define TEST_MEM_HIGH_BASE      0x100000
+#define TEST_MEM_BOOT_END       0x200000
+#define TEST_MEM_MAPPED         (32*1024*1024)
+
+// Largest single request issued, in pages.
+#define TEST_MEM_MAX_REQUEST    1024
+
+// Pages the zero pool may be holding, see Mem_PagesZeroIdle.
+#define TEST_MEM_ZERO_POOL      64
+
+// Threads standing in for CPUs, and what each one keeps allocated.
+#define TEST_MEM_THREADS        4
+#define TEST_MEM_THREAD_ALLOCS  256
+
+typedef struct _TEST_MEM_ALLOC TEST_MEM_ALLOC;
+
+struct _TEST_MEM_ALLOC
+{
+    uintptr_t BasePa;
+    uint32_t PageCount;
+};
+
+typedef struct _TEST_MEM_STATE
+{
+    HAL_MEM_RANGE Ranges[4];
+    HAL_BOOT_INFO BootInfo;
+    uint8_t* pMapped;
+    
+    // One byte per page, non-zero while the test owns it.
+    uint8_t* pOwned;
+    uint32_t PageCount;
+    uint32_t OwnedPages;
+    
+    TEST_MEM_ALLOC* pAllocs;
+    uint32_t AllocCount;
+    uint32_t AllocMax;
+} TEST_MEM_STATE;
+
+typedef struct _TEST_MEM_THREAD
+{
+    pthread_t Thread;
+    KRN_CPU_DATA CpuData;
+    uint32_t OpCount;
+    uint32_t Seed;
+    int Failed;
+} TEST_MEM_THREAD;
+
+TEST_MEM_STATE g_Test_Mem;
+
+extern KRN_CPU_DATA g_Test_CpuData;
+extern __thread KRN_CPU_DATA* g_Test_pCpuData;
+
+uint32_t
+OSCALL
+Test_MemRequestSize(
+    uint32_t MaxPages
+    );
+
+int
+OSCALL
+Test_MemAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    int* pFailed
+    );
+
+int
+OSCALL
+Test_MemFree(
+    uint32_t Index
+    );
+
+uint32_t
+OSCALL
+Test_MemLargestFree(
+    );
+
+uint32_t
+OSCALL
+Test_MemFreeInRuns(
+    uint32_t RunPages
+    );
+
+int
+OSCALL
+Test_MemCheckStats(
+    );
+
+int
+OSCALL
+Test_MemLargePages(
+    );
+
+int
+OSCALL
+Test_MemZones(
+    );
+
+int
+OSCALL
+Test_MemSmallZones(
+    );
+
+int
+OSCALL
+Test_MemMagazineZones(
+    );
+
+int
+OSCALL
+Test_MemZeroPool(
+    );
+
+int
+OSCALL
+Test_MemExactRuns(
+    );
+
+int
+OSCALL
+Test_MemColors(
+    );
+
+int
+OSCALL
+Test_MemFuzz(
+    uint64_t MemBytes,
+    uint32_t OpCount
+    );
+
+void*
+Test_MemThread(
+    void* pContext
+    );
+
+int
+OSCALL
+Test_MemThreads(
+    uint64_t MemBytes,
+    uint32_t OpCount
+    );
+
+int
+OSCALL
+Test_MemBench(
+    uint64_t MemBytes,
+    uint32_t Occupancy
+    );
+
+int
+OSCALL
+Test_MemInit(
+    uint64_t MemBytes
+    )
+{
+    TEST_MEM_STATE* pTest;
+    void* pMapped;
+    
+    pTest = &g_Test_Mem;
+    
+    memset(pTest, 0, sizeof(*pTest));
+    memset(&g_Test_CpuData, 0, sizeof(g_Test_CpuData));
+    
+    // The allocator's statistics start from zero with each setup.
+    g_Test_pCpuData = NULL;
+    Krn_CounterInit();
+    TEST_CHECK(Krn_CounterCpuInit() == KRN_ERR_SUCCESS);
+    
+    if (posix_memalign(&pMapped, MEM_PAGE_SIZE, TEST_MEM_MAPPED) != 0)
+    {
+        return 1;
+    }
+    
+    pTest->pMapped = pMapped;
+    memset(pTest->pMapped, 0, TEST_MEM_MAPPED);
+    
+    pTest->Ranges[0].Base = 0;
+    pTest->Ranges[0].Length = TEST_MEM_LOW_END;
+    pTest->Ranges[0].Type = HAL_MEM_RANGE_AVAILABLE;
+    pTest->Ranges[1].Base = TEST_MEM_BIOS_BASE;
+    pTest->Ranges[1].Length = TEST_MEM_HIGH_BASE - TEST_MEM_BIOS_BASE;
+    pTest->Ranges[1].Type = HAL_MEM_RANGE_RESERVED;
+    pTest->Ranges[2].Base = TEST_MEM_HIGH_BASE;
+    pTest->Ranges[2].Length = MemBytes - TEST_MEM_HIGH_BASE;
+    pTest->Ranges[2].Type = HAL_MEM_RANGE_AVAILABLE;
+    pTest->Ranges[3].Base = 0;
+    pTest->Ranges[3].Length = TEST_MEM_BOOT_END;
+    pTest->Ranges[3].Type = HAL_MEM_RANGE_BOOT;
+    
+    pTest->BootInfo.pMemRanges = pTest->Ranges;
+    pTest->BootInfo.MemRangeCount = _countof(pTest->Ranges);
+    pTest->BootInfo.MappedBaseVa = (uintptr_t) pTest->pMapped;
+    pTest->BootInfo.MappedLength = TEST_MEM_MAPPED;
+    
+    pTest->PageCount = (uint32_t) (MemBytes >> MEM_PAGE_SHIFT);
+    pTest->pOwned = calloc(pTest->PageCount, 1);
+    pTest->AllocMax = pTest->PageCount;
+    pTest->pAllocs = calloc(pTest->AllocMax, sizeof(TEST_MEM_ALLOC));
+    
+    if ((! pTest->pOwned) || (! pTest->pAllocs))
+    {
+        return 1;
+    }
+    
+    return Mem_PagesInit(&pTest->BootInfo) != KRN_ERR_SUCCESS;
+}
+
+void
+OSCALL
+Test_MemDone(
+    )
+{
+    TEST_MEM_STATE* pTest;
+    
+    pTest = &g_Test_Mem;
+    
+    free(pTest->pAllocs);
+    free(pTest->pOwned);
+    free(pTest->pMapped);
+}
+
+uint32_t
+OSCALL
+Test_MemRequestSize(
+    uint32_t MaxPages
+    )
+{
+    uint32_t pick;
+    uint32_t size;
+    
+    // Mostly single pages, some small runs and the odd large one.
+    pick = Test_Rand() % 100;
+    if (pick < 70)
+    {
+        size = 1;
+    }
+    else if (pick < 90)
+    {
+        size = 2 + (Test_Rand() % 7);
+    }
+    else if (pick < 99)
+    {
+        size = 16 + (Test_Rand() % 49);
+    }
+    else
+    {
+        size = 1 + (Test_Rand() % TEST_MEM_MAX_REQUEST);
+    }
+    
+    return (size < MaxPages) ? size : MaxPages;
+}
+
+// Allocates and checks the result against the model.  A refused request
+// sets *pFailed and is not an error by itself.
+int
+OSCALL
+Test_MemAlloc(
+    uint32_t PageCount,
+    uint32_t Flags,
+    int* pFailed
+    )
+{
+    TEST_MEM_STATE* pTest;
+    uintptr_t pa;
+    uint32_t page;
+    uint32_t align;
+    uint8_t* pVa;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    *pFailed = 0;
+    
+    if (Mem_PagesAlloc(PageCount, Flags, &pa) != KRN_ERR_SUCCESS)
+    {
+        *pFailed = 1;
+        return 0;
+    }
+    
+    page = (uint32_t) (pa >> MEM_PAGE_SHIFT);
+    
+    TEST_CHECK((pa & (MEM_PAGE_SIZE - 1)) == 0);
+    TEST_CHECK(page + PageCount <= pTest->PageCount);
+    TEST_CHECK(pTest->AllocCount < pTest->AllocMax);
+    
+    // Nothing from the boot image or the BIOS hole.
+    TEST_CHECK(pa >= TEST_MEM_BOOT_END);
+    
+    // Runs start on a buddy block of the largest power of two in them.
+    for (align = 1; (align << 1) <= PageCount; align <<= 1)
+    {
+    }
+    TEST_CHECK((page & (align - 1)) == 0);
+    
+    for (i = 0; i < PageCount; i++)
+    {
+        TEST_CHECK(! pTest->pOwned[page + i]);
+        pTest->pOwned[page + i] = 1;
+    }
+    
+    if (Flags & MEM_OPTS_DMA)
+    {
+        TEST_CHECK(pa + (PageCount * MEM_PAGE_SIZE) <= MEM_ZONE_DMA_END);
+    }
+    
+    if (Flags & (MEM_OPTS_MAPPED | MEM_OPTS_ZERO))
+    {
+        TEST_CHECK(pa + (PageCount * MEM_PAGE_SIZE) <= TEST_MEM_MAPPED);
+        
+        pVa = Mem_PagesPaToVa(pa);
+        TEST_CHECK(pVa == pTest->pMapped + pa);
+        
+        if (Flags & MEM_OPTS_ZERO)
+        {
+            for (i = 0; i < PageCount * MEM_PAGE_SIZE; i++)
+            {
+                TEST_CHECK(pVa[i] == 0);
+            }
+        }
+        
+        // Dirty it, so a later ZERO request served by these pages means
+        // something.
+        memset(pVa, 0xA5, PageCount * MEM_PAGE_SIZE);
+    }
+    
+    pTest->pAllocs[pTest->AllocCount].BasePa = pa;
+    pTest->pAllocs[pTest->AllocCount].PageCount = PageCount;
+    pTest->AllocCount++;
+    pTest->OwnedPages += PageCount;
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_MemFree(
+    uint32_t Index
+    )
+{
+    TEST_MEM_STATE* pTest;
+    TEST_MEM_ALLOC alloc;
+    uint32_t page;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    alloc = pTest->pAllocs[Index];
+    page = (uint32_t) (alloc.BasePa >> MEM_PAGE_SHIFT);
+    
+    TEST_CHECK(Mem_PagesFree(alloc.BasePa, alloc.PageCount) == KRN_ERR_SUCCESS);
+    
+    // A second free of the same pages is refused.
+    TEST_CHECK(Mem_PagesFree(alloc.BasePa, alloc.PageCount) != KRN_ERR_SUCCESS);
+    
+    for (i = 0; i < alloc.PageCount; i++)
+    {
+        pTest->pOwned[page + i] = 0;
+    }
+    
+    pTest->OwnedPages -= alloc.PageCount;
+    pTest->pAllocs[Index] = pTest->pAllocs[--pTest->AllocCount];
+    
+    return 0;
+}
+
+// Counts by taking every free page, cached ones included, and giving them
+// back.  Ordinary requests stop at the lower zones' reserves and magazines,
+// the zones' own requests take the rest.
+uint32_t
+OSCALL
+Test_MemCountFree(
+    )
+{
+    static const uint32_t flags[] = { 0, MEM_OPTS_MAPPED, MEM_OPTS_DMA };
+    uintptr_t* pPages;
+    uint32_t count;
+    uint32_t i;
+    
+    pPages = malloc(g_Test_Mem.PageCount * sizeof(uintptr_t));
+    if (! pPages)
+    {
+        return 0;
+    }
+    
+    count = 0;
+    for (i = 0; i < _countof(flags); i++)
+    {
+        while (Mem_PagesAlloc(1, flags[i], &pPages[count]) == KRN_ERR_SUCCESS)
+        {
+            count++;
+        }
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        Mem_PagesFree(pPages[i], 1);
+    }
+    
+    free(pPages);
+    
+    return count;
+}
+
+// The largest power of two run that can still be allocated.
+uint32_t
+OSCALL
+Test_MemLargestFree(
+    )
+{
+    uintptr_t pa;
+    uint32_t pages;
+    
+    for (pages = 1U << 20; pages > 1; pages >>= 1)
+    {
+        if (Mem_PagesAlloc(pages, 0, &pa) == KRN_ERR_SUCCESS)
+        {
+            Mem_PagesFree(pa, pages);
+            return pages;
+        }
+    }
+    
+    return (Mem_PagesAlloc(1, 0, &pa) == KRN_ERR_SUCCESS) &&
+           (Mem_PagesFree(pa, 1) == KRN_ERR_SUCCESS);
+}
+
+// Free pages that can still be allocated as runs of RunPages.
+uint32_t
+OSCALL
+Test_MemFreeInRuns(
+    uint32_t RunPages
+    )
+{
+    uintptr_t* pRuns;
+    uint32_t count;
+    uint32_t i;
+    
+    pRuns = malloc((g_Test_Mem.PageCount / RunPages + 1) * sizeof(uintptr_t));
+    if (! pRuns)
+    {
+        return 0;
+    }
+    
+    count = 0;
+    while (Mem_PagesAlloc(RunPages, 0, &pRuns[count]) == KRN_ERR_SUCCESS)
+    {
+        count++;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        Mem_PagesFree(pRuns[i], RunPages);
+    }
+    
+    free(pRuns);
+    
+    return count * RunPages;
+}
+
+// The free blocks by order cover exactly the free pages.
+int
+OSCALL
+Test_MemCheckStats(
+    )
+{
+    MEM_PAGE_STATS stats;
+    uint64_t pages;
+    uint32_t total;
+    uint32_t i;
+    
+    Mem_PagesStatsGet(&stats);
+    
+    TEST_CHECK(stats.PageCount == g_Test_Mem.PageCount);
+    TEST_CHECK(stats.OrderCount <= MEM_PAGE_STATS_ORDERS);
+    
+    // Two bits a page across all levels, plus headers, summaries and a
+    // cache line of padding per level of each zone.
+    TEST_CHECK(stats.BuddyBytes <= (stats.PageCount / 4) + (MEM_ZONE_COUNT * stats.OrderCount * (sizeof(void*) * 16 + 64)) + (stats.PageCount / 128));
+    
+    // Zones are contiguous and split the free pages between them.
+    pages = 0;
+    total = 0;
+    for (i = 0; i < MEM_ZONE_COUNT; i++)
+    {
+        TEST_CHECK(stats.Zones[i].BasePage == total);
+        TEST_CHECK(stats.Zones[i].FreePages <= stats.Zones[i].PageCount);
+        pages += stats.Zones[i].FreePages;
+        total += stats.Zones[i].PageCount;
+    }
+    TEST_CHECK(total == stats.PageCount);
+    TEST_CHECK(pages == stats.FreePages);
+    
+    pages = 0;
+    for (i = 0; i < stats.OrderCount; i++)
+    {
+        pages += (uint64_t) stats.FreeBlocks[i] << i;
+    }
+    TEST_CHECK(pages == stats.FreePages);
+    
+    if (stats.FreePages)
+    {
+        TEST_CHECK(stats.FreeBlocks[stats.LargestFreeOrder] > 0);
+    }
+    
+    total = 0;
+    for (i = 0; i < MEM_PAGE_STATS_LATENCY; i++)
+    {
+        total += stats.AllocLatency[i];
+    }
+    TEST_CHECK(total == stats.AllocCount);
+    
+    return 0;
+}
+
+// Small machines still get large pages out of their top buddy level.
+int
+OSCALL
+Test_MemLargePages(
+    )
+{
+    uintptr_t pa[3];
+    uintptr_t single;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    TEST_CHECK(Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT - 1, MEM_OPTS_LARGE_PAGE, &pa[0]) == KRN_ERR_INV_PARAMETER);
+    
+    TEST_CHECK(Mem_PagesAlloc(1, 0, &single) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT, MEM_OPTS_LARGE_PAGE, &pa[0]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT, MEM_OPTS_LARGE_PAGE, &pa[1]) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesAlloc(MEM_LARGE_PAGE_COUNT, MEM_OPTS_LARGE_PAGE | MEM_OPTS_MAPPED, &pa[2]) == KRN_ERR_SUCCESS);
+    
+    TEST_CHECK((pa[0] & (HAL_LARGE_PAGE_SIZE - 1)) == 0);
+    TEST_CHECK((pa[1] & (HAL_LARGE_PAGE_SIZE - 1)) == 0);
+    TEST_CHECK((pa[2] & (HAL_LARGE_PAGE_SIZE - 1)) == 0);
+    TEST_CHECK(pa[2] + HAL_LARGE_PAGE_SIZE <= TEST_MEM_MAPPED);
+    
+    TEST_CHECK(Mem_PagesFree(pa[0], MEM_LARGE_PAGE_COUNT) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesFree(pa[1], MEM_LARGE_PAGE_COUNT) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesFree(pa[2], MEM_LARGE_PAGE_COUNT) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesFree(single, 1) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  large pages: ok\n");
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// Ordinary pages come from the top, and running them out still leaves the
+// lower zones' reserves for requests that need them.
+int
+OSCALL
+Test_MemZones(
+    )
+{
+    TEST_MEM_STATE* pTest;
+    MEM_PAGE_STATS stats;
+    uint32_t ordinary;
+    int failed;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.Zones[MEM_ZONE_DMA].PageCount == (MEM_ZONE_DMA_END >> MEM_PAGE_SHIFT));
+    TEST_CHECK(stats.Zones[MEM_ZONE_LOW].BasePage == (MEM_ZONE_DMA_END >> MEM_PAGE_SHIFT));
+    TEST_CHECK(stats.Zones[MEM_ZONE_HIGH].BasePage == (TEST_MEM_MAPPED >> MEM_PAGE_SHIFT));
+    
+    TEST_CHECK(Test_MemAlloc(1, 0, &failed) == 0);
+    TEST_CHECK(! failed);
+    TEST_CHECK(pTest->pAllocs[0].BasePa >= TEST_MEM_MAPPED);
+    
+    do
+    {
+        TEST_CHECK(Test_MemAlloc(1, 0, &failed) == 0);
+    } while (! failed);
+    ordinary = pTest->AllocCount;
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.Zones[MEM_ZONE_HIGH].FreePages == 0);
+    TEST_CHECK(stats.Zones[MEM_ZONE_LOW].FreePages >= stats.Zones[MEM_ZONE_LOW].ReservePages);
+    TEST_CHECK(stats.Zones[MEM_ZONE_DMA].FreePages >= stats.Zones[MEM_ZONE_DMA].ReservePages);
+    TEST_CHECK(stats.Zones[MEM_ZONE_LOW].ReservePages > 0);
+    
+    // A low page freed now sits in this CPU's low magazine, which has to
+    // honor the reserve just like the buddy lists, colored or not.
+    TEST_CHECK(Test_MemAlloc(1, MEM_OPTS_MAPPED, &failed) == 0);
+    TEST_CHECK(! failed);
+    TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    TEST_CHECK(Test_MemAlloc(1, 0, &failed) == 0);
+    TEST_CHECK(failed);
+    TEST_CHECK(Test_MemAlloc(1, MEM_OPTS_COLOR, &failed) == 0);
+    TEST_CHECK(failed);
+    
+    // Ordinary requests were refused, the reserves still serve these.
+    TEST_CHECK(Test_MemAlloc(8, MEM_OPTS_MAPPED, &failed) == 0);
+    TEST_CHECK(! failed);
+    TEST_CHECK(pTest->pAllocs[ordinary].BasePa >= MEM_ZONE_DMA_END);
+    
+    TEST_CHECK(Test_MemAlloc(8, MEM_OPTS_DMA, &failed) == 0);
+    TEST_CHECK(! failed);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  zones: %u ordinary pages before the reserves: ok\n", ordinary);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// A machine just over 16 MB keeps its few pages above 16 MB out of the DMA
+// zone, so DMA requests never get them.
+int
+OSCALL
+Test_MemSmallZones(
+    )
+{
+    TEST_MEM_STATE* pTest;
+    MEM_PAGE_STATS stats;
+    uint32_t i;
+    int failed;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(18ULL << 20) == 0);
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.Zones[MEM_ZONE_DMA].PageCount == (MEM_ZONE_DMA_END >> MEM_PAGE_SHIFT));
+    TEST_CHECK(stats.Zones[MEM_ZONE_LOW].PageCount == ((2 << 20) >> MEM_PAGE_SHIFT));
+    
+    do
+    {
+        TEST_CHECK(Test_MemAlloc(1 + (Test_Rand() & 7), MEM_OPTS_DMA, &failed) == 0);
+    } while (! failed);
+    
+    for (i = 0; i < pTest->AllocCount; i++)
+    {
+        TEST_CHECK(pTest->pAllocs[i].BasePa + pTest->pAllocs[i].PageCount * MEM_PAGE_SIZE <= MEM_ZONE_DMA_END);
+    }
+    
+    // The pages above 16 MB still serve everything else.
+    TEST_CHECK(Test_MemAlloc(1, 0, &failed) == 0);
+    TEST_CHECK(! failed);
+    TEST_CHECK(pTest->pAllocs[pTest->AllocCount - 1].BasePa >= MEM_ZONE_DMA_END);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  small zones: ok\n");
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// Single pages freed from the DMA and low zones pass through this CPU's
+// magazines, ordinary requests must still never get them back.
+int
+OSCALL
+Test_MemMagazineZones(
+    )
+{
+    TEST_MEM_STATE* pTest;
+    uint32_t i;
+    int failed;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    for (i = 0; i < 4 * MEM_PAGE_MAGAZINE_SIZE; i++)
+    {
+        TEST_CHECK(Test_MemAlloc(1, (i & 1) ? MEM_OPTS_DMA : MEM_OPTS_MAPPED, &failed) == 0);
+        TEST_CHECK(! failed);
+        TEST_CHECK(pTest->pAllocs[pTest->AllocCount - 1].BasePa < TEST_MEM_MAPPED);
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+        
+        TEST_CHECK(Test_MemAlloc(1, 0, &failed) == 0);
+        TEST_CHECK(! failed);
+        TEST_CHECK(pTest->pAllocs[pTest->AllocCount - 1].BasePa >= TEST_MEM_MAPPED);
+    }
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  magazine zones: ok\n");
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// A full zero pool is still free memory: single pages of any kind come out
+// of it once the buddy lists run dry, and larger requests get it drained.
+int
+OSCALL
+Test_MemZeroPool(
+    )
+{
+    static const uint32_t flags[] = { 0, MEM_OPTS_MAPPED, MEM_OPTS_DMA };
+    TEST_MEM_STATE* pTest;
+    MEM_PAGE_STATS stats;
+    uint32_t freeBase;
+    uint32_t allocCount;
+    uint32_t i;
+    int failed;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    freeBase = Test_MemCountFree();
+    Mem_PagesStatsGet(&stats);
+    allocCount = stats.AllocCount;
+    
+    // Filling the pool is the allocator's own business, not an allocation.
+    while (Mem_PagesZeroIdle() > 0)
+    {
+    }
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.ZeroPoolPages == TEST_MEM_ZERO_POOL);
+    TEST_CHECK(stats.AllocCount == allocCount);
+    
+    for (i = 0; i < _countof(flags); i++)
+    {
+        do
+        {
+            TEST_CHECK(Test_MemAlloc(1, flags[i], &failed) == 0);
+        } while (! failed);
+    }
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.ZeroPoolPages == 0);
+    TEST_CHECK(pTest->OwnedPages == freeBase);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    
+    while (Mem_PagesZeroIdle() > 0)
+    {
+    }
+    
+    do
+    {
+        TEST_CHECK(Test_MemAlloc(2, MEM_OPTS_MAPPED, &failed) == 0);
+    } while (! failed);
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.ZeroPoolPages == 0);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    
+    TEST_CHECK(Test_MemCountFree() == freeBase);
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  zero pool: ok\n");
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// A run that is not a power of two only needs its own pages free, not the
+// whole block covering it.
+int
+OSCALL
+Test_MemExactRuns(
+    )
+{
+    static const uint32_t flags[] = { MEM_OPTS_DMA, MEM_OPTS_MAPPED, 0 };
+    TEST_MEM_STATE* pTest;
+    MEM_PAGE_STATS stats;
+    uintptr_t base;
+    uintptr_t pa;
+    uint32_t size;
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    // Take everything, largest runs first.  Each zone is drained by the
+    // requests it serves first, so the reserves go too.
+    for (size = MEM_LARGE_PAGE_COUNT; size > 0; size >>= 1)
+    {
+        for (i = 0; i < _countof(flags); i++)
+        {
+            do
+            {
+                TEST_CHECK(Test_MemAlloc(size, flags[i], &failed) == 0);
+            } while (! failed);
+        }
+    }
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.FreePages == 0);
+    
+    // Hand back the first 9 pages of a large DMA run, no 16 page block is
+    // free anywhere.
+    for (i = 0; pTest->pAllocs[i].PageCount != MEM_LARGE_PAGE_COUNT; i++)
+    {
+    }
+    base = pTest->pAllocs[i].BasePa;
+    TEST_CHECK(Mem_PagesFree(base, 9) == KRN_ERR_SUCCESS);
+    
+    TEST_CHECK(base + MEM_LARGE_PAGE_COUNT * MEM_PAGE_SIZE <= MEM_ZONE_DMA_END);
+    TEST_CHECK(Mem_PagesAlloc(10, MEM_OPTS_DMA, &pa) == KRN_ERR_NOT_ENOUGH_MEM);
+    TEST_CHECK(Mem_PagesAlloc(9, MEM_OPTS_DMA, &pa) == KRN_ERR_SUCCESS);
+    TEST_CHECK(pa == base);
+    
+    // Only the 9 pages are taken, 3 of them can come back on their own.
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.FreePages == 0);
+    TEST_CHECK(Mem_PagesFree(base + 6 * MEM_PAGE_SIZE, 3) == KRN_ERR_SUCCESS);
+    TEST_CHECK(Mem_PagesAlloc(3, MEM_OPTS_DMA, &pa) == KRN_ERR_SUCCESS);
+    TEST_CHECK(pa == base + 6 * MEM_PAGE_SIZE);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  exact runs: ok\n");
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// Colored pages cycle through every color, whatever order the magazine and
+// the buddy lists would hand pages out in.
+int
+OSCALL
+Test_MemColors(
+    )
+{
+    TEST_MEM_STATE* pTest;
+    MEM_PAGE_STATS stats;
+    uint32_t colors;
+    uint32_t first;
+    uint32_t page;
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(64ULL << 20) == 0);
+    
+    Mem_PagesStatsGet(&stats);
+    colors = stats.ColorCount;
+    TEST_CHECK(colors == 32);
+    
+    // Scatter what is free, so plain allocations would not cycle.
+    for (i = 0; i < 1024; i++)
+    {
+        TEST_CHECK(Test_MemAlloc(Test_MemRequestSize(8), 0, &failed) == 0);
+        TEST_CHECK(! failed);
+    }
+    for (i = pTest->AllocCount; i > 0; i--)
+    {
+        if (i & 1)
+        {
+            TEST_CHECK(Test_MemFree(i - 1) == 0);
+        }
+    }
+    
+    first = pTest->AllocCount;
+    for (i = 0; i < colors * 16; i++)
+    {
+        TEST_CHECK(Test_MemAlloc(1, (i & 1) ? MEM_OPTS_COLOR : MEM_OPTS_COLOR | MEM_OPTS_MAPPED, &failed) == 0);
+        TEST_CHECK(! failed);
+        
+        // This CPU's colors start from 0 after Test_MemInit.
+        page = (uint32_t) (pTest->pAllocs[first + i].BasePa >> MEM_PAGE_SHIFT);
+        TEST_CHECK((page & (colors - 1)) == (i & (colors - 1)));
+    }
+    
+    Mem_PagesStatsGet(&stats);
+    TEST_CHECK(stats.ColorMissCount == 0);
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  colors: %u, %u pages in turn: ok\n", colors, colors * 16);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_MemFuzz(
+    uint64_t MemBytes,
+    uint32_t OpCount
+    )
+{
+    static const uint32_t flags[] =
+    {
+        0,
+        MEM_OPTS_MAPPED,
+        MEM_OPTS_ZERO,
+        MEM_OPTS_SYS_CRITICAL,
+        MEM_OPTS_DMA,
+        MEM_OPTS_COLOR
+    };
+    TEST_MEM_STATE* pTest;
+    uint32_t freeBase;
+    uint32_t freeNow;
+    uint32_t pageCount;
+    uint32_t flag;
+    uint32_t failures;
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(MemBytes) == 0);
+    
+    freeBase = Test_MemCountFree();
+    TEST_CHECK(freeBase > 0);
+    
+    failures = 0;
+    for (i = 0; i < OpCount; i++)
+    {
+        if ((pTest->AllocCount > 0) &&
+            ((Test_Rand() & 1) || (pTest->OwnedPages > (freeBase / 4) * 3)))
+        {
+            TEST_CHECK(Test_MemFree(Test_Rand() % pTest->AllocCount) == 0);
+            continue;
+        }
+        
+        flag = flags[Test_Rand() % _countof(flags)];
+        pageCount = Test_MemRequestSize(TEST_MEM_MAX_REQUEST);
+        
+        // Keep mapped and DMA requests small, there is only so much boot
+        // mapping and DMA zone.
+        if (flag & (MEM_OPTS_MAPPED | MEM_OPTS_ZERO | MEM_OPTS_DMA))
+        {
+            pageCount = (pageCount > 8) ? 8 : pageCount;
+        }
+        
+        TEST_CHECK(Test_MemAlloc(pageCount, flag, &failed) == 0);
+        
+        // With a quarter of memory still free a single page is always
+        // available.
+        if ((failed) && (pageCount == 1) && (flag == 0))
+        {
+            TEST_CHECK(pTest->OwnedPages < freeBase);
+        }
+        failures += failed;
+        
+        if ((i % 64) == 0)
+        {
+            Mem_PagesZeroIdle();
+        }
+        
+        if ((i % 4096) == 0)
+        {
+            TEST_CHECK(Test_MemCheckStats() == 0);
+        }
+    }
+    
+    while (pTest->AllocCount > 0)
+    {
+        TEST_CHECK(Test_MemFree(pTest->AllocCount - 1) == 0);
+    }
+    
+    // Everything handed back can be taken again, less the zero pool.
+    freeNow = Test_MemCountFree();
+    TEST_CHECK(freeNow <= freeBase);
+    TEST_CHECK(freeNow + TEST_MEM_ZERO_POOL >= freeBase);
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  fuzz %4u MB, %u ops, %u refused: ok\n",
+           (uint32_t) (MemBytes >> 20),
+           OpCount,
+           failures);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+// One CPU's worth of allocations.  Ownership is claimed in the shared model
+// with atomics, so two threads given the same page is caught.
+void*
+Test_MemThread(
+    void* pContext
+    )
+{
+    TEST_MEM_THREAD* pThread;
+    TEST_MEM_ALLOC allocs[TEST_MEM_THREAD_ALLOCS];
+    uint32_t allocCount;
+    uint32_t index;
+    uint32_t seed;
+    uint32_t page;
+    uint32_t i;
+    uint32_t j;
+    
+    pThread = pContext;
+    g_Test_pCpuData = &pThread->CpuData;
+    
+    // Counted in the totals along with the main thread.
+    if (Krn_CounterCpuInit() != KRN_ERR_SUCCESS)
+    {
+        pThread->Failed = 1;
+        return NULL;
+    }
+    
+    allocCount = 0;
+    seed = pThread->Seed;
+    
+    for (i = 0; (i < pThread->OpCount) && (! pThread->Failed); i++)
+    {
+        // Test_Rand is not thread safe, this is a plain LCG per thread.
+        seed = seed * 1103515245 + 12345;
+        
+        if ((allocCount == TEST_MEM_THREAD_ALLOCS) ||
+            ((allocCount > 0) && (seed & 0x10000)))
+        {
+            index = (seed >> 17) % allocCount;
+            page = (uint32_t) (allocs[index].BasePa >> MEM_PAGE_SHIFT);
+            
+            for (j = 0; j < allocs[index].PageCount; j++)
+            {
+                __sync_lock_release(&g_Test_Mem.pOwned[page + j]);
+            }
+            
+            if (Mem_PagesFree(allocs[index].BasePa, allocs[index].PageCount) != KRN_ERR_SUCCESS)
+            {
+                pThread->Failed = 1;
+            }
+            
+            allocs[index] = allocs[--allocCount];
+            continue;
+        }
+        
+        allocs[allocCount].PageCount = ((seed >> 17) & 3) ? 1 : 1 + ((seed >> 19) & 15);
+        if (Mem_PagesAlloc(allocs[allocCount].PageCount, 0, &allocs[allocCount].BasePa) != KRN_ERR_SUCCESS)
+        {
+            continue;
+        }
+        
+        page = (uint32_t) (allocs[allocCount].BasePa >> MEM_PAGE_SHIFT);
+        for (j = 0; j < allocs[allocCount].PageCount; j++)
+        {
+            if (__sync_lock_test_and_set(&g_Test_Mem.pOwned[page + j], 1))
+            {
+                printf("FAILED: page %u handed out twice\n", page + j);
+                pThread->Failed = 1;
+            }
+        }
+        
+        allocCount++;
+    }
+    
+    while (allocCount > 0)
+    {
+        allocCount--;
+        page = (uint32_t) (allocs[allocCount].BasePa >> MEM_PAGE_SHIFT);
+        
+        for (j = 0; j < allocs[allocCount].PageCount; j++)
+        {
+            __sync_lock_release(&g_Test_Mem.pOwned[page + j]);
+        }
+        
+        Mem_PagesFree(allocs[allocCount].BasePa, allocs[allocCount].PageCount);
+    }
+    
+    return NULL;
+}
+
+int
+OSCALL
+Test_MemThreads(
+    uint64_t MemBytes,
+    uint32_t OpCount
+    )
+{
+    // Static, the counters keep pointing at the CPU data until the next
+    // Test_MemInit.
+    static TEST_MEM_THREAD threads[TEST_MEM_THREADS];
+    uint64_t start;
+    uint64_t ns;
+    uint32_t i;
+    
+    TEST_CHECK(Test_MemInit(MemBytes) == 0);
+    
+    memset(threads, 0, sizeof(threads));
+    
+    start = Test_Ns();
+    for (i = 0; i < TEST_MEM_THREADS; i++)
+    {
+        threads[i].OpCount = OpCount;
+        threads[i].Seed = Test_Rand();
+        TEST_CHECK(pthread_create(&threads[i].Thread, NULL, Test_MemThread, &threads[i]) == 0);
+    }
+    
+    for (i = 0; i < TEST_MEM_THREADS; i++)
+    {
+        pthread_join(threads[i].Thread, NULL);
+        TEST_CHECK(! threads[i].Failed);
+    }
+    ns = Test_Ns() - start;
+    
+    TEST_CHECK(Test_MemCheckStats() == 0);
+    
+    printf("  threads %4u MB, %u x %u ops, %u ns/op wall: ok\n",
+           (uint32_t) (MemBytes >> 20),
+           TEST_MEM_THREADS,
+           OpCount,
+           (uint32_t) (ns / ((uint64_t) TEST_MEM_THREADS * OpCount)));
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_MemBench(
+    uint64_t MemBytes,
+    uint32_t Occupancy
+    )
+{
+    TEST_MEM_STATE* pTest;
+    uint32_t freeBase;
+    uint32_t target;
+    uint32_t maxPages;
+    uint32_t largest;
+    uint32_t inRuns;
+    uint32_t freeNow;
+    uint32_t failures;
+    uint32_t phase;
+    uint64_t start;
+    uint64_t ns[2];
+    int failed;
+    uint32_t i;
+    
+    pTest = &g_Test_Mem;
+    
+    TEST_CHECK(Test_MemInit(MemBytes) == 0);
+    
+    freeBase = Test_MemCountFree();
+    target = (uint32_t) (((uint64_t) freeBase * Occupancy) / 100);
+    
+    // Fill to the occupancy with the mixed request sizes.
+    failures = 0;
+    while (pTest->OwnedPages < target)
+    {
+        TEST_CHECK(Test_MemAlloc(Test_MemRequestSize(target - pTest->OwnedPages), 0, &failed) == 0);
+        if (failed)
+        {
+            break;
+        }
+    }
+    
+    // Steady state, each iteration is one free and one allocation.  Phase 0
+    // uses single pages only, phase 1 the mixed sizes.
+    for (phase = 0; phase < 2; phase++)
+    {
+        maxPages = phase ? TEST_MEM_MAX_REQUEST : 1;
+        
+        start = Test_Ns();
+        for (i = 0; i < 100000; i++)
+        {
+            if (pTest->AllocCount > 0)
+            {
+                TEST_CHECK(Test_MemFree(Test_Rand() % pTest->AllocCount) == 0);
+            }
+            
+            TEST_CHECK(Test_MemAlloc(Test_MemRequestSize(maxPages), 0, &failed) == 0);
+            failures += failed;
+        }
+        ns[phase] = Test_Ns() - start;
+    }
+    
+    // Fragmentation is the share of free memory that cannot be had as
+    // 64 page runs.
+    largest = Test_MemLargestFree();
+    inRuns = Test_MemFreeInRuns(64);
+    freeNow = freeBase - pTest->OwnedPages;
+    
+    // Each iteration checks the model and frees twice, so these are upper
+    // bounds on the allocator's own cost.
+    printf("  %4u MB %2u%% used: 1 page %4u ns/op, mixed %4u ns/op, "
+           "largest run %5u pages, fragmentation %3u%%, %u refused\n",
+           (uint32_t) (MemBytes >> 20),
+           Occupancy,
+           (uint32_t) (ns[0] / 200000),
+           (uint32_t) (ns[1] / 200000),
+           largest,
+           freeNow ? 100 - (uint32_t) (((uint64_t) inRuns * 100) / freeNow) : 0,
+           failures);
+    
+    Test_MemDone();
+    
+    return 0;
+}
+
+int
+OSCALL
+Test_Mem(
+    int Bench
+    )
+{
+    static const uint64_t sizes[] =
+    {
+        64ULL << 20,
+        512ULL << 20,
+        3ULL << 30
+    };
+    static const uint32_t occupancy[] = { 25, 50, 90 };
+    uint32_t i;
+    uint32_t j;
+    
+    if (Test_MemLargePages())
+    {
+        return 1;
+    }
+    
+    if (Test_MemZones())
+    {
+        return 1;
+    }
+    
+    if (Test_MemSmallZones())
+    {
+        return 1;
+    }
+    
+    if (Test_MemMagazineZones())
+    {
+        return 1;
+    }
+    
+    if (Test_MemZeroPool())
+    {
+        return 1;
+    }
+    
+    if (Test_MemExactRuns())
+    {
+        return 1;
+    }
+    
+    if (Test_MemColors())
+    {
+        return 1;
+    }
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        if (Test_MemFuzz(sizes[i], 200000))
+        {
+            return 1;
+        }
+    }
+    
+    if (Test_MemThreads(sizes[1], 200000))
+    {
+        return 1;
+    }
+    
+    if (! Bench)
+    {
+        return 0;
+    }
+    
+    for (i = 0; i < _countof(sizes); i++)
+    {
+        for (j = 0; j < _countof(occupancy); j++)
+        {
+            if (Test_MemBench(sizes[i], occupancy[j]))
+            {
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,397 @@
+/*
+Copyright (c) 2016, Jonathan Ward
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// HAL and kernel services the kernel sources expect, backed by the host.
+
+#define _GNU_SOURCE
+
+#include "test.h"
+
+#include <hal_common.h>
+#include <krn_cpu.h>
+
+#include <krn_mem.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+KRN_CPU_DATA g_Test_CpuData;
+
+// Threads standing in for other CPUs point this at their own data.
+__thread KRN_CPU_DATA* g_Test_pCpuData;
+
+KRN_CPU_DATA*
+OSCALL
+Hal_GetCpuData(
+    )
+{
+    return g_Test_pCpuData ? g_Test_pCpuData : &g_Test_CpuData;
+}
+
+// Interrupt flag of the CPU each thread stands in for, for lock tests.
+__thread uint32_t g_Test_IntEnabled = 1;
+
+uint32_t
+OSCALL
+Hal_InterruptsDisable(
+    )
+{
+    uint32_t state;
+    
+    state = g_Test_IntEnabled;
+    g_Test_IntEnabled = 0;
+    
+    return state;
+}
+
+void
+OSCALL
+Hal_InterruptsRestore(
+    uint32_t State
+    )
+{
+    g_Test_IntEnabled = State;
+}
+
+// One entry per page of the reserved VA, the PA plus these flags.
+#define TEST_KVA_PRESENT        0x1
+#define TEST_KVA_LARGE          0x2
+
+// Physical memory behind kernel VA mappings, sparse, one byte per byte of PA.
+#define TEST_KVA_PHYS_LENGTH    (4ULL << 30)
+
+uint8_t* g_Test_pKva;
+size_t g_Test_KvaLength;
+uintptr_t* g_Test_pKvaPtes;
+int g_Test_KvaPhys = -1;
+
+uintptr_t*
+OSCALL
+Test_KvaPte(
+    uintptr_t Va,
+    size_t Length
+    );
+
+KRN_ERROR_CODE
+OSCALL
+Test_KvaMap(
+    uintptr_t Va,
+    uintptr_t Pa,
+    size_t Length
+    );
+
+void
+OSCALL
+Test_KvaUnmap(
+    uintptr_t Va,
+    size_t Length
+    );
+
+void*
+OSCALL
+Test_KvaReserve(
+    size_t Length
+    )
+{
+    uint8_t* pBase;
+    
+    // Over reserve so the range can start on a large page boundary.
+    pBase = mmap(NULL, Length + HAL_LARGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pBase == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    g_Test_pKva = (uint8_t*) (((uintptr_t) pBase + HAL_LARGE_PAGE_SIZE - 1) & ~(uintptr_t) (HAL_LARGE_PAGE_SIZE - 1));
+    g_Test_KvaLength = Length;
+    g_Test_pKvaPtes = calloc(Length >> MEM_PAGE_SHIFT, sizeof(uintptr_t));
+    
+    // Mapping the same PA twice shows the same bytes, as it would for real.
+    g_Test_KvaPhys = memfd_create("test_phys", 0);
+    if ((g_Test_KvaPhys < 0) ||
+        (ftruncate(g_Test_KvaPhys, TEST_KVA_PHYS_LENGTH) != 0))
+    {
+        return NULL;
+    }
+    
+    return g_Test_pKva;
+}
+
+void
+OSCALL
+Test_KvaRelease(
+    )
+{
+    munmap(g_Test_pKva, g_Test_KvaLength);
+    free(g_Test_pKvaPtes);
+    close(g_Test_KvaPhys);
+    g_Test_pKva = NULL;
+    g_Test_pKvaPtes = NULL;
+    g_Test_KvaPhys = -1;
+}
+
+int
+OSCALL
+Test_KvaIsMapped(
+    uintptr_t Va
+    )
+{
+    return g_Test_pKvaPtes[(Va - (uintptr_t) g_Test_pKva) >> MEM_PAGE_SHIFT] & TEST_KVA_PRESENT;
+}
+
+uintptr_t
+OSCALL
+Test_KvaPa(
+    uintptr_t Va
+    )
+{
+    return *Test_KvaPte(Va, MEM_PAGE_SIZE) & ~(uintptr_t) (MEM_PAGE_SIZE - 1);
+}
+
+KRN_ERROR_CODE
+OSCALL
+Test_KvaMap(
+    uintptr_t Va,
+    uintptr_t Pa,
+    size_t Length
+    )
+{
+    if (mmap((void*) Va, Length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, g_Test_KvaPhys, Pa) == MAP_FAILED)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+void
+OSCALL
+Test_KvaUnmap(
+    uintptr_t Va,
+    size_t Length
+    )
+{
+    mmap((void*) Va, Length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+uintptr_t*
+OSCALL
+Test_KvaPte(
+    uintptr_t Va,
+    size_t Length
+    )
+{
+    if ((Va < (uintptr_t) g_Test_pKva) ||
+        (Va + Length > (uintptr_t) g_Test_pKva + g_Test_KvaLength))
+    {
+        printf("HAL stub: %lx is not kernel VA\n", (unsigned long) Va);
+        abort();
+    }
+    
+    return &g_Test_pKvaPtes[(Va - (uintptr_t) g_Test_pKva) >> MEM_PAGE_SHIFT];
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_MapPage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    )
+{
+    uintptr_t* pPte;
+    
+    pPte = Test_KvaPte(Va, MEM_PAGE_SIZE);
+    if (*pPte & TEST_KVA_PRESENT)
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    if (Test_KvaMap(Va, Pa, MEM_PAGE_SIZE) != KRN_ERR_SUCCESS)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    *pPte = Pa | TEST_KVA_PRESENT;
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapPage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    )
+{
+    uintptr_t* pPte;
+    
+    pPte = Test_KvaPte(Va, MEM_PAGE_SIZE);
+    if ((*pPte & (TEST_KVA_PRESENT | TEST_KVA_LARGE)) != TEST_KVA_PRESENT)
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    *pPa = *pPte & ~(uintptr_t) (MEM_PAGE_SIZE - 1);
+    *pPte = 0;
+    Test_KvaUnmap(Va, MEM_PAGE_SIZE);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_MapLargePage(
+    uintptr_t Va,
+    uintptr_t Pa,
+    uint32_t Flags
+    )
+{
+    uintptr_t* pPte;
+    uint32_t i;
+    
+    if ((Va & (HAL_LARGE_PAGE_SIZE - 1)) ||
+        (Pa & (HAL_LARGE_PAGE_SIZE - 1)))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPte = Test_KvaPte(Va, HAL_LARGE_PAGE_SIZE);
+    for (i = 0; i < MEM_LARGE_PAGE_COUNT; i++)
+    {
+        if (pPte[i] & TEST_KVA_PRESENT)
+        {
+            return KRN_ERR_INV_PARAMETER;
+        }
+    }
+    
+    if (Test_KvaMap(Va, Pa, HAL_LARGE_PAGE_SIZE) != KRN_ERR_SUCCESS)
+    {
+        return KRN_ERR_NOT_ENOUGH_MEM;
+    }
+    
+    for (i = 0; i < MEM_LARGE_PAGE_COUNT; i++)
+    {
+        pPte[i] = (Pa + i * MEM_PAGE_SIZE) | TEST_KVA_PRESENT | TEST_KVA_LARGE;
+    }
+    
+    return KRN_ERR_SUCCESS;
+}
+
+KRN_ERROR_CODE
+OSCALL
+Hal_UnmapLargePage(
+    uintptr_t Va,
+    uintptr_t* pPa
+    )
+{
+    uintptr_t* pPte;
+    
+    if (Va & (HAL_LARGE_PAGE_SIZE - 1))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    pPte = Test_KvaPte(Va, HAL_LARGE_PAGE_SIZE);
+    if ((pPte[0] & (TEST_KVA_PRESENT | TEST_KVA_LARGE)) != (TEST_KVA_PRESENT | TEST_KVA_LARGE))
+    {
+        return KRN_ERR_INV_PARAMETER;
+    }
+    
+    *pPa = pPte[0] & ~(uintptr_t) (MEM_PAGE_SIZE - 1);
+    memset(pPte, 0, MEM_LARGE_PAGE_COUNT * sizeof(uintptr_t));
+    Test_KvaUnmap(Va, HAL_LARGE_PAGE_SIZE);
+    
+    return KRN_ERR_SUCCESS;
+}
+
+// Threads standing in for CPUs share one page table and have no TLBs.
+uint32_t
+OSCALL
+Hal_CpuCount(
+    )
+{
+    return 1;
+}
+
+uint32_t
+OSCALL
+Hal_CpuFeaturesGet(
+    )
+{
+    return __builtin_cpu_supports("sse2") ? HAL_CPU_FEATURE_NT_STORE : 0;
+}
+
+// A typical desktop L2, 32 page colors.
+void
+OSCALL
+Hal_CacheInfoGet(
+    HAL_CACHE_INFO* pInfo
+    )
+{
+    pInfo->Size = 2 * 1024 * 1024;
+    pInfo->Ways = 16;
+    pInfo->LineSize = 64;
+}
+
+uint64_t
+OSCALL
+Hal_TimestampGet(
+    )
+{
+    return __builtin_ia32_rdtsc();
+}
+
+int
+OSCALL
+Hal_conprintf(
+    const char* pFormat,
+    ...
+    )
+{
+    va_list args;
+    int ret;
+    
+    va_start(args, pFormat);
+    ret = vprintf(pFormat, args);
+    va_end(args);
+    
+    return ret;
+}
+
+void
+OSCALL
+Krn_ErrFunc(
+    uint32_t ErrorCode,
+    const char* pSourceFile,
+    int SourceLine,
+    const void* pParam
+    )
+{
+    printf("Krn_Err 0x%08x at %s:%d\n", ErrorCode, pSourceFile, SourceLine);
+    abort();
+}